@@ -0,0 +1,92 @@
+#include "batch.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "error.h"
+#include "infer.h"
+#include "parser.h"
+
+typedef struct {
+    const char *const *sources;
+    char **types;
+    unsigned int count;
+    atomic_uint next;  // Index of the next source to be taken
+    atomic_uint failures;
+} Batch;
+
+static void *check_worker(void *data) {
+    Batch *batch = data;
+    InferContext *ctx = new_infer_context();
+    TypeEnv *env = init_standard_type_env(ctx);
+    TypeMark standard_types = type_arena_mark(ctx);
+
+    // Sources are handed out one at a time, so a slow one holds up only the
+    // thread checking it
+    for (;;) {
+        unsigned int i = atomic_fetch_add(&batch->next, 1);
+        if (i >= batch->count) {
+            break;
+        }
+        const char *source = batch->sources[i];
+        Error error;
+        Exp *exp = parse(source, &error);
+        if (exp == NULL) {
+            batch->types[i] = error_to_string(&error, source);
+            atomic_fetch_add(&batch->failures, 1);
+            continue;
+        }
+        Type *type = infer(ctx, exp, env, &error);
+        if (type != NULL) {
+            batch->types[i] = type_to_string(type);
+        } else {
+            batch->types[i] = error_to_string(&error, source);
+            atomic_fetch_add(&batch->failures, 1);
+        }
+        type_arena_release(ctx, standard_types);
+        free_exp(exp);
+    }
+
+    free_type_env(env);
+    free_infer_context(ctx);
+    return NULL;
+}
+
+unsigned int check_batch(const char *const *sources, unsigned int count,
+                         char **types, unsigned int num_threads) {
+    Batch batch;
+    batch.sources = sources;
+    batch.types = types;
+    batch.count = count;
+    atomic_init(&batch.next, 0);
+    atomic_init(&batch.failures, 0);
+
+    if (num_threads > count) {
+        num_threads = count;
+    }
+    if (num_threads <= 1) {
+        check_worker(&batch);
+        return atomic_load(&batch.failures);
+    }
+
+    // The calling thread is one of the workers
+    pthread_t *threads = malloc((num_threads - 1) * sizeof(pthread_t));
+    if (threads == NULL) {
+        fprintf(stderr, "Fatal: failed to allocate threads.\n");
+        exit(1);
+    }
+    for (unsigned int i = 0; i < num_threads - 1; i++) {
+        if (pthread_create(&threads[i], NULL, check_worker, &batch) != 0) {
+            fprintf(stderr, "Fatal: failed to start a checker thread.\n");
+            exit(1);
+        }
+    }
+    check_worker(&batch);
+    for (unsigned int i = 0; i < num_threads - 1; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    return atomic_load(&batch.failures);
+}
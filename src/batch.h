@@ -0,0 +1,9 @@
+#pragma once
+
+// Type-check independent programs on num_threads threads, each with its own
+// inference context and standard type environment. types[i] is set to the
+// printed type of sources[i], or to its error as printed by error_to_string()
+// if it does not check, to be freed by the caller. Returns the number of
+// sources that did not check.
+unsigned int check_batch(const char *const *sources, unsigned int count,
+                         char **types, unsigned int num_threads);
@@ -0,0 +1,76 @@
+// Lexer throughput with each scanner the CPU supports, on a generated
+// source shaped like machine-written programs: deep indentation, long
+// names and comments.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lexer.h"
+#include "scan.h"
+
+#define SOURCE_SIZE (32u << 20)
+#define RUNS 5
+
+static char *generate_source(unsigned int size) {
+    char *source = malloc(size);
+    if (source == NULL) {
+        fprintf(stderr, "Fatal: failed to allocate the source.\n");
+        exit(1);
+    }
+    unsigned int length = 0;
+    unsigned int line = 0;
+    while (length + 256 < size) {
+        unsigned int indent = 4 * (line % 24);
+        memset(source + length, ' ', indent);
+        length += indent;
+        int written;
+        if (line % 8 == 0) {
+            written = sprintf(source + length,
+                              "# step %u of the generated pipeline\n", line);
+        } else {
+            written = sprintf(source + length,
+                              "let intermediate_value_%u = \\accumulator_%u."
+                              "add accumulator_%u %u in\n",
+                              line, line, line, line);
+        }
+        length += (unsigned int)written;
+        line++;
+    }
+    memset(source + length, ' ', size - length);
+    return source;
+}
+
+static double seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+int main(void) {
+    char *source = generate_source(SOURCE_SIZE);
+    static const char *names[] = {"scalar", "SSE2", "AVX2"};
+    for (ScanLevel level = SCAN_SCALAR; level <= best_scan_level(); level++) {
+        set_scan_level(level);
+        double best = 0;
+        unsigned long tokens = 0;
+        for (int run = 0; run < RUNS; run++) {
+            double start = seconds();
+            Lexer lexer;
+            lexer_init(&lexer, source, SOURCE_SIZE, 0);
+            tokens = 1;
+            while (lexer.current.type != TOKEN_EOF) {
+                lexer_next(&lexer);
+                tokens++;
+            }
+            double elapsed = seconds() - start;
+            if (run == 0 || elapsed < best) {
+                best = elapsed;
+            }
+        }
+        printf("%-6s %8.1f MB/s  (%lu tokens)\n", names[level],
+               SOURCE_SIZE / best / 1e6, tokens);
+    }
+    free(source);
+    return 0;
+}
@@ -0,0 +1,252 @@
+#include "cek.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gc.h"
+#include "primitives.h"
+
+// What to do with the value of the expression being evaluated
+typedef struct {
+    enum {
+        K_ARG,   // The function of an application: evaluate the argument
+        K_CALL,  // The argument of an application: call the function
+        K_LET,   // The bound value of a let: evaluate the body
+        K_PRIM   // An argument of a primitive: evaluate the next or apply it
+    } kind;
+    union {
+        struct {
+            Exp *exp;  // The application
+            Env *env;
+        } arg;  // K_ARG
+        struct {
+            Value fn;
+            Exp *exp;  // The application, for where an error is
+        } call;        // K_CALL
+        struct {
+            Exp *exp;
+            Env *env;
+        } let;  // K_LET
+        struct {
+            Exp *exp;
+            Env *env;
+            Value first;        // Once the second argument is being evaluated
+            unsigned int next;  // Index of the argument being evaluated
+        } prim;                 // K_PRIM
+    } data;
+} Kont;
+
+typedef struct {
+    Kont *frames;
+    unsigned int size;
+    unsigned int capacity;
+} KontStack;
+
+static void push(KontStack *ks, Kont k) {
+    if (ks->size == ks->capacity) {
+        ks->capacity *= 2;
+        ks->frames = realloc(ks->frames, ks->capacity * sizeof(Kont));
+        if (ks->frames == NULL) {
+            fprintf(stderr, "Fatal: continuation stack exhausted\n");
+            exit(1);
+        }
+    }
+    ks->frames[ks->size++] = k;
+}
+
+static void trace_konts(void *data) {
+    KontStack *ks = data;
+    for (unsigned int i = 0; i < ks->size; i++) {
+        Kont *k = &ks->frames[i];
+        switch (k->kind) {
+            case K_ARG:
+                gc_mark_env(k->data.arg.env);
+                break;
+            case K_CALL:
+                gc_mark_value(k->data.call.fn);
+                break;
+            case K_LET:
+                gc_mark_env(k->data.let.env);
+                break;
+            case K_PRIM:
+                gc_mark_env(k->data.prim.env);
+                if (k->data.prim.next > 0) {
+                    gc_mark_value(k->data.prim.first);
+                }
+                break;
+        }
+    }
+}
+
+static Value run_cek(Exp *exp, Env *env, KontStack *ks) {
+    Value val = val_unit();
+
+    // The continuations and the registers are all the machine holds
+    unsigned int saved_roots = gc_save_roots();
+    gc_push_tracer(trace_konts, ks);
+    gc_root_env(&env);
+    gc_root_value(&val);
+
+    for (;;) {
+        // Descend into exp until it yields a value
+        while (exp != NULL) {
+            switch (exp->type) {
+                case EXP_UNIT:
+                    val = val_unit();
+                    break;
+                case EXP_INT:
+                    val = val_int(exp->data.int_val);
+                    break;
+                case EXP_BOOL:
+                    val = val_bool(exp->data.bool_val);
+                    break;
+
+                case EXP_VAR:
+                    switch (exp->data.var.ref.scope) {
+                        case VAR_LOCAL:
+                            val = env->slots[exp->data.var.ref.index];
+                            break;
+                        case VAR_FREE:
+                            val = env->closure
+                                      ->captured[exp->data.var.ref.index];
+                            break;
+                        case VAR_GLOBAL:
+                            val = env->globals[exp->data.var.ref.index];
+                            break;
+                    }
+                    break;
+
+                case EXP_LAMBDA:
+                    val = close_over(exp, env);
+                    break;
+
+                case EXP_APPLY:
+                    push(ks, (Kont){K_ARG, .data.arg = {exp, env}});
+                    exp = apply_fn(exp);
+                    continue;
+
+                case EXP_LET:
+                    push(ks, (Kont){K_LET, .data.let = {exp, env}});
+                    exp = let_value(exp);
+                    continue;
+
+                case EXP_PRIM:
+                    push(ks, (Kont){K_PRIM, .data.prim = {exp, env,
+                                                           val_unit(), 0}});
+                    exp = prim_arg(exp, 0);
+                    continue;
+            }
+            exp = NULL;
+        }
+
+        // Hand the value to the innermost continuation
+        if (ks->size == 0) {
+            gc_restore_roots(saved_roots);
+            return val;
+        }
+        Kont *top = &ks->frames[ks->size - 1];
+        switch (top->kind) {
+            case K_ARG: {
+                // What is called is checked once the argument is known
+                Exp *apply = top->data.arg.exp;
+                exp = apply_arg(apply);
+                env = top->data.arg.env;
+                top->kind = K_CALL;
+                top->data.call.fn = val;
+                top->data.call.exp = apply;
+                break;
+            }
+
+            case K_CALL: {
+                // The function stays on the stack, and so reachable, until
+                // the frame for the call has been allocated
+                Value fn = top->data.call.fn;
+                if (!is_closure(fn)) {
+                    // Anything but a primitive is an error here
+                    val = apply_primitive(fn, val, top->data.call.exp->offset);
+                    ks->size--;
+                    break;
+                }
+
+                Exp *lambda = as_closure(fn)->lambda;
+                Env *frame = new_frame(lambda->data.lambda.frame_size,
+                                       as_closure(fn), env->globals);
+                frame->slots[0] = val;
+                ks->size--;
+                // Calls in tail position leave nothing behind on the stack;
+                // the caller's frame is collected once no continuation
+                // refers to it
+                exp = lambda_body(lambda);
+                env = frame;
+                break;
+            }
+
+            case K_LET: {
+                Exp *let = top->data.let.exp;
+                env = top->data.let.env;
+                ks->size--;
+                env->slots[let->data.let.slot] = val;
+
+                // Point recursive captures at the new closure, as in eval()
+                Exp *e1 = let_value(let);
+                if (e1->type == EXP_LAMBDA && is_closure(val)) {
+                    for (unsigned int i = 0;
+                         i < e1->data.lambda.num_captures; i++) {
+                        VarRef ref = e1->data.lambda.captures[i];
+                        if (ref.scope == VAR_LOCAL &&
+                            ref.index == let->data.let.slot) {
+                            as_closure(val)->captured[i] = val;
+                        }
+                    }
+                }
+                exp = let_body(let);
+                break;
+            }
+
+            case K_PRIM: {
+                Exp *prim = top->data.prim.exp;
+                PrimitiveOp op = prim->data.prim.op;
+                if (op == PRIM_IF) {
+                    // Continue with the branch taken, in tail position
+                    if (!is_bool(val)) {
+                        runtime_error(prim->offset,
+                                      "if expects a boolean condition");
+                    }
+                    env = top->data.prim.env;
+                    ks->size--;
+                    exp = prim_arg(prim, as_bool(val) ? 1 : 2);
+                } else if (op == PRIM_SUCC) {
+                    ks->size--;
+                    val = prim_succ(val, prim->offset);
+                } else if (top->data.prim.next == 0) {
+                    top->data.prim.first = val;
+                    top->data.prim.next = 1;
+                    env = top->data.prim.env;
+                    exp = prim_arg(prim, 1);
+                } else {
+                    ks->size--;
+                    val = prim_binary(op, top->data.prim.first, val,
+                                      prim->offset);
+                }
+                break;
+            }
+        }
+    }
+}
+
+Value eval_cek(Exp *exp, Env *env) {
+    // A runtime error unwinds past the machine, so frees its continuations
+    // on the way
+    KontStack ks = {malloc(64 * sizeof(Kont)), 0, 64};
+    RuntimeHandler handler;
+    push_runtime_handler(&handler);
+    if (setjmp(handler.jump) != 0) {
+        free(ks.frames);
+        forward_runtime_error(&handler);
+    }
+    Value val = run_cek(exp, env, &ks);
+    pop_runtime_handler(&handler);
+    free(ks.frames);
+    return val;
+}
@@ -0,0 +1,9 @@
+#pragma once
+#include "lambda.h"
+
+// Evaluate a resolved expression like eval(), as a machine of closures,
+// environments and continuations. Pending work is kept on a heap-allocated
+// continuation stack instead of the C stack, so nesting and recursion depth
+// are limited only by memory. Calls in tail position do not grow the
+// continuation stack.
+Value eval_cek(Exp *exp, Env *env);
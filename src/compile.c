@@ -0,0 +1,313 @@
+#include "compile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    Program *program;
+    Code *code;
+    unsigned int depth;  // Operand stack depth at the current instruction
+} Compiler;
+
+static void *grow(void *array, unsigned int *capacity, size_t size) {
+    *capacity = *capacity == 0 ? 16 : *capacity * 2;
+    void *p = realloc(array, *capacity * size);
+    if (p == NULL) {
+        fprintf(stderr, "Fatal: failed to grow bytecode buffer.\n");
+        exit(1);
+    }
+    return p;
+}
+
+static void emit(Compiler *c, unsigned int word) {
+    Code *code = c->code;
+    if (code->length == code->capacity) {
+        unsigned int capacity = code->capacity;
+        code->ops = grow(code->ops, &code->capacity, sizeof(unsigned int));
+        code->offsets = grow(code->offsets, &capacity, sizeof(unsigned int));
+    }
+    code->offsets[code->length] = NO_POSITION;
+    code->ops[code->length++] = word;
+}
+
+// Emit an opcode for exp and track its effect on the operand stack depth
+static void emit_op(Compiler *c, Exp *exp, OpCode op, int effect) {
+    emit(c, op);
+    c->code->offsets[c->code->length - 1] = exp->offset;
+    c->depth = (unsigned int)((int)c->depth + effect);
+    if (c->depth > c->code->max_stack) {
+        c->code->max_stack = c->depth;
+    }
+}
+
+static unsigned int add_constant(Compiler *c, Value value) {
+    Program *p = c->program;
+    if (p->num_constants == p->constants_capacity) {
+        p->constants =
+            grow(p->constants, &p->constants_capacity, sizeof(Value));
+    }
+    p->constants[p->num_constants] = value;
+    return p->num_constants++;
+}
+
+static Code *new_code(Program *p, Exp *lambda, unsigned int frame_size) {
+    Code *code = calloc(1, sizeof(Code));
+    code->frame_size = frame_size;
+    code->lambda = lambda;
+    if (p->num_codes == p->codes_capacity) {
+        p->codes = grow(p->codes, &p->codes_capacity, sizeof(Code *));
+    }
+    p->codes[p->num_codes++] = code;
+    return code;
+}
+
+// An expression compile_exp() is inside of, with its children compiled
+// so far
+typedef struct {
+    Exp *exp;
+    unsigned int state;
+    bool tail;
+    unsigned int patch;  // Jump of an if to fill in, or index of a lambda
+    Code *code;          // Of the function around a lambda
+    unsigned int depth;  // Of the operand stack there
+} CompileFrame;
+
+typedef struct {
+    CompileFrame *frames;
+    unsigned int size;
+    unsigned int capacity;
+} CompileStack;
+
+static void push_compile(CompileStack *stack, Exp *exp, bool tail) {
+    if (stack->size == stack->capacity) {
+        stack->frames =
+            grow(stack->frames, &stack->capacity, sizeof(CompileFrame));
+    }
+    stack->frames[stack->size++] =
+        (CompileFrame){exp, 0, tail, 0, NULL, 0};
+}
+
+// Emit the code of a node without children, or of a let or a primitive
+// call up to its first child
+static void compile_leaf(Compiler *c, Exp *exp) {
+    switch (exp->type) {
+        case EXP_UNIT:
+            emit_op(c, exp, OP_CONST, 1);
+            emit(c, add_constant(c, val_unit()));
+            break;
+        case EXP_INT:
+            emit_op(c, exp, OP_CONST, 1);
+            emit(c, add_constant(c, val_int(exp->data.int_val)));
+            break;
+        case EXP_BOOL:
+            emit_op(c, exp, OP_CONST, 1);
+            emit(c, add_constant(c, val_bool(exp->data.bool_val)));
+            break;
+
+        case EXP_VAR:
+            switch (exp->data.var.ref.scope) {
+                case VAR_LOCAL:
+                    emit_op(c, exp, OP_LOCAL, 1);
+                    break;
+                case VAR_FREE:
+                    emit_op(c, exp, OP_FREE, 1);
+                    break;
+                case VAR_GLOBAL:
+                    emit_op(c, exp, OP_GLOBAL, 1);
+                    break;
+            }
+            emit(c, exp->data.var.ref.index);
+            break;
+
+        default:
+            break;
+    }
+}
+
+// Store the value of a let, now on the stack, in its slot
+static void compile_store(Compiler *c, Exp *exp) {
+    Exp *e1 = let_value(exp);
+    if (e1->type == EXP_LAMBDA) {
+        // Recursive references were captured before the slot was filled
+        // in, see the EXP_LET case of eval()
+        for (unsigned int i = 0; i < e1->data.lambda.num_captures; i++) {
+            VarRef ref = e1->data.lambda.captures[i];
+            if (ref.scope == VAR_LOCAL && ref.index == exp->data.let.slot) {
+                emit_op(c, exp, OP_FIX, 0);
+                emit(c, i);
+            }
+        }
+    }
+    emit_op(c, exp, OP_STORE, -1);
+    emit(c, exp->data.let.slot);
+}
+
+// Emit the instruction of a primitive call whose arguments are on the stack
+static void compile_primitive(Compiler *c, Exp *exp) {
+    switch (exp->data.prim.op) {
+        case PRIM_SUCC:
+            emit_op(c, exp, OP_SUCC, 0);
+            break;
+        case PRIM_ADD:
+            emit_op(c, exp, OP_ADD, -1);
+            break;
+        case PRIM_SUBTRACT:
+            emit_op(c, exp, OP_SUBTRACT, -1);
+            break;
+        case PRIM_MULTIPLY:
+            emit_op(c, exp, OP_MULTIPLY, -1);
+            break;
+        case PRIM_EQUALS:
+            emit_op(c, exp, OP_EQUALS, -1);
+            break;
+        case PRIM_IF:
+            break;
+    }
+}
+
+// The expressions being compiled are kept on a stack of their own, so a
+// tree of any depth can be compiled. A lambda switches c to the code of its
+// body until the body is done.
+static void compile_exp(Compiler *c, Exp *exp, bool tail) {
+    CompileStack stack = {NULL, 0, 0};
+    for (;;) {
+        // Descend into exp, emitting what comes before its first child
+        while (exp != NULL) {
+            switch (exp->type) {
+                case EXP_LAMBDA: {
+                    push_compile(&stack, exp, tail);
+                    CompileFrame *frame = &stack.frames[stack.size - 1];
+                    frame->patch = c->program->num_codes;
+                    frame->code = c->code;
+                    frame->depth = c->depth;
+                    c->code = new_code(c->program, exp,
+                                       exp->data.lambda.frame_size);
+                    c->depth = 0;
+                    exp->data.lambda.code = c->code;
+                    exp = lambda_body(exp);
+                    tail = true;
+                    continue;
+                }
+
+                case EXP_APPLY:
+                    push_compile(&stack, exp, tail);
+                    exp = apply_fn(exp);
+                    tail = false;
+                    continue;
+
+                case EXP_LET:
+                    push_compile(&stack, exp, tail);
+                    exp = let_value(exp);
+                    tail = false;
+                    continue;
+
+                case EXP_PRIM:
+                    push_compile(&stack, exp, tail);
+                    exp = prim_arg(exp, 0);
+                    tail = false;
+                    continue;
+
+                default:
+                    compile_leaf(c, exp);
+                    break;
+            }
+            exp = NULL;
+        }
+
+        // Emit what comes after the child just compiled
+        if (stack.size == 0) {
+            break;
+        }
+        CompileFrame *frame = &stack.frames[stack.size - 1];
+        Exp *parent = frame->exp;
+        frame->state++;
+        switch (parent->type) {
+            case EXP_LAMBDA:
+                emit_op(c, parent, OP_RETURN, -1);
+                c->code = frame->code;
+                c->depth = frame->depth;
+                emit_op(c, parent, OP_CLOSURE, 1);
+                emit(c, frame->patch);
+                break;
+
+            case EXP_APPLY:
+                if (frame->state == 1) {
+                    exp = apply_arg(parent);
+                    tail = false;
+                    continue;
+                }
+                emit_op(c, parent, frame->tail ? OP_TAIL_APPLY : OP_APPLY,
+                        -1);
+                break;
+
+            case EXP_LET:
+                if (frame->state == 1) {
+                    compile_store(c, parent);
+                    exp = let_body(parent);
+                    tail = frame->tail;
+                    continue;
+                }
+                break;
+
+            case EXP_PRIM:
+                if (parent->data.prim.op == PRIM_IF) {
+                    // Only the branch that is taken gets evaluated: the
+                    // condition jumps over the first to the second, which
+                    // the first jumps over to the end
+                    if (frame->state == 3) {
+                        c->code->ops[frame->patch] = c->code->length;
+                        break;
+                    }
+                    emit_op(c, parent,
+                            frame->state == 1 ? OP_JUMP_IF_FALSE : OP_JUMP,
+                            -1);
+                    unsigned int patch = c->code->length;
+                    emit(c, 0);
+                    if (frame->state == 2) {
+                        c->code->ops[frame->patch] = c->code->length;
+                    }
+                    frame->patch = patch;
+                    exp = prim_arg(parent, frame->state);
+                    tail = frame->tail;
+                    continue;
+                }
+                if (frame->state < primitive_arity(parent->data.prim.op)) {
+                    exp = prim_arg(parent, frame->state);
+                    tail = false;
+                    continue;
+                }
+                compile_primitive(c, parent);
+                break;
+
+            default:
+                break;
+        }
+        stack.size--;
+    }
+    free(stack.frames);
+}
+
+Program *compile(Exp *exp, unsigned int frame_size) {
+    Program *program = calloc(1, sizeof(Program));
+    Compiler c = {program, NULL, 0};
+    c.code = new_code(program, NULL, frame_size);
+    compile_exp(&c, exp, true);
+    emit_op(&c, exp, OP_RETURN, -1);
+    return program;
+}
+
+void free_program(Program *program) {
+    for (unsigned int i = 0; i < program->num_codes; i++) {
+        Code *code = program->codes[i];
+        if (code->lambda != NULL) {
+            code->lambda->data.lambda.code = NULL;
+        }
+        free(code->ops);
+        free(code->offsets);
+        free(code);
+    }
+    free(program->codes);
+    free(program->constants);
+    free(program);
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include "lambda.h"
+
+// Instructions of the stack VM. Each opcode is one word, followed by the
+// operand words listed next to it.
+typedef enum {
+    OP_CONST,          // k: push constants[k]
+    OP_LOCAL,          // i: push slot i of the current frame
+    OP_FREE,           // i: push entry i of the captured array
+    OP_GLOBAL,         // i: push global slot i
+    OP_STORE,          // i: pop into slot i of the current frame
+    OP_CLOSURE,        // f: push a closure over codes[f]
+    OP_FIX,            // i: make entry i of the closure on top refer to it
+    OP_APPLY,          // pop argument and function, call
+    OP_TAIL_APPLY,     // as OP_APPLY, reusing the current frame
+    OP_RETURN,         // pop result and leave the current frame
+    OP_JUMP,           // t: continue at t
+    OP_JUMP_IF_FALSE,  // t: pop a bool, continue at t when false
+    OP_ADD,
+    OP_SUBTRACT,
+    OP_MULTIPLY,
+    OP_EQUALS,
+    OP_SUCC
+} OpCode;
+
+// Bytecode of one function body, or of the top-level expression
+struct Code {
+    unsigned int *ops;
+    unsigned int *offsets;  // Source offset of the instruction at each word
+    unsigned int length;
+    unsigned int capacity;
+    unsigned int frame_size;
+    unsigned int max_stack;  // Operand stack needed above the frame
+    Exp *lambda;             // NULL for top-level code
+};
+
+typedef struct {
+    Code **codes;  // codes[0] is the top-level expression
+    unsigned int num_codes;
+    unsigned int codes_capacity;
+    Value *constants;
+    unsigned int num_constants;
+    unsigned int constants_capacity;
+} Program;
+
+// Compile a resolved expression. frame_size is the value returned by
+// resolve(); the EXP_PRIM nodes it made become single instructions.
+Program *compile(Exp *exp, unsigned int frame_size);
+void free_program(Program *program);
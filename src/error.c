@@ -0,0 +1,104 @@
+#include "error.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Handlers are per thread, like the evaluations they protect
+static _Thread_local RuntimeHandler *current_handler = NULL;
+
+static void set_error_v(Error *error, ErrorKind kind, unsigned int offset,
+                        const char *format, va_list args) {
+    error->kind = kind;
+    error->offset = offset;
+    vsnprintf(error->message, sizeof(error->message), format, args);
+}
+
+void set_error(Error *error, ErrorKind kind, unsigned int offset,
+               const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    set_error_v(error, kind, offset, format, args);
+    va_end(args);
+}
+
+const char *error_kind_name(ErrorKind kind) {
+    switch (kind) {
+        case ERROR_SYNTAX:
+            return "Syntax";
+        case ERROR_TYPE:
+            return "Type";
+        case ERROR_RUNTIME:
+            return "Runtime";
+    }
+    return "Unknown";
+}
+
+void error_position(const Error *error, const char *source, int *line,
+                    int *column) {
+    *line = 0;
+    *column = 0;
+    if (error->offset == NO_POSITION || source == NULL) {
+        return;
+    }
+    *line = 1;
+    *column = 1;
+    for (unsigned int i = 0; i < error->offset && source[i] != '\0'; i++) {
+        if (source[i] == '\n') {
+            (*line)++;
+            *column = 1;
+        } else {
+            (*column)++;
+        }
+    }
+}
+
+char *error_to_string(const Error *error, const char *source) {
+    int line, column;
+    error_position(error, source, &line, &column);
+    char buffer[sizeof(error->message) + 64];
+    if (line == 0) {
+        snprintf(buffer, sizeof(buffer), "%s error: %s",
+                 error_kind_name(error->kind), error->message);
+    } else {
+        snprintf(buffer, sizeof(buffer), "%d:%d: %s error: %s", line, column,
+                 error_kind_name(error->kind), error->message);
+    }
+    return strdup(buffer);
+}
+
+void push_runtime_handler(RuntimeHandler *handler) {
+    handler->outer = current_handler;
+    current_handler = handler;
+}
+
+void pop_runtime_handler(RuntimeHandler *handler) {
+    current_handler = handler->outer;
+}
+
+void runtime_error(unsigned int offset, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    if (current_handler == NULL) {
+        Error error;
+        set_error_v(&error, ERROR_RUNTIME, offset, format, args);
+        va_end(args);
+        fprintf(stderr, "Runtime error: %s\n", error.message);
+        exit(1);
+    }
+    RuntimeHandler *handler = current_handler;
+    set_error_v(&handler->error, ERROR_RUNTIME, offset, format, args);
+    va_end(args);
+    longjmp(handler->jump, 1);
+}
+
+void forward_runtime_error(RuntimeHandler *handler) {
+    pop_runtime_handler(handler);
+    if (current_handler == NULL) {
+        fprintf(stderr, "Runtime error: %s\n", handler->error.message);
+        exit(1);
+    }
+    current_handler->error = handler->error;
+    longjmp(current_handler->jump, 1);
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <limits.h>
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// An error in a program and where it is. Syntax and type errors are
+// returned by parse(), infer() and resolve(); runtime errors, which only
+// untyped code can run into, unwind the evaluators to the innermost runtime
+// handler. Every engine places the same runtime error at the same node.
+typedef enum { ERROR_SYNTAX, ERROR_TYPE, ERROR_RUNTIME } ErrorKind;
+
+#define NO_POSITION UINT_MAX
+
+typedef struct {
+    ErrorKind kind;
+    unsigned int offset;  // Into the source, or NO_POSITION
+    char message[256];
+} Error;
+
+void set_error(Error *error, ErrorKind kind, unsigned int offset,
+               const char *format, ...);
+const char *error_kind_name(ErrorKind kind);
+// Line and column of the error in source, both from 1; 0 without a position
+void error_position(const Error *error, const char *source, int *line,
+                    int *column);
+// "line:column: Kind error: message", to be freed by the caller
+char *error_to_string(const Error *error, const char *source);
+
+// A runtime handler is installed around a run with push_runtime_handler()
+// and a setjmp() on its jump buffer; runtime_error() fills in its error and
+// jumps back there. The handler has to restore the GC roots. Evaluators
+// with buffers of their own install a handler that frees them and forwards
+// the error outwards. Without a handler a runtime error is printed and ends
+// the process.
+typedef struct RuntimeHandler {
+    jmp_buf jump;
+    Error error;
+    struct RuntimeHandler *outer;
+} RuntimeHandler;
+
+void push_runtime_handler(RuntimeHandler *handler);
+void pop_runtime_handler(RuntimeHandler *handler);
+_Noreturn void runtime_error(unsigned int offset, const char *format, ...);
+// Pass the error caught by handler, the innermost one, on to the handler
+// around it
+_Noreturn void forward_runtime_error(RuntimeHandler *handler);
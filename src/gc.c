@@ -0,0 +1,275 @@
+#include "gc.h"
+
+#include <stddef.h>
+#include <time.h>
+
+// Header in front of every heap object. Live objects are chained through
+// next for the sweep; freed ones are chained on the free list of their size
+// class.
+typedef struct GcObject {
+    struct GcObject *next;
+    unsigned int size;  // Payload bytes asked for
+    unsigned char kind;
+    bool marked;
+} GcObject;
+
+_Static_assert(sizeof(GcObject) % 16 == 0, "payloads must stay aligned");
+
+// Payloads up to MAX_SMALL bytes are recycled through per-size free lists
+// instead of going back to malloc
+#define GRANULE 16
+#define MAX_SMALL 512
+#define NUM_CLASSES (MAX_SMALL / GRANULE)
+#define MIN_THRESHOLD (1u << 20)
+
+typedef enum { ROOT_VALUE, ROOT_ENV, ROOT_TRACER } RootKind;
+
+typedef struct {
+    RootKind kind;
+    void *ptr;
+    GcTracer trace;
+} Root;
+
+static GcObject *objects = NULL;
+static GcObject *free_lists[NUM_CLASSES];
+static size_t allocated_since_gc = 0;
+static size_t threshold = MIN_THRESHOLD;
+
+static Root *roots = NULL;
+static unsigned int num_roots = 0;
+static unsigned int roots_capacity = 0;
+
+static GcObject **mark_stack = NULL;
+static unsigned int mark_size = 0;
+static unsigned int mark_capacity = 0;
+
+static GcStats stats;
+
+static GcObject *header(void *payload) { return (GcObject *)payload - 1; }
+
+static unsigned int size_class(size_t size) {
+    return (unsigned int)((size + GRANULE - 1) / GRANULE) - 1;
+}
+
+static size_t object_bytes(GcObject *obj) {
+    if (obj->size <= MAX_SMALL) {
+        return sizeof(GcObject) + (size_class(obj->size) + 1) * GRANULE;
+    }
+    return sizeof(GcObject) + obj->size;
+}
+
+void *gc_alloc(GcKind kind, size_t size) {
+    if (size == 0) size = 1;
+    if (allocated_since_gc >= threshold) {
+        gc_collect();
+    }
+
+    GcObject *obj = NULL;
+    if (size <= MAX_SMALL) {
+        unsigned int c = size_class(size);
+        obj = free_lists[c];
+        if (obj != NULL) {
+            free_lists[c] = obj->next;
+        } else {
+            obj = malloc(sizeof(GcObject) + (c + 1) * GRANULE);
+            stats.heap_bytes += sizeof(GcObject) + (c + 1) * GRANULE;
+        }
+    } else {
+        obj = malloc(sizeof(GcObject) + size);
+        stats.heap_bytes += sizeof(GcObject) + size;
+    }
+    if (obj == NULL) {
+        fprintf(stderr, "Fatal: failed to allocate %zu bytes on the heap.\n",
+                size);
+        exit(1);
+    }
+
+    obj->size = (unsigned int)size;
+    obj->kind = (unsigned char)kind;
+    obj->marked = false;
+    obj->next = objects;
+    objects = obj;
+
+    allocated_since_gc += object_bytes(obj);
+    stats.bytes_allocated += object_bytes(obj);
+    return obj + 1;
+}
+
+static void push_root(Root root) {
+    if (num_roots == roots_capacity) {
+        roots_capacity = roots_capacity == 0 ? 64 : roots_capacity * 2;
+        roots = realloc(roots, roots_capacity * sizeof(Root));
+        if (roots == NULL) {
+            fprintf(stderr, "Fatal: failed to grow GC root stack.\n");
+            exit(1);
+        }
+    }
+    roots[num_roots++] = root;
+}
+
+unsigned int gc_save_roots(void) { return num_roots; }
+
+void gc_restore_roots(unsigned int saved) { num_roots = saved; }
+
+void gc_root_value(Value *value) {
+    push_root((Root){ROOT_VALUE, value, NULL});
+}
+
+void gc_root_env(Env **env) { push_root((Root){ROOT_ENV, env, NULL}); }
+
+void gc_push_tracer(GcTracer trace, void *data) {
+    push_root((Root){ROOT_TRACER, data, trace});
+}
+
+// Marking uses an explicit stack, as closure chains can be arbitrarily long
+static void mark_object(GcObject *obj) {
+    if (obj->marked) return;
+    obj->marked = true;
+    if (mark_size == mark_capacity) {
+        mark_capacity = mark_capacity == 0 ? 256 : mark_capacity * 2;
+        mark_stack = realloc(mark_stack, mark_capacity * sizeof(GcObject *));
+        if (mark_stack == NULL) {
+            fprintf(stderr, "Fatal: failed to grow GC mark stack.\n");
+            exit(1);
+        }
+    }
+    mark_stack[mark_size++] = obj;
+}
+
+void gc_mark_value(Value value) {
+    switch (value_tag(value)) {
+        case TAG_CLOSURE:
+            mark_object(header(as_closure(value)));
+            break;
+        case TAG_PARTIAL:
+            mark_object(header(as_partial(value)));
+            break;
+        case TAG_THUNK:
+            mark_object(header(as_thunk(value)));
+            break;
+        default:
+            break;
+    }
+}
+
+void gc_mark_env(Env *env) {
+    if (env != NULL) {
+        mark_object(header(env));
+    }
+}
+
+void gc_mark_closure(Closure *closure) {
+    if (closure != NULL) {
+        mark_object(header(closure));
+    }
+}
+
+static void trace_object(GcObject *obj) {
+    if (obj->kind == GC_CLOSURE) {
+        Closure *closure = (Closure *)(obj + 1);
+        for (unsigned int i = 0; i < closure->num_captured; i++) {
+            gc_mark_value(closure->captured[i]);
+        }
+        return;
+    }
+    if (obj->kind == GC_THUNK) {
+        Thunk *thunk = (Thunk *)(obj + 1);
+        gc_mark_env(thunk->env);
+        if (thunk->state == THUNK_DONE) {
+            gc_mark_value(thunk->value);
+        }
+        return;
+    }
+    if (obj->kind == GC_PARTIAL) {
+        Partial *partial = (Partial *)(obj + 1);
+        for (unsigned int i = 0; i < partial->num_args; i++) {
+            gc_mark_value(partial->args[i]);
+        }
+        return;
+    }
+
+    Env *env = (Env *)(obj + 1);
+    gc_mark_closure(env->closure);
+    if (env->globals != NULL) {
+        // Every frame points into the slots of the global frame
+        gc_mark_env(
+            (Env *)((char *)env->globals - offsetof(Env, slots)));
+    }
+    for (unsigned int i = 0; i < env->size; i++) {
+        gc_mark_value(env->slots[i]);
+    }
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e3 + (double)ts.tv_nsec / 1e6;
+}
+
+void gc_collect(void) {
+    double start = now_ms();
+
+    for (unsigned int i = 0; i < num_roots; i++) {
+        switch (roots[i].kind) {
+            case ROOT_VALUE:
+                gc_mark_value(*(Value *)roots[i].ptr);
+                break;
+            case ROOT_ENV:
+                gc_mark_env(*(Env **)roots[i].ptr);
+                break;
+            case ROOT_TRACER:
+                roots[i].trace(roots[i].ptr);
+                break;
+        }
+    }
+    while (mark_size > 0) {
+        trace_object(mark_stack[--mark_size]);
+    }
+
+    // Sweep
+    size_t live = 0;
+    GcObject **link = &objects;
+    while (*link != NULL) {
+        GcObject *obj = *link;
+        if (obj->marked) {
+            obj->marked = false;
+            live += object_bytes(obj);
+            link = &obj->next;
+            continue;
+        }
+        *link = obj->next;
+        stats.objects_freed++;
+        if (obj->size <= MAX_SMALL) {
+            unsigned int c = size_class(obj->size);
+            obj->next = free_lists[c];
+            free_lists[c] = obj;
+        } else {
+            stats.heap_bytes -= object_bytes(obj);
+            free(obj);
+        }
+    }
+
+    // Let the heap grow to three times what survived before collecting again
+    allocated_since_gc = 0;
+    threshold = 2 * live > MIN_THRESHOLD ? 2 * live : MIN_THRESHOLD;
+
+    double pause = now_ms() - start;
+    stats.collections++;
+    stats.total_pause_ms += pause;
+    if (pause > stats.max_pause_ms) {
+        stats.max_pause_ms = pause;
+    }
+    stats.live_bytes = live;
+}
+
+void gc_get_stats(GcStats *out) { *out = stats; }
+
+void gc_print_stats(FILE *out) {
+    fprintf(out, "GC: %lu collections, %.3f ms total pause, %.3f ms max\n",
+            stats.collections, stats.total_pause_ms, stats.max_pause_ms);
+    fprintf(out,
+            "GC: %zu bytes allocated, %zu live, %zu heap, %lu objects "
+            "freed\n",
+            stats.bytes_allocated, stats.live_bytes, stats.heap_bytes,
+            stats.objects_freed);
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <stdio.h>
+
+#include "lambda.h"
+
+// Mark-and-sweep heap for environment frames, closures, partially applied
+// primitives and thunks. Objects are never freed by hand;
+// a collection runs from gc_alloc() once enough has been allocated since the
+// last one, so everything an evaluator still needs must be reachable from
+// the roots registered below when it allocates.
+
+typedef enum { GC_FRAME, GC_CLOSURE, GC_PARTIAL, GC_THUNK } GcKind;
+
+typedef struct {
+    unsigned long collections;
+    double total_pause_ms;
+    double max_pause_ms;
+    size_t bytes_allocated;  // Over the lifetime of the heap
+    size_t live_bytes;       // Surviving the last collection
+    size_t heap_bytes;       // Held by the heap, including free lists
+    unsigned long objects_freed;
+} GcStats;
+
+// Objects are 16-byte aligned, leaving the tag bits of a Value free
+void *gc_alloc(GcKind kind, size_t size);
+
+// Roots live on a stack: push them while the C locals they point to are in
+// use, and drop everything pushed since gc_save_roots() with
+// gc_restore_roots(). A tracer is called during marking to mark the
+// objects held by an evaluator's own stacks.
+typedef void (*GcTracer)(void *data);
+unsigned int gc_save_roots(void);
+void gc_restore_roots(unsigned int saved);
+void gc_root_value(Value *value);
+void gc_root_env(Env **env);
+void gc_push_tracer(GcTracer trace, void *data);
+
+// For tracers
+void gc_mark_value(Value value);
+void gc_mark_env(Env *env);
+void gc_mark_closure(Closure *closure);
+
+void gc_collect(void);
+void gc_get_stats(GcStats *stats);
+void gc_print_stats(FILE *out);
@@ -1,166 +1,697 @@
 #include "infer.h"
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-// Main type inference function
-Type *infer(Exp *exp, TypeEnv *env) {
-    switch (exp->type) {
-        case EXP_UNIT:
-            return new_MT_type(TYPE_UNIT);
-        case EXP_INT: {
-            return new_MT_type(TYPE_INT);
-        }
-        case EXP_BOOL: {
-            return new_MT_type(TYPE_BOOL);
-        }
-
-        case EXP_VAR: {
-            // Look up the variable in the environment
-            PolyType *polytype = lookup_type_env(exp->data.var_name, env);
-            if (polytype == NULL) {
-                fprintf(stderr, "Type error: unbound variable %s\n",
-                        exp->data.var_name);
-                exit(1);
-            }
-
-            // Instantiate the polymorphic type
-            Type *t = instantiate(polytype);
-            exp->inferred_type = t;
-            return t;
+// Names bound around the expression being walked, innermost last. Two
+// expressions are compared with a second column for the other one.
+typedef struct {
+    Symbol *names;
+    Symbol *other;
+    unsigned int depth;
+    unsigned int capacity;
+} Binders;
+
+// The closed lambdas found so far by hash_exp() that are not inside another
+// closed lambda, in the order they were finished
+typedef struct {
+    Exp **lambdas;
+    unsigned int count;
+    unsigned int capacity;
+} ClosedLambdas;
+
+static void push_closed(ClosedLambdas *closed, Exp *lambda) {
+    if (closed->count == closed->capacity) {
+        closed->capacity = closed->capacity == 0 ? 16 : closed->capacity * 2;
+        closed->lambdas =
+            realloc(closed->lambdas, closed->capacity * sizeof(Exp *));
+        if (closed->lambdas == NULL) {
+            fprintf(stderr, "Fatal: failed to grow closed lambdas.\n");
+            exit(1);
         }
+    }
+    closed->lambdas[closed->count++] = lambda;
+}
 
-        case EXP_LAMBDA: {
-            // Create a fresh type variable for the parameter
-            Type *param_type = new_typevar();
-
-            // Extend the environment with the parameter
-            PolyType *param_polytype = dont_generalize(param_type);
-            TypeEnv *new_env =
-                extend_type_env(exp->data.lambda.param, param_polytype, env);
-
-            // Infer the type of the body
-            Type *body_type = infer(exp->data.lambda.body, new_env);
+static void push_binder(Binders *b, Symbol name, Symbol other) {
+    if (b->depth == b->capacity) {
+        b->capacity = b->capacity == 0 ? 16 : b->capacity * 2;
+        b->names = realloc(b->names, b->capacity * sizeof(Symbol));
+        b->other = realloc(b->other, b->capacity * sizeof(Symbol));
+        if (b->names == NULL || b->other == NULL) {
+            fprintf(stderr, "Fatal: failed to grow binder stack.\n");
+            exit(1);
+        }
+    }
+    b->names[b->depth] = name;
+    b->other[b->depth] = other;
+    b->depth++;
+}
 
-            // The type of the lambda is param_type -> body_type
-            Type *fn_type = type_function(param_type, body_type);
-            exp->inferred_type = fn_type;
+// How many binders out name is bound, or UINT_MAX when it is free
+static unsigned int binder_distance(Symbol *names, unsigned int depth,
+                                    Symbol name) {
+    for (unsigned int i = depth; i > 0; i--) {
+        if (names[i - 1] == name) {
+            return depth - i;
+        }
+    }
+    return UINT_MAX;
+}
 
-            // Free the extended environment
-            free(new_env->name);
-            free_polytype(new_env->type);
-            free(new_env);
+static unsigned int mix(unsigned int h, unsigned int x) {
+    return (h ^ x) * 16777619u;
+}
 
-            return fn_type;
+// A node hash_exp() is inside of, with its children visited so far
+typedef struct {
+    Exp *exp;
+    unsigned int next;    // Child to visit next
+    unsigned int hash;    // Of the node and its children so far
+    unsigned int need;    // Binders needed by the children so far
+    unsigned int inside;  // Closed lambdas found before a lambda
+} HashFrame;
+
+typedef struct {
+    HashFrame *frames;
+    unsigned int size;
+    unsigned int capacity;
+} HashStack;
+
+static void push_hash_frame(HashStack *stack, Exp *exp) {
+    if (stack->size == stack->capacity) {
+        stack->capacity = stack->capacity == 0 ? 64 : stack->capacity * 2;
+        stack->frames =
+            realloc(stack->frames, stack->capacity * sizeof(HashFrame));
+        if (stack->frames == NULL) {
+            fprintf(stderr, "Fatal: failed to grow the hash stack.\n");
+            exit(1);
         }
+    }
+    stack->frames[stack->size++] =
+        (HashFrame){exp, 0, mix(2166136261u, exp->type), 0, 0};
+}
 
-        case EXP_APPLY: {
-            // Infer the type of the function
-            Type *fn_type = infer(exp->data.apply.fn, env);
+// Hash the structure of exp, naming bound variables by binder distance so
+// that renaming them changes nothing, and mark the lambdas without free
+// variables that are not inside another one. Those inside are only ever
+// inferred as part of it, and generalizing each of a nest of them would
+// take time and memory quadratic in its depth. The nodes being visited are
+// kept on a stack of their own, so any depth of tree can be hashed.
+static void hash_exp(Exp *root, Binders *b, ClosedLambdas *closed) {
+    HashStack stack = {NULL, 0, 0};
+    push_hash_frame(&stack, root);
+    // Of the node finished last
+    unsigned int hash = 0;
+    unsigned int need = 0;
+    while (stack.size > 0) {
+        HashFrame *frame = &stack.frames[stack.size - 1];
+        Exp *exp = frame->exp;
+        if (frame->next == 0) {
+            switch (exp->type) {
+                case EXP_UNIT:
+                    break;
+                case EXP_INT:
+                    frame->hash = mix(frame->hash, exp->data.int_val);
+                    break;
+                case EXP_BOOL:
+                    frame->hash = mix(frame->hash, exp->data.bool_val);
+                    break;
+                case EXP_VAR: {
+                    unsigned int d = binder_distance(b->names, b->depth,
+                                                     exp->data.var.name);
+                    frame->hash = d == UINT_MAX
+                                      ? mix(frame->hash ^ 1,
+                                            exp->data.var.name)
+                                      : mix(frame->hash, d);
+                    frame->need = d == UINT_MAX ? UINT_MAX : d + 1;
+                    break;
+                }
+                case EXP_LAMBDA:
+                    frame->inside = closed->count;
+                    push_binder(b, exp->data.lambda.param, 0);
+                    break;
+                case EXP_APPLY:
+                    break;
+                case EXP_LET:
+                    // The variable is in scope in its own definition
+                    push_binder(b, exp->data.let.var, 0);
+                    break;
+                case EXP_PRIM:
+                    frame->hash = mix(frame->hash, exp->data.prim.op);
+                    break;
+            }
+        } else {
+            // Back from a child
+            frame->hash = mix(frame->hash, hash);
+            frame->need = need > frame->need ? need : frame->need;
+        }
+        if (frame->next < exp_num_children(exp)) {
+            push_hash_frame(&stack, exp_child(exp, frame->next++));
+            continue;
+        }
 
-            // Infer the type of the argument
-            Type *arg_type = infer(exp->data.apply.arg, env);
+        hash = frame->hash;
+        need = frame->need;
+        if (exp->type == EXP_LAMBDA || exp->type == EXP_LET) {
+            b->depth--;
+            need = need == UINT_MAX || need == 0 ? need : need - 1;
+        }
+        if (exp->type == EXP_LAMBDA) {
+            exp->data.lambda.hash = hash;
+            exp->data.lambda.closed = need == 0;
+            if (need == 0) {
+                // It takes the place of the closed lambdas in its body
+                for (unsigned int i = frame->inside; i < closed->count; i++) {
+                    closed->lambdas[i]->data.lambda.closed = false;
+                }
+                closed->count = frame->inside;
+                push_closed(closed, exp);
+            }
+        }
+        stack.size--;
+    }
+    free(stack.frames);
+}
 
-            // Create a fresh type variable for the result
-            Type *result_type = new_typevar();
+// Pairs of subexpressions alpha_equal() has still to compare; a pair of
+// NULLs ends the scope of the binders pushed last
+typedef struct {
+    Exp *a;
+    Exp *b;
+} ExpPair;
+
+typedef struct {
+    ExpPair *pairs;
+    unsigned int size;
+    unsigned int capacity;
+} PairStack;
+
+static void push_pair(PairStack *stack, Exp *a, Exp *b) {
+    if (stack->size == stack->capacity) {
+        stack->capacity = stack->capacity == 0 ? 64 : stack->capacity * 2;
+        stack->pairs =
+            realloc(stack->pairs, stack->capacity * sizeof(ExpPair));
+        if (stack->pairs == NULL) {
+            fprintf(stderr, "Fatal: failed to grow the pair stack.\n");
+            exit(1);
+        }
+    }
+    stack->pairs[stack->size++] = (ExpPair){a, b};
+}
 
-            // The function type must be arg_type -> result_type
-            Type *expected_fn_type = type_function(arg_type, result_type);
+// Whether a and b are the same up to the names of bound variables
+static bool alpha_equal(Exp *a, Exp *b, Binders *binders) {
+    PairStack stack = {NULL, 0, 0};
+    push_pair(&stack, a, b);
+    bool equal = true;
+    while (equal && stack.size > 0) {
+        ExpPair pair = stack.pairs[--stack.size];
+        a = pair.a;
+        b = pair.b;
+        if (a == NULL) {
+            binders->depth--;
+            continue;
+        }
+        if (a->type != b->type) {
+            equal = false;
+            break;
+        }
+        switch (a->type) {
+            case EXP_UNIT:
+                break;
+            case EXP_INT:
+                equal = a->data.int_val == b->data.int_val;
+                break;
+            case EXP_BOOL:
+                equal = a->data.bool_val == b->data.bool_val;
+                break;
+
+            case EXP_VAR: {
+                unsigned int da = binder_distance(
+                    binders->names, binders->depth, a->data.var.name);
+                unsigned int db = binder_distance(
+                    binders->other, binders->depth, b->data.var.name);
+                equal = da == db && (da != UINT_MAX ||
+                                     a->data.var.name == b->data.var.name);
+                break;
+            }
 
-            // Unify the actual function type with the expected function type
-            unify(fn_type, expected_fn_type);
+            case EXP_LAMBDA:
+                push_binder(binders, a->data.lambda.param,
+                            b->data.lambda.param);
+                push_pair(&stack, NULL, NULL);
+                push_pair(&stack, lambda_body(a), lambda_body(b));
+                break;
+
+            case EXP_APPLY:
+                push_pair(&stack, apply_arg(a), apply_arg(b));
+                push_pair(&stack, apply_fn(a), apply_fn(b));
+                break;
+
+            case EXP_LET:
+                push_binder(binders, a->data.let.var, b->data.let.var);
+                push_pair(&stack, NULL, NULL);
+                push_pair(&stack, let_body(a), let_body(b));
+                push_pair(&stack, let_value(a), let_value(b));
+                break;
+
+            case EXP_PRIM:
+                equal = a->data.prim.op == b->data.prim.op;
+                for (unsigned int i = exp_num_children(a); equal && i > 0;
+                     i--) {
+                    push_pair(&stack, prim_arg(a, i - 1), prim_arg(b, i - 1));
+                }
+                break;
+        }
+    }
+    free(stack.pairs);
+    return equal;
+}
 
-            exp->inferred_type = result_type;
-            return result_type;
+// Give the nodes of b, equal to a up to the names of bound variables, the
+// types inferred for those of a. The types of a closed lambda's body are
+// generalized along with it and never unified again, so they can be shared.
+static void copy_types(Exp *a, Exp *b) {
+    PairStack stack = {NULL, 0, 0};
+    push_pair(&stack, a, b);
+    while (stack.size > 0) {
+        ExpPair pair = stack.pairs[--stack.size];
+        pair.b->inferred_type = pair.a->inferred_type;
+        for (unsigned int i = 0; i < exp_num_children(pair.a); i++) {
+            push_pair(&stack, exp_child(pair.a, i),
+                      exp_child(pair.b, i));
         }
+    }
+    free(stack.pairs);
+}
 
-        case EXP_LET: {
-            // Create a temporary environment for recursive definitions
-            TypeEnv *temp_env = env;
-            Type *var_type = new_typevar();
-            PolyType *var_polytype = dont_generalize(var_type);
-            temp_env =
-                extend_type_env(exp->data.let.var, var_polytype, temp_env);
+// Bound to the variable of a let while its value is inferred when the value
+// is not a lambda. The evaluators only tie the knot for a lambda, whose
+// closure can refer to itself; any other value would see the variable
+// before it has one.
+static PolyType being_defined;
+
+static bool same_lambda(const void *a, const void *b) {
+    Binders binders = {NULL, NULL, 0, 0};
+    bool equal = alpha_equal((Exp *)a, (Exp *)b, &binders);
+    free(binders.names);
+    free(binders.other);
+    return equal;
+}
 
-            // Enter a new type level for polymorphism
-            enter_level();
+// Unify two types met at exp, reporting a failure as a type error there
+static bool unify_at(InferContext *ctx, Exp *exp, Type *t1, Type *t2,
+                     Error *error) {
+    UnifyResult result = unify(ctx, t1, t2);
+    if (result == UNIFY_OK) {
+        return true;
+    }
+    char *t1_str = type_to_string(t1);
+    char *t2_str = type_to_string(t2);
+    set_error(error, ERROR_TYPE, exp->offset,
+              result == UNIFY_RECURSIVE
+                  ? "%s and %s would make a recursive type"
+                  : "cannot unify %s with %s",
+              t1_str, t2_str);
+    free(t1_str);
+    free(t2_str);
+    return false;
+}
 
-            // Infer the type of the value in the extended environment
-            Type *val_type = infer(exp->data.let.e1, temp_env);
+// Whether exp applies the primitive if to a condition and both branches.
+// Only the branch taken is evaluated, so if is not a function and any other
+// use of it is an error.
+static bool applies_if(Exp *exp, TypeEnv *env) {
+    Exp *head = exp;
+    for (int i = 0; i < 3; i++) {
+        if (head->type != EXP_APPLY) return false;
+        head = apply_fn(head);
+    }
+    return head->type == EXP_VAR && env->if_type != NULL &&
+           lookup_type_env(head->data.var.name, env) == env->if_type;
+}
 
-            // Unify the variable type with the value type
-            unify(var_type, val_type);
+// Argument i of a call typed by infer_exp() like the applications of a
+// primitive it stands for: an EXP_PRIM node, or an if applied in full
+static Exp *call_arg(Exp *exp, unsigned int i) {
+    if (exp->type == EXP_PRIM) {
+        return prim_arg(exp, i);
+    }
+    for (unsigned int j = i; j < 2; j++) {
+        exp = apply_fn(exp);
+    }
+    return apply_arg(exp);
+}
 
-            // Exit the type level
-            exit_level();
+static unsigned int call_arity(Exp *exp) {
+    return exp->type == EXP_PRIM ? primitive_arity(exp->data.prim.op) : 3;
+}
 
-            // Generalize the type
-            PolyType *val_polytype = generalize(val_type);
+// An expression infer_exp() is inside of, waiting for the type of a child
+typedef struct {
+    Exp *exp;
+    unsigned int state;  // Children inferred so far
+    bool call;           // Typed as a call, one argument at a time
+    // The type of the lambda's parameter or the let's variable, of the
+    // function applied, or of the call with the arguments so far
+    Type *type;
+} InferFrame;
+
+typedef struct {
+    InferFrame *frames;
+    unsigned int size;
+    unsigned int capacity;
+} InferStack;
+
+static void push_infer_frame(InferStack *stack, Exp *exp, bool call,
+                             Type *type) {
+    if (stack->size == stack->capacity) {
+        stack->capacity = stack->capacity == 0 ? 64 : stack->capacity * 2;
+        stack->frames =
+            realloc(stack->frames, stack->capacity * sizeof(InferFrame));
+        if (stack->frames == NULL) {
+            fprintf(stderr, "Fatal: failed to grow the inference stack.\n");
+            exit(1);
+        }
+    }
+    stack->frames[stack->size++] = (InferFrame){exp, 0, call, type};
+}
 
-            // Extend the environment with the generalized type
-            TypeEnv *new_env =
-                extend_type_env(exp->data.let.var, val_polytype, env);
+// The expressions being inferred are kept on a stack of their own, so a
+// tree of any depth can be inferred. Every binding pushed on env is popped
+// again, also when an error is found and NULL returned.
+static Type *infer_exp(InferContext *ctx, Exp *exp, TypeEnv *env,
+                       Error *error) {
+    InferStack stack = {NULL, 0, 0};
+    // Of the expression finished last, NULL once an error has been found
+    Type *type = NULL;
+
+    for (;;) {
+        // Descend into exp until one of its subexpressions has a type
+        while (exp != NULL) {
+            switch (exp->type) {
+                case EXP_UNIT:
+                    type = type_unit();
+                    break;
+                case EXP_INT:
+                    type = type_int();
+                    break;
+                case EXP_BOOL:
+                    type = type_bool();
+                    break;
+
+                case EXP_VAR: {
+                    // Look up the variable in the environment
+                    PolyType *polytype =
+                        lookup_type_env(exp->data.var.name, env);
+                    type = NULL;
+                    if (polytype == NULL) {
+                        set_error(error, ERROR_TYPE, exp->offset,
+                                  "unbound variable %s",
+                                  symbol_name(exp->data.var.name));
+                    } else if (polytype == &being_defined) {
+                        set_error(error, ERROR_TYPE, exp->offset,
+                                  "%s is used in its own definition, which "
+                                  "is not a lambda",
+                                  symbol_name(exp->data.var.name));
+                    } else if (polytype == env->if_type) {
+                        set_error(error, ERROR_TYPE, exp->offset,
+                                  "if has to be applied to a condition and "
+                                  "both branches");
+                    } else {
+                        // Instantiate the polymorphic type
+                        type = instantiate(ctx, polytype);
+                        exp->inferred_type = type;
+                    }
+                    break;
+                }
+
+                case EXP_LAMBDA: {
+                    // A closed lambda has the same principal type wherever
+                    // it appears, so it is generalized once and
+                    // instantiated for every equal one after it
+                    if (exp->data.lambda.closed) {
+                        const void *first;
+                        PolyType *memo =
+                            type_memo_find(ctx, exp->data.lambda.hash, exp,
+                                           same_lambda, &first);
+                        if (memo != NULL) {
+                            // The body gets the types inferred for the
+                            // first one, which specialize() reads
+                            copy_types((Exp *)first, exp);
+                            type = instantiate(ctx, memo);
+                            exp->inferred_type = type;
+                            break;
+                        }
+                        enter_level(ctx);
+                    }
+
+                    // Extend the environment with a fresh type variable for
+                    // the parameter, and infer the body
+                    Type *param_type = new_typevar(ctx);
+                    push_type_env(env, exp->data.lambda.param,
+                                  dont_generalize(param_type));
+                    push_infer_frame(&stack, exp, false, param_type);
+                    exp = lambda_body(exp);
+                    continue;
+                }
+
+                case EXP_APPLY:
+                    if (applies_if(exp, env)) {
+                        push_infer_frame(&stack, exp, true,
+                                         instantiate(ctx, env->if_type));
+                        exp = call_arg(exp, 0);
+                        continue;
+                    }
+                    // Infer the type of the function, then of the argument
+                    push_infer_frame(&stack, exp, false, NULL);
+                    exp = apply_fn(exp);
+                    continue;
+
+                case EXP_LET: {
+                    // Enter a new type level for polymorphism
+                    enter_level(ctx);
+
+                    // Bind the variable for recursive definitions first,
+                    // which only a lambda can be. Its type belongs to the
+                    // new level too, or unifying with it would keep the
+                    // value from being generalized.
+                    bool recursive = let_value(exp)->type == EXP_LAMBDA;
+                    Type *var_type = new_typevar(ctx);
+                    push_type_env(env, exp->data.let.var,
+                                  recursive ? dont_generalize(var_type)
+                                            : &being_defined);
+                    push_infer_frame(&stack, exp, false, var_type);
+                    exp = let_value(exp);
+                    continue;
+                }
+
+                case EXP_PRIM: {
+                    // Typed like the application of the global it came from
+                    Symbol name = intern(primitive_name(exp->data.prim.op));
+                    push_infer_frame(
+                        &stack, exp, true,
+                        instantiate(ctx, lookup_type_env(name, env)));
+                    exp = prim_arg(exp, 0);
+                    continue;
+                }
+            }
+            exp = NULL;
+        }
 
-            // Infer the type of the body in the extended environment
-            Type *body_type = infer(exp->data.let.e2, new_env);
+        // Hand the type to the innermost expression waiting for it
+        if (stack.size == 0) {
+            break;
+        }
+        InferFrame *frame = &stack.frames[stack.size - 1];
+        Exp *parent = frame->exp;
+
+        if (frame->call) {
+            // The arguments of a call are applied one at a time
+            Type *result_type = NULL;
+            if (type != NULL) {
+                result_type = new_typevar(ctx);
+                if (!unify_at(ctx, parent, frame->type,
+                              type_function(ctx, type, result_type),
+                              error)) {
+                    result_type = NULL;
+                }
+            }
+            type = result_type;
+            if (type != NULL && ++frame->state < call_arity(parent)) {
+                frame->type = type;
+                exp = call_arg(parent, frame->state);
+                continue;
+            }
+            if (type != NULL) {
+                parent->inferred_type = type;
+            }
+            stack.size--;
+            continue;
+        }
 
-            exp->inferred_type = body_type;
+        switch (parent->type) {
+            case EXP_LAMBDA: {
+                // Leave the scope of the parameter
+                bool closed = parent->data.lambda.closed;
+                free_polytype(pop_type_env(env));
+                stack.size--;
+                if (type == NULL) {
+                    if (closed) exit_level(ctx);
+                    break;
+                }
+
+                // The type of the lambda is param_type -> body_type
+                type = type_function(ctx, frame->type, type);
+                parent->inferred_type = type;
+                if (closed) {
+                    exit_level(ctx);
+                    PolyType *polytype = generalize(ctx, type);
+                    type_memo_add(ctx, parent->data.lambda.hash, parent,
+                                  polytype);
+                    type = instantiate(ctx, polytype);
+                    parent->inferred_type = type;
+                }
+                break;
+            }
 
-            // Free the extended environment
-            free(new_env->name);
-            free_polytype(new_env->type);
-            free(new_env);
+            case EXP_APPLY: {
+                if (type == NULL) {
+                    stack.size--;
+                    break;
+                }
+                if (frame->state == 0) {
+                    frame->state = 1;
+                    frame->type = type;
+                    exp = apply_arg(parent);
+                    break;
+                }
+
+                // The function type must be arg_type -> result_type
+                Type *result_type = new_typevar(ctx);
+                Type *expected_fn_type =
+                    type_function(ctx, type, result_type);
+                stack.size--;
+                type = NULL;
+                if (unify_at(ctx, parent, frame->type, expected_fn_type,
+                             error)) {
+                    type = result_type;
+                    parent->inferred_type = type;
+                }
+                break;
+            }
 
-            return body_type;
+            case EXP_LET: {
+                if (frame->state == 1) {
+                    // Leave the scope of the variable
+                    parent->inferred_type = type;
+                    free_polytype(pop_type_env(env));
+                    stack.size--;
+                    break;
+                }
+
+                // Unify the variable type with the value type
+                bool ok = type != NULL &&
+                          unify_at(ctx, let_value(parent), frame->type, type,
+                                   error);
+
+                // Exit the type level
+                exit_level(ctx);
+                PolyType *var_polytype = pop_type_env(env);
+                if (let_value(parent)->type == EXP_LAMBDA) {
+                    free_polytype(var_polytype);
+                }
+                if (!ok) {
+                    type = NULL;
+                    stack.size--;
+                    break;
+                }
+
+                // Generalize the type, and infer the body with it
+                push_type_env(env, parent->data.let.var,
+                              generalize(ctx, type));
+                frame->state = 1;
+                exp = let_body(parent);
+                break;
+            }
+
+            default:
+                break;
         }
     }
 
-    // Should never reach here
-    fprintf(stderr, "Type error: unknown expression type\n");
-    exit(1);
+    free(stack.frames);
+    return type;
+}
+
+// Main type inference function
+Type *infer(InferContext *ctx, Exp *exp, TypeEnv *env, Error *error) {
+    Binders binders = {NULL, NULL, 0, 0};
+    ClosedLambdas closed = {NULL, 0, 0};
+    hash_exp(exp, &binders, &closed);
+    free(binders.names);
+    free(binders.other);
+    free(closed.lambdas);
+
+    return infer_exp(ctx, exp, env, error);
+}
+
+// forall a. type, for the type variable a
+static PolyType *forall(Type *a, Type *type) {
+    Type **typevars = malloc(sizeof(Type *));
+    typevars[0] = a;
+    return quantify(type, typevars, 1);
 }
 
-// Initialize the standard environment with primitive types
-TypeEnv *init_standard_type_env() {
-    TypeEnv *env = NULL;
+// Initialize the standard environment with primitive types. They outlive
+// the types inferred for each expression, so must never be unified with
+// them: the polymorphic ones are quantified and only ever instantiated.
+TypeEnv *init_standard_type_env(InferContext *ctx) {
+    TypeEnv *env = new_type_env();
 
     // add : int -> int -> int
-    Type *int_type = new_MT_type(TYPE_INT);
-    Type *add_type = type_function(int_type, type_function(int_type, int_type));
+    Type *int_type = type_int();
+    Type *add_type =
+        type_function(ctx, int_type, type_function(ctx, int_type, int_type));
     PolyType *add_polytype = dont_generalize(add_type);
-    env = extend_type_env("add", add_polytype, env);
+    push_type_env(env, intern("add"), add_polytype);
 
     // subtract : int -> int -> int
     Type *subtract_type =
-        type_function(int_type, type_function(int_type, int_type));
+        type_function(ctx, int_type, type_function(ctx, int_type, int_type));
     PolyType *subtract_polytype = dont_generalize(subtract_type);
-    env = extend_type_env("subtract", subtract_polytype, env);
+    push_type_env(env, intern("subtract"), subtract_polytype);
 
     // multiply : int -> int -> int
     Type *multiply_type =
-        type_function(int_type, type_function(int_type, int_type));
+        type_function(ctx, int_type, type_function(ctx, int_type, int_type));
     PolyType *multiply_polytype = dont_generalize(multiply_type);
-    env = extend_type_env("multiply", multiply_polytype, env);
+    push_type_env(env, intern("multiply"), multiply_polytype);
 
     // equals : 'a -> 'a -> bool
-    Type *a_type = new_typevar();
-    Type *bool_type = new_MT_type(TYPE_BOOL);
-    Type *equals_type = type_function(a_type, type_function(a_type, bool_type));
-    PolyType *equals_polytype = generalize(equals_type);
-    env = extend_type_env("equals", equals_polytype, env);
+    Type *a_type = new_typevar(ctx);
+    Type *bool_type = type_bool();
+    Type *equals_type =
+        type_function(ctx, a_type, type_function(ctx, a_type, bool_type));
+    PolyType *equals_polytype = forall(a_type, equals_type);
+    push_type_env(env, intern("equals"), equals_polytype);
 
     // if : bool -> 'a -> 'a -> 'a
-    Type *b_type = new_typevar();
+    Type *b_type = new_typevar(ctx);
     Type *if_type = type_function(
-        bool_type, type_function(b_type, type_function(b_type, b_type)));
-    PolyType *if_polytype = generalize(if_type);
-    env = extend_type_env("if", if_polytype, env);
+        ctx, bool_type,
+        type_function(ctx, b_type, type_function(ctx, b_type, b_type)));
+    PolyType *if_polytype = forall(b_type, if_type);
+    push_type_env(env, intern("if"), if_polytype);
+    env->if_type = if_polytype;
 
     // multiply : int -> int -> int
-    Type *succ_type = type_function(int_type, int_type);
+    Type *succ_type = type_function(ctx, int_type, int_type);
     PolyType *succ_polytype = dont_generalize(succ_type);
-    env = extend_type_env("succ", succ_polytype, env);
+    push_type_env(env, intern("succ"), succ_polytype);
 
     return env;
 }
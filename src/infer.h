@@ -1,6 +1,11 @@
 #pragma once
+#include "error.h"
 #include "lambda.h"
 #include "types.h"
 
-Type *infer(Exp *exp, TypeEnv *env);
-TypeEnv *init_standard_type_env();
+// Infer the type of exp in env. On a type error NULL is returned, env is as
+// it was and error says what and where. The types made on the way stay in
+// the arena of ctx until released either way.
+Type *infer(InferContext *ctx, Exp *exp, TypeEnv *env, Error *error);
+// The types of the primitives, allocated in ctx
+TypeEnv *init_standard_type_env(InferContext *ctx);
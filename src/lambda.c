@@ -1,367 +1,783 @@
 #include "lambda.h"
 
+#include <limits.h>
+#include <stddef.h>
+
+#include "gc.h"
 #include "primitives.h"
 
 void string_of_value(Value v);
-static Exp *safe_malloc() {
-    void *p = malloc(sizeof(Exp));
-    if (p == NULL) {
-        fprintf(stderr, "Fatal: failed to allocate %zu bytes for expression.\n",
-                sizeof(Exp));
+// The nodes of a finished tree, preceded by their count
+typedef struct {
+    size_t count;
+    Exp nodes[];
+} ExpArena;
+
+static ExpArena *resize_arena(ExpArena *arena, unsigned int capacity) {
+    arena = realloc(arena, sizeof(ExpArena) + capacity * sizeof(Exp));
+    if (arena == NULL) {
+        fprintf(stderr,
+                "Fatal: failed to allocate %zu bytes for expressions.\n",
+                sizeof(ExpArena) + capacity * sizeof(Exp));
         exit(1);
     }
-    return p;
+    return arena;
 }
 
-Exp *make_int(unsigned int val) {
-    Exp *exp = safe_malloc();
-    exp->type = EXP_INT;
-    exp->data.int_val = val;
-    exp->inferred_type = NULL;
-    return exp;
+static ExpArena *arena_of(const ExpBuilder *builder) {
+    return (ExpArena *)((char *)builder->nodes - offsetof(ExpArena, nodes));
 }
 
-Exp *make_bool(bool val) {
-    Exp *exp = safe_malloc();
-    exp->type = EXP_BOOL;
-    exp->data.bool_val = val;
-    exp->inferred_type = NULL;
-    return exp;
+void init_exp_builder(ExpBuilder *builder) {
+    builder->capacity = 64;
+    builder->nodes = resize_arena(NULL, builder->capacity)->nodes;
+    builder->count = 1;  // The root goes first once it is known
 }
 
-Exp *make_var(const char *name) {
-    Exp *exp = safe_malloc();
-    exp->type = EXP_VAR;
-    exp->data.var_name = strdup(name);
-    exp->inferred_type = NULL;
-    return exp;
+void discard_exp_builder(ExpBuilder *builder) {
+    free(arena_of(builder));
+    builder->nodes = NULL;
 }
 
-Exp *make_lambda(const char *param, Exp *body) {
-    Exp *exp = (Exp *)safe_malloc();
-    exp->type = EXP_LAMBDA;
-    exp->data.lambda.param = strdup(param);
-    exp->data.lambda.body = body;
+static ExpId new_node(ExpBuilder *builder, ExpType type) {
+    if (builder->count == builder->capacity) {
+        if (builder->capacity > UINT_MAX / 2) {
+            fprintf(stderr, "Fatal: expression too large.\n");
+            exit(1);
+        }
+        builder->capacity *= 2;
+        builder->nodes =
+            resize_arena(arena_of(builder), builder->capacity)->nodes;
+    }
+    Exp *exp = &builder->nodes[builder->count];
+    exp->type = type;
+    exp->offset = NO_POSITION;
     exp->inferred_type = NULL;
-    return exp;
+    return builder->count++;
 }
 
-Exp *make_apply(Exp *fn, Exp *arg) {
-    Exp *exp = (Exp *)safe_malloc();
-    exp->type = EXP_APPLY;
-    exp->data.apply.fn = fn;
-    exp->data.apply.arg = arg;
-    exp->inferred_type = NULL;
-    return exp;
+static ExpRef child_ref(ExpId parent, ExpId child) {
+    return (ExpRef)child - (ExpRef)parent;
 }
 
-Exp *make_let(const char *var, Exp *e1, Exp *e2) {
-    Exp *exp = safe_malloc();
-    exp->type = EXP_LET;
-    exp->data.let.var = strdup(var);
-    exp->data.let.e1 = e1;
-    exp->data.let.e2 = e2;
-    exp->inferred_type = NULL;
-    return exp;
+ExpId make_int(ExpBuilder *builder, unsigned int val) {
+    ExpId id = new_node(builder, EXP_INT);
+    exp_at(builder, id)->data.int_val = val;
+    return id;
 }
 
-Exp *make_unit() {
-    Exp *exp = safe_malloc();
-    exp->type = EXP_UNIT;
-    exp->inferred_type = NULL;
-    return exp;
+ExpId make_bool(ExpBuilder *builder, bool val) {
+    ExpId id = new_node(builder, EXP_BOOL);
+    exp_at(builder, id)->data.bool_val = val;
+    return id;
 }
 
-// Environment operations
-Env *extend_env(const char *name, Value value, Env *env) {
-    Env *new_env = malloc(sizeof(Env));
-    new_env->name = strdup(name);
-    new_env->value = value;
-    new_env->next = env;
-    return new_env;
+ExpId make_var(ExpBuilder *builder, Symbol name) {
+    ExpId id = new_node(builder, EXP_VAR);
+    Exp *exp = exp_at(builder, id);
+    exp->data.var.name = name;
+    exp->data.var.ref.scope = VAR_LOCAL;
+    exp->data.var.ref.index = 0;
+    return id;
 }
 
-Value make_primitive(PrimitiveOp op) {
-    Value v;
-    v.type = VAL_PRIMITIVE;
-    v.data.primitive.op = op;
-    v.data.primitive.num_args = 0;
-    v.data.primitive.args[0] = NULL;
-    v.data.primitive.args[1] = NULL;
-    v.data.primitive.args[2] = NULL;
-    return v;
-}
-
-// Apply an argument to a primitive
-Value apply_primitive(Value *prim, Value *arg) {
-    if (prim->type != VAL_PRIMITIVE) {
-        fprintf(stderr, "Cannot apply to non-primitive");
-        exit(1);
-    }
-    string_of_value(*arg);
-    switch (prim->data.primitive.num_args) {
-        case 0:
-            prim->data.primitive.args[0] = arg;
-            ++(prim->data.primitive.num_args);
+ExpId make_lambda(ExpBuilder *builder, Symbol param, ExpId body) {
+    ExpId id = new_node(builder, EXP_LAMBDA);
+    Exp *exp = exp_at(builder, id);
+    exp->data.lambda.param = param;
+    exp->data.lambda.body = child_ref(id, body);
+    exp->data.lambda.frame_size = 1;
+    exp->data.lambda.num_captures = 0;
+    exp->data.lambda.captures = NULL;
+    exp->data.lambda.code = NULL;
+    exp->data.lambda.hash = 0;
+    exp->data.lambda.closed = false;
+    return id;
+}
+
+ExpId make_apply(ExpBuilder *builder, ExpId fn, ExpId arg) {
+    ExpId id = new_node(builder, EXP_APPLY);
+    Exp *exp = exp_at(builder, id);
+    exp->data.apply.fn = child_ref(id, fn);
+    exp->data.apply.arg = child_ref(id, arg);
+    exp->data.apply.tail = false;
+    return id;
+}
+
+ExpId make_let(ExpBuilder *builder, Symbol var, ExpId e1, ExpId e2) {
+    ExpId id = new_node(builder, EXP_LET);
+    Exp *exp = exp_at(builder, id);
+    exp->data.let.var = var;
+    exp->data.let.e1 = child_ref(id, e1);
+    exp->data.let.e2 = child_ref(id, e2);
+    exp->data.let.slot = 0;
+    return id;
+}
+
+ExpId make_unit(ExpBuilder *builder) { return new_node(builder, EXP_UNIT); }
+
+Exp *finish_exp(ExpBuilder *builder, ExpId root) {
+    // Move the root to the front, where free_exp() can find the array from
+    // it. Only its own references change, as nothing points to the root.
+    Exp *nodes = builder->nodes;
+    nodes[0] = nodes[root];
+    ExpRef shift = (ExpRef)root;
+    switch (nodes[0].type) {
+        case EXP_LAMBDA:
+            nodes[0].data.lambda.body += shift;
             break;
-        case 1:
-            prim->data.primitive.args[1] = arg;
-            ++(prim->data.primitive.num_args);
+        case EXP_APPLY:
+            nodes[0].data.apply.fn += shift;
+            nodes[0].data.apply.arg += shift;
             break;
-        case 2:
-            prim->data.primitive.args[2] = arg;
-            ++(prim->data.primitive.num_args);
+        case EXP_LET:
+            nodes[0].data.let.e1 += shift;
+            nodes[0].data.let.e2 += shift;
             break;
         default:
-            fprintf(stderr, "Too many arguments for ptimiitive");
-            exit(1);
+            break;
+    }
+    if (root == builder->count - 1) {
+        builder->count--;
+    }
+    ExpArena *arena = resize_arena(arena_of(builder), builder->count);
+    arena->count = builder->count;
+    builder->nodes = NULL;
+    return arena->nodes;
+}
+
+// Environment operations
+Env *new_frame(unsigned int size, Closure *closure, Value *globals) {
+    Env *frame = gc_alloc(GC_FRAME, sizeof(Env) + size * sizeof(Value));
+    frame->closure = closure;
+    frame->globals = globals;
+    frame->names = NULL;
+    frame->size = size;
+    for (unsigned int i = 0; i < size; i++) {
+        frame->slots[i] = val_unit();
+    }
+    return frame;
+}
+
+Closure *new_closure(Exp *lambda) {
+    unsigned int n = lambda->data.lambda.num_captures;
+    Closure *closure =
+        gc_alloc(GC_CLOSURE, sizeof(Closure) + n * sizeof(Value));
+    closure->lambda = lambda;
+    closure->num_captured = n;
+    return closure;
+}
+
+Value close_over(Exp *lambda, Env *env) {
+    // Copy only the free variables of the body
+    Closure *closure = new_closure(lambda);
+    for (unsigned int i = 0; i < closure->num_captured; i++) {
+        VarRef ref = lambda->data.lambda.captures[i];
+        closure->captured[i] = ref.scope == VAR_LOCAL
+                                   ? env->slots[ref.index]
+                                   : env->closure->captured[ref.index];
     }
+    return val_closure(closure);
+}
 
-    switch (prim->data.primitive.op) {
+unsigned int primitive_arity(PrimitiveOp op) {
+    switch (op) {
         case PRIM_SUCC:
-            if (prim->data.primitive.num_args == 1)
-                return prim_succ(*prim->data.primitive.args[0]);
-            break;
+            return 1;
+        case PRIM_IF:
+            return 3;
+        default:
+            return 2;
+    }
+}
+
+unsigned int exp_num_children(const Exp *exp) {
+    switch (exp->type) {
+        case EXP_LAMBDA:
+            return 1;
+        case EXP_APPLY:
+        case EXP_LET:
+            return 2;
+        case EXP_PRIM:
+            return primitive_arity(exp->data.prim.op);
+        default:
+            return 0;
+    }
+}
+
+Exp *exp_child(const Exp *exp, unsigned int i) {
+    switch (exp->type) {
+        case EXP_LAMBDA:
+            return lambda_body(exp);
+        case EXP_APPLY:
+            return i == 0 ? apply_fn(exp) : apply_arg(exp);
+        case EXP_LET:
+            return i == 0 ? let_value(exp) : let_body(exp);
+        default:
+            return prim_arg(exp, i);
+    }
+}
+
+const char *primitive_name(PrimitiveOp op) {
+    switch (op) {
         case PRIM_ADD:
+            return "add";
         case PRIM_SUBTRACT:
+            return "subtract";
         case PRIM_MULTIPLY:
+            return "multiply";
         case PRIM_EQUALS:
-            if (prim->data.primitive.num_args == 2) {
-                switch (prim->data.primitive.op) {
-                    case PRIM_ADD:
-                        return prim_add(*prim->data.primitive.args[0],
-                                        *prim->data.primitive.args[1]);
-                    case PRIM_SUBTRACT:
-                        return prim_subtract(*prim->data.primitive.args[0],
-                                             *prim->data.primitive.args[1]);
-                    case PRIM_MULTIPLY:
-                        return prim_multiply(*prim->data.primitive.args[0],
-                                             *prim->data.primitive.args[1]);
-                    case PRIM_EQUALS:
-                        return prim_equals(*prim->data.primitive.args[0],
-                                           *prim->data.primitive.args[1]);
-                    case PRIM_IF:
-                    default:
-                        break;
-                }
-            }
-            break;
-
+            return "equals";
         case PRIM_IF:
-            if (prim->data.primitive.num_args == 3) {
-                // If-then-else, we have all three arguments
-                return prim_if(*prim->data.primitive.args[0],
-                               *prim->data.primitive.args[1],
-                               *prim->data.primitive.args[2]);
-            }
-            break;
+            return "if";
+        case PRIM_SUCC:
+            return "succ";
     }
-    // Not enough arguments yet, return the partially applied primitive
-    return *prim;
+    return "<primitive>";
 }
-void string_of_env(Env *env) {
-    printf("Env: {name : %s, value : ", env->name);
-    string_of_value(env->value);
-    printf("}\n");
+
+Value make_primitive(PrimitiveOp op) {
+    return (Value){(uint64_t)op << 32 | TAG_PRIMITIVE};
 }
 
-Value *lookup_env(const char *name, Env *env) {
-    while (env != NULL) {
-        /*string_of_env(env);*/
-        if (strcmp(env->name, name) == 0) {
-            return &env->value;
-        }
-        env = env->next;
+bool unapplied_primitive(Value v, PrimitiveOp *op) {
+    if (value_tag(v) != TAG_PRIMITIVE) {
+        return false;
     }
-    return NULL;
+    *op = (PrimitiveOp)(v.bits >> 32);
+    return true;
 }
 
+// Apply an argument to a primitive. Until it has all of them, the arguments
+// are kept in a Partial on the heap.
+Value apply_primitive(Value prim, Value arg, unsigned int offset) {
+    PrimitiveOp op;
+    Value args[3];
+    unsigned int num_args = 0;
+    if (value_tag(prim) == TAG_PARTIAL) {
+        Partial *partial = as_partial(prim);
+        op = partial->op;
+        for (; num_args < partial->num_args; num_args++) {
+            args[num_args] = partial->args[num_args];
+        }
+    } else if (!unapplied_primitive(prim, &op)) {
+        runtime_error(offset, "cannot apply a non-function value");
+    }
+    args[num_args++] = arg;
+
+    if (num_args < primitive_arity(op)) {
+        // Not enough arguments yet, return the partially applied primitive
+        unsigned int saved = gc_save_roots();
+        for (unsigned int i = 0; i < num_args; i++) {
+            gc_root_value(&args[i]);
+        }
+        Partial *partial = gc_alloc(GC_PARTIAL, sizeof(Partial));
+        gc_restore_roots(saved);
+        partial->op = op;
+        partial->num_args = num_args;
+        for (unsigned int i = 0; i < num_args; i++) {
+            partial->args[i] = args[i];
+        }
+        return val_partial(partial);
+    }
+
+    switch (op) {
+        case PRIM_SUCC:
+            return prim_succ(args[0], offset);
+        case PRIM_IF:
+            return prim_if(args[0], args[1], args[2], offset);
+        default:
+            return prim_binary(op, args[0], args[1], offset);
+    }
+}
 void free_exp(Exp *exp) {
     if (exp == NULL) return;
 
-    switch (exp->type) {
-        case EXP_VAR:
-            free(exp->data.var_name);
-            break;
-        case EXP_LAMBDA:
-            free(exp->data.lambda.param);
-            free_exp(exp->data.lambda.body);
-            break;
-        case EXP_APPLY:
-            free_exp(exp->data.apply.fn);
-            free_exp(exp->data.apply.arg);
-            break;
-        case EXP_LET:
-            free(exp->data.let.var);
-            free_exp(exp->data.let.e1);
-            free_exp(exp->data.let.e2);
-            break;
-        case EXP_INT:
-        case EXP_BOOL:
-        case EXP_UNIT:
-            break;
+    ExpArena *arena = (ExpArena *)((char *)exp - offsetof(ExpArena, nodes));
+    for (size_t i = 0; i < arena->count; i++) {
+        if (arena->nodes[i].type == EXP_LAMBDA) {
+            free(arena->nodes[i].data.lambda.captures);
+        }
+    }
+    // Inferred types belong to the type arena
+    free(arena);
+}
+
+void free_value(Value value) {
+    // Closures share their captured array and lambda with every copy, so
+    // there is nothing a single value owns
+    (void)value;
+}
+
+// Indices come from resolve(), so no name comparison is needed
+static Value read_var(Exp *exp, Env *env) {
+    switch (exp->data.var.ref.scope) {
+        case VAR_LOCAL:
+            return env->slots[exp->data.var.ref.index];
+        case VAR_FREE:
+            return env->closure->captured[exp->data.var.ref.index];
+        default:
+            return env->globals[exp->data.var.ref.index];
     }
-    if (exp->inferred_type != NULL) {
-        free_type(exp->inferred_type);
+}
+
+// What eval() does with the value of the expression being evaluated
+typedef struct {
+    enum {
+        K_ARG,     // The function of an application: evaluate the argument
+        K_CALL,    // The argument of an application: call the function
+        K_RETURN,  // The body of a call: go back to the caller's frame
+        K_LET,     // The bound value of a let: evaluate the body
+        K_IF,      // The condition of an if: evaluate the branch taken
+        K_PRIM,    // An argument of a boxed primitive
+        K_RAW,     // An argument of a specialized primitive, raw
+        K_BOX,     // A specialized primitive's raw result: box it
+        K_UNBOX    // A boxed value wanted raw: take its payload
+    } kind;
+    Exp *exp;
+    Env *env;
+    union {
+        Value fn;            // K_CALL
+        Env *tail_frame;     // K_RETURN, the caller's
+        Value first;         // K_PRIM once the second argument is evaluated
+        unsigned int raw;    // K_RAW once the second argument is evaluated
+    } data;
+    unsigned int next;  // K_PRIM and K_RAW: the argument being evaluated
+} EvalKont;
+
+typedef struct {
+    EvalKont *frames;
+    unsigned int size;
+    unsigned int capacity;
+} EvalStack;
+
+static void push_kont(EvalStack *ks, EvalKont k) {
+    if (ks->size == ks->capacity) {
+        ks->capacity *= 2;
+        ks->frames = realloc(ks->frames, ks->capacity * sizeof(EvalKont));
+        if (ks->frames == NULL) {
+            fprintf(stderr, "Fatal: continuation stack exhausted\n");
+            exit(1);
+        }
     }
-    free(exp);
+    ks->frames[ks->size++] = k;
 }
 
-void free_env(Env *env) {
-    while (env != NULL) {
-        Env *next = env->next;
-        free(env->name);
-        if (env->value.type == VAL_CLOSURE) {
-            free(env->value.data.closure.param);
-            // Do not free body and env to avoid circular freeing
+static void trace_eval(void *data) {
+    EvalStack *ks = data;
+    for (unsigned int i = 0; i < ks->size; i++) {
+        EvalKont *k = &ks->frames[i];
+        gc_mark_env(k->env);
+        switch (k->kind) {
+            case K_CALL:
+                gc_mark_value(k->data.fn);
+                break;
+            case K_RETURN:
+                gc_mark_env(k->data.tail_frame);
+                break;
+            case K_PRIM:
+                if (k->next > 0) {
+                    gc_mark_value(k->data.first);
+                }
+                break;
+            default:
+                break;
         }
-        free(env);
-        env = next;
     }
 }
 
-void free_value(Value value) {
-    if (value.type == VAL_CLOSURE) {
-        free(value.data.closure.param);
-        // We doot free the body and environment here to avoid double-freeing
+// Whether the continuation on top takes its value raw
+static bool wants_raw(EvalStack *ks) {
+    if (ks->size == 0) {
+        return false;
     }
+    EvalKont *k = &ks->frames[ks->size - 1];
+    return k->kind == K_RAW || k->kind == K_BOX ||
+           (k->kind == K_IF && k->exp->data.prim.rep != REP_BOXED);
 }
 
-Value eval(Exp *exp, Env *env) {
-    Value result;
-    Value *lookup_result;
-    Value arg_val;
+// Specialized code computes ints and bools as their raw payload, which is
+// the same for both, without boxing or checking tags: its types have been
+// checked. A specialized primitive boxes only the result of the whole
+// subterm, and an int or bool computed by anything else is unboxed where a
+// specialized primitive takes it.
+static Value run_eval(Exp *exp, Env *env, EvalStack *ks) {
+    Value val = val_unit();
+    unsigned int raw = 0;
+    // Frame of the latest tail call made by the running call, reused by
+    // the next one
+    Env *tail_frame = NULL;
+
+    // The continuations and the registers are all the machine holds
+    unsigned int saved_roots = gc_save_roots();
+    gc_push_tracer(trace_eval, ks);
+    gc_root_env(&env);
+    gc_root_env(&tail_frame);
+    gc_root_value(&val);
+
+    for (;;) {
+        // Descend into exp until it yields a value, raw where the
+        // continuation on top wants it so
+        while (exp != NULL) {
+            bool want_raw = wants_raw(ks);
+            switch (exp->type) {
+                case EXP_INT:
+                    if (want_raw) {
+                        raw = exp->data.int_val;
+                    } else {
+                        val = val_int(exp->data.int_val);
+                    }
+                    break;
+                case EXP_BOOL:
+                    if (want_raw) {
+                        raw = exp->data.bool_val;
+                    } else {
+                        val = val_bool(exp->data.bool_val);
+                    }
+                    break;
+                case EXP_VAR:
+                    val = read_var(exp, env);
+                    if (want_raw) {
+                        raw = as_int(val);
+                    }
+                    break;
+
+                case EXP_PRIM: {
+                    Rep rep = exp->data.prim.rep;
+                    if (rep == REP_BOXED && want_raw) {
+                        push_kont(ks, (EvalKont){.kind = K_UNBOX});
+                    }
+                    if (exp->data.prim.op == PRIM_IF) {
+                        // Only the branch taken is evaluated, in tail
+                        // position; the condition is raw when the if is
+                        // specialized
+                        push_kont(ks, (EvalKont){.kind = K_IF, exp, env});
+                        exp = prim_arg(exp, 0);
+                        continue;
+                    }
+                    if (rep != REP_BOXED && !want_raw) {
+                        push_kont(ks, (EvalKont){.kind = K_BOX, exp});
+                    }
+                    push_kont(ks, (EvalKont){.kind = rep == REP_BOXED
+                                                         ? K_PRIM
+                                                         : K_RAW,
+                                             exp, env});
+                    exp = prim_arg(exp, 0);
+                    continue;
+                }
 
-    switch (exp->type) {
-        case EXP_UNIT:
-            result.type = VAL_UNIT;
-            return result;
-        case EXP_INT:
-            result.type = VAL_INT;
-            result.data.int_val = exp->data.int_val;
-            return result;
-
-        case EXP_BOOL:
-            result.type = VAL_BOOL;
-            result.data.bool_val = exp->data.bool_val;
-            return result;
-
-        case EXP_VAR:
-            lookup_result = lookup_env(exp->data.var_name, env);
-            if (lookup_result == NULL) {
-                fprintf(stderr, "Unbound variable: %s\n", exp->data.var_name);
-                exit(1);
+                default:
+                    // Nothing else is computed raw
+                    if (want_raw) {
+                        push_kont(ks, (EvalKont){.kind = K_UNBOX});
+                    }
+                    switch (exp->type) {
+                        case EXP_UNIT:
+                            val = val_unit();
+                            break;
+                        case EXP_LAMBDA:
+                            val = close_over(exp, env);
+                            break;
+                        case EXP_APPLY:
+                            // Evaluate the function, then the argument, and
+                            // only then check what is called, as the CEK
+                            // machine and the VM do
+                            push_kont(ks, (EvalKont){.kind = K_ARG, exp, env});
+                            exp = apply_fn(exp);
+                            continue;
+                        case EXP_LET:
+                            // The variable lives in a slot of the current
+                            // frame
+                            push_kont(ks, (EvalKont){.kind = K_LET, exp, env});
+                            exp = let_value(exp);
+                            continue;
+                        default:
+                            break;
+                    }
+                    break;
             }
-            return *lookup_result;
+            exp = NULL;
+        }
 
-        case EXP_LAMBDA:
-            result.type = VAL_CLOSURE;
-            result.data.closure.param = strdup(exp->data.lambda.param);
-            result.data.closure.body = exp->data.lambda.body;
-            result.data.closure.env = env;
-            return result;
-
-        case EXP_APPLY: {
-            // Evaluate the function expression
-            Value fn_val = eval(exp->data.apply.fn, env);
-
-            if (fn_val.type != VAL_CLOSURE && fn_val.type != VAL_PRIMITIVE) {
-                fprintf(stderr, "Cannot apply a non-function value\n");
-                exit(1);
-            }
+        // Hand the value to the innermost continuation
+        if (ks->size == 0) {
+            gc_restore_roots(saved_roots);
+            return val;
+        }
+        EvalKont *top = &ks->frames[ks->size - 1];
+        switch (top->kind) {
+            case K_ARG:
+                top->kind = K_CALL;
+                top->data.fn = val;
+                exp = apply_arg(top->exp);
+                env = top->env;
+                break;
+
+            case K_CALL: {
+                // The function stays on the stack, and so reachable, until
+                // the frame for the call has been allocated
+                Exp *apply = top->exp;
+                Value fn = top->data.fn;
+                if (!is_closure(fn)) {
+                    // Anything but a primitive is an error here
+                    val = apply_primitive(fn, val, apply->offset);
+                    ks->size--;
+                    break;
+                }
 
-            // Evaluate the argument expression
-            arg_val = eval(exp->data.apply.arg, env);
-            if (fn_val.type == VAL_CLOSURE) {
-                // Create an extended environment for the function application
-                Env *new_env = extend_env(fn_val.data.closure.param, arg_val,
-                                          fn_val.data.closure.env);
+                Exp *lambda = as_closure(fn)->lambda;
+                unsigned int frame_size = lambda->data.lambda.frame_size;
+                if (apply->data.apply.tail) {
+                    // Nothing is left to do in the current frame, so the
+                    // callee takes it over
+                    if (tail_frame == NULL || tail_frame->size < frame_size) {
+                        tail_frame =
+                            new_frame(frame_size, NULL, top->env->globals);
+                    }
+                    tail_frame->closure = as_closure(fn);
+                    tail_frame->slots[0] = val;
+                    env = tail_frame;
+                    ks->size--;
+                } else {
+                    // The body runs in a frame of its own, with tail calls
+                    // of its own
+                    Env *frame = new_frame(frame_size, as_closure(fn),
+                                           top->env->globals);
+                    frame->slots[0] = val;
+                    top->kind = K_RETURN;
+                    top->data.tail_frame = tail_frame;
+                    tail_frame = NULL;
+                    env = frame;
+                }
+                exp = lambda_body(lambda);
+                break;
+            }
 
-                // Evaluate the function body in the extended environment
-                result = eval(fn_val.data.closure.body, new_env);
+            case K_RETURN:
+                env = top->env;
+                tail_frame = top->data.tail_frame;
+                ks->size--;
+                break;
+
+            case K_LET: {
+                Exp *let = top->exp;
+                env = top->env;
+                ks->size--;
+                env->slots[let->data.let.slot] = val;
+
+                // A lambda referring to itself captured the slot before it
+                // was filled in; point those captures at the new closure
+                Exp *e1 = let_value(let);
+                if (e1->type == EXP_LAMBDA && is_closure(val)) {
+                    for (unsigned int i = 0;
+                         i < e1->data.lambda.num_captures; i++) {
+                        VarRef ref = e1->data.lambda.captures[i];
+                        if (ref.scope == VAR_LOCAL &&
+                            ref.index == let->data.let.slot) {
+                            as_closure(val)->captured[i] = val;
+                        }
+                    }
+                }
 
-                // Free the environment we created (but not the original
-                // environments) WHAT WAS I THINKING???? DON'T DO THIS!!!
-                // free(new_env->name);
-                // free(new_env);
+                // The body is in tail position
+                exp = let_body(let);
+                break;
+            }
 
-                return result;
-            } else if (fn_val.type == VAL_PRIMITIVE) {
-                return apply_primitive(&fn_val, &arg_val);
+            case K_IF: {
+                Exp *prim = top->exp;
+                bool taken;
+                if (prim->data.prim.rep != REP_BOXED) {
+                    taken = raw != 0;
+                } else {
+                    if (!is_bool(val)) {
+                        runtime_error(prim->offset,
+                                      "if expects a boolean condition");
+                    }
+                    taken = as_bool(val);
+                }
+                env = top->env;
+                ks->size--;
+                exp = prim_arg(prim, taken ? 1 : 2);
+                break;
             }
-        } break;
-        case EXP_LET: {
-            // Evaluate the value
 
-            // Create extended environment
-            Env *let_env =
-                extend_env(exp->data.let.var, (Value){.type = VAL_UNIT}, env);
+            case K_PRIM: {
+                Exp *prim = top->exp;
+                PrimitiveOp op = prim->data.prim.op;
+                if (op == PRIM_SUCC) {
+                    ks->size--;
+                    val = prim_succ(val, prim->offset);
+                } else if (top->next == 0) {
+                    top->data.first = val;
+                    top->next = 1;
+                    env = top->env;
+                    exp = prim_arg(prim, 1);
+                } else {
+                    ks->size--;
+                    val = prim_binary(op, top->data.first, val,
+                                      prim->offset);
+                }
+                break;
+            }
 
-            Value val = eval(exp->data.let.e1, let_env);
-            let_env->value = val;
-            // Evaluate the body in the extended environment
-            result = eval(exp->data.let.e2, let_env);
+            case K_RAW: {
+                Exp *prim = top->exp;
+                PrimitiveOp op = prim->data.prim.op;
+                if (op != PRIM_SUCC && top->next == 0) {
+                    top->data.raw = raw;
+                    top->next = 1;
+                    env = top->env;
+                    exp = prim_arg(prim, 1);
+                    break;
+                }
+                ks->size--;
+                switch (op) {
+                    case PRIM_SUCC:
+                        raw = raw + 1;
+                        break;
+                    case PRIM_ADD:
+                        raw = top->data.raw + raw;
+                        break;
+                    case PRIM_SUBTRACT:
+                        raw = top->data.raw - raw;
+                        break;
+                    case PRIM_MULTIPLY:
+                        raw = top->data.raw * raw;
+                        break;
+                    default:
+                        raw = top->data.raw == raw;
+                        break;
+                }
+                break;
+            }
 
-            // Free the environment we created
-            // IT MAKES SENSE HERE!!!
-            free(let_env->name);
-            free(let_env);
+            case K_BOX:
+                val = top->exp->data.prim.rep == REP_INT ? val_int(raw)
+                                                         : val_bool(raw != 0);
+                ks->size--;
+                break;
 
-            return result;
+            case K_UNBOX:
+                raw = as_int(val);
+                ks->size--;
+                break;
         }
     }
+}
 
-    // Should never reach here
-    fprintf(stderr, "Unknown expression type in eval\n");
-    exit(1);
+// Calls in tail position continue in the frame of the caller's last tail
+// call rather than growing the continuation stack
+Value eval(Exp *exp, Env *env) {
+    // A runtime error unwinds past the machine, so frees its continuations
+    // on the way
+    EvalStack ks = {malloc(64 * sizeof(EvalKont)), 0, 64};
+    RuntimeHandler handler;
+    push_runtime_handler(&handler);
+    if (setjmp(handler.jump) != 0) {
+        free(ks.frames);
+        forward_runtime_error(&handler);
+    }
+    Value val = run_eval(exp, env, &ks);
+    pop_runtime_handler(&handler);
+    free(ks.frames);
+    return val;
 }
 
-void print_exp(Exp *exp) {
-    switch (exp->type) {
-        case EXP_UNIT:
-            printf("()");
-            break;
-        case EXP_INT:
-            printf("%d", exp->data.int_val);
-            break;
-        case EXP_BOOL:
-            printf("%s", exp->data.bool_val ? "true" : "false");
-            break;
-        case EXP_VAR:
-            printf("%s", exp->data.var_name);
-            break;
-        case EXP_LAMBDA:
-            printf("(lambda %s. ", exp->data.lambda.param);
-            print_exp(exp->data.lambda.body);
-            printf(")");
-            break;
-        case EXP_APPLY:
-            printf("(");
-            print_exp(exp->data.apply.fn);
-            printf(" ");
-            print_exp(exp->data.apply.arg);
-            printf(")");
-            break;
-        case EXP_LET:
-            printf("(let %s = ", exp->data.let.var);
-            print_exp(exp->data.let.e1);
-            printf(" in ");
-            print_exp(exp->data.let.e2);
-            printf(")");
-            break;
+// What print_exp() has left to print: a subexpression, or text between
+// subexpressions when exp is NULL
+typedef struct {
+    const Exp *exp;
+    const char *text;
+} PrintItem;
+
+typedef struct {
+    PrintItem *items;
+    size_t size;
+    size_t capacity;
+} PrintStack;
+
+static void push_print(PrintStack *stack, const Exp *exp, const char *text) {
+    if (stack->size == stack->capacity) {
+        stack->capacity = stack->capacity == 0 ? 64 : stack->capacity * 2;
+        stack->items =
+            realloc(stack->items, stack->capacity * sizeof(PrintItem));
+        if (stack->items == NULL) {
+            fprintf(stderr, "Fatal: failed to grow the print stack.\n");
+            exit(1);
+        }
+    }
+    stack->items[stack->size++] = (PrintItem){exp, text};
+}
+
+// Iterative, so any nesting the parser accepts can be printed. What follows
+// a node's opening is pushed in reverse.
+void print_exp(Exp *root) {
+    PrintStack stack = {NULL, 0, 0};
+    push_print(&stack, root, NULL);
+    while (stack.size > 0) {
+        PrintItem item = stack.items[--stack.size];
+        if (item.exp == NULL) {
+            fputs(item.text, stdout);
+            continue;
+        }
+        const Exp *exp = item.exp;
+        switch (exp->type) {
+            case EXP_UNIT:
+                printf("()");
+                break;
+            case EXP_INT:
+                printf("%d", exp->data.int_val);
+                break;
+            case EXP_BOOL:
+                printf("%s", exp->data.bool_val ? "true" : "false");
+                break;
+            case EXP_VAR:
+                printf("%s", symbol_name(exp->data.var.name));
+                break;
+            case EXP_LAMBDA:
+                printf("(lambda %s. ", symbol_name(exp->data.lambda.param));
+                push_print(&stack, NULL, ")");
+                push_print(&stack, lambda_body(exp), NULL);
+                break;
+            case EXP_APPLY:
+                printf("(");
+                push_print(&stack, NULL, ")");
+                push_print(&stack, apply_arg(exp), NULL);
+                push_print(&stack, NULL, " ");
+                push_print(&stack, apply_fn(exp), NULL);
+                break;
+            case EXP_LET:
+                printf("(let %s = ", symbol_name(exp->data.let.var));
+                push_print(&stack, NULL, ")");
+                push_print(&stack, let_body(exp), NULL);
+                push_print(&stack, NULL, " in ");
+                push_print(&stack, let_value(exp), NULL);
+                break;
+            case EXP_PRIM:
+                printf("(%s", primitive_name(exp->data.prim.op));
+                push_print(&stack, NULL, ")");
+                for (unsigned int i = primitive_arity(exp->data.prim.op);
+                     i > 0; i--) {
+                    push_print(&stack, prim_arg(exp, i - 1), NULL);
+                    push_print(&stack, NULL, " ");
+                }
+                break;
+        }
     }
+    free(stack.items);
 }
 
 void string_of_value(Value value) {
-    switch (value.type) {
+    switch (value_type(value)) {
         case VAL_UNIT:
             printf("()");
             break;
         case VAL_INT:
-            printf("%d", value.data.int_val);
+            printf("%d", as_int(value));
             break;
         case VAL_BOOL:
-            printf("%s", value.data.bool_val ? "true" : "false");
+            printf("%s", as_bool(value) ? "true" : "false");
             break;
         case VAL_CLOSURE:
             printf("<lambda>");
@@ -369,5 +785,8 @@ void string_of_value(Value value) {
         case VAL_PRIMITIVE:
             printf("<primitive>");
             break;
+        case VAL_THUNK:
+            printf("<thunk>");
+            break;
     }
 }
@@ -1,9 +1,12 @@
 #pragma once
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "error.h"
+#include "symbol.h"
 #include "types.h"
 
 // Type of expressions
@@ -14,7 +17,8 @@ typedef enum {
     EXP_VAR,
     EXP_LAMBDA,
     EXP_APPLY,
-    EXP_LET  // Let binding (e.g., let x = e1 in e2)
+    EXP_LET,  // Let binding (e.g., let x = e1 in e2)
+    EXP_PRIM  // Call of a primitive with all its arguments, made by resolve()
 } ExpType;
 
 typedef enum {
@@ -26,80 +30,277 @@ typedef enum {
     PRIM_SUCC
 } PrimitiveOp;
 
+// How the value of an EXP_PRIM node is computed, decided by specialize()
+// from the inferred types: as a boxed Value, or as a raw int or bool when it
+// and all its arguments are known to be ints or bools
+typedef enum { REP_BOXED, REP_INT, REP_BOOL } Rep;
+
 // Forward declaration for Environment
 typedef struct Env Env;
 
+// Where a variable lives at runtime, as computed by resolve(): a slot of the
+// current frame, an entry of the running closure's captured array, or a
+// slot of the global frame
+typedef enum { VAR_LOCAL, VAR_FREE, VAR_GLOBAL } VarScope;
+
+// Bytecode for a lambda body, see compile.h
+typedef struct Code Code;
+
+typedef struct {
+    VarScope scope;
+    unsigned int index;
+} VarRef;
+
+// Where a child node is, counted in nodes from its parent. All the nodes of
+// a tree are in one array (see ExpBuilder), so this stays right when the
+// array moves while the tree is built.
+typedef int ExpRef;
+
 // Expression structure
 typedef struct Exp {
     ExpType type;
+    unsigned int offset;  // Of its first token in the source, for errors
     Type *inferred_type;
     union {
         unsigned int int_val;  // For EXP_INT
         bool bool_val;         // For EXP_BOOL
-        char *var_name;        // For EXP_VAR
-        struct {               // For EXP_LAMBDA
-            char *param;
-            struct Exp *body;
+        struct {               // For EXP_VAR
+            Symbol name;
+            VarRef ref;  // Set by resolve()
+        } var;
+        struct {  // For EXP_LAMBDA
+            Symbol param;
+            ExpRef body;
+            unsigned int frame_size;    // Param plus let-bound locals
+            unsigned int num_captures;  // Free variables of the lambda
+            VarRef *captures;  // Where to copy each one from on creation
+            Code *code;        // Set by compile(), owned by the Program
+            unsigned int hash;  // Of its structure, set by infer()
+            bool closed;        // Without free variables, set by infer()
         } lambda;
         struct {  // For EXP_APPLY
-            struct Exp *fn;
-            struct Exp *arg;
+            ExpRef fn;
+            ExpRef arg;
+            bool tail;  // Last thing its function body does, set by resolve()
         } apply;
         struct {  // For EXP_LET
-            char *var;
-            struct Exp *e1;
-            struct Exp *e2;
+            Symbol var;
+            ExpRef e1;
+            ExpRef e2;
+            unsigned int slot;  // Slot in the enclosing frame
         } let;
+        struct {  // For EXP_PRIM
+            PrimitiveOp op;
+            Rep rep;              // Set by specialize()
+            ExpRef args[3];  // As many as the primitive takes
+        } prim;
     } data;
 } Exp;
 
-// Closure to represent functions with their environment
-typedef struct {
-    char *param;
-    Exp *body;
-    Env *env;
-} Closure;
+static inline Exp *lambda_body(const Exp *e) {
+    return (Exp *)e + e->data.lambda.body;
+}
+static inline Exp *apply_fn(const Exp *e) {
+    return (Exp *)e + e->data.apply.fn;
+}
+static inline Exp *apply_arg(const Exp *e) {
+    return (Exp *)e + e->data.apply.arg;
+}
+static inline Exp *let_value(const Exp *e) {
+    return (Exp *)e + e->data.let.e1;
+}
+static inline Exp *let_body(const Exp *e) {
+    return (Exp *)e + e->data.let.e2;
+}
+static inline Exp *prim_arg(const Exp *e, unsigned int i) {
+    return (Exp *)e + e->data.prim.args[i];
+}
+static inline ExpRef exp_ref(const Exp *parent, const Exp *child) {
+    return (ExpRef)(child - parent);
+}
+
+// The subexpressions of exp, in the order the source has them, for walks
+// that treat every kind of node alike
+unsigned int exp_num_children(const Exp *exp);
+Exp *exp_child(const Exp *exp, unsigned int i);
 
-// Value representation for evaluation
-typedef struct Value Value;
+// A value is one tagged word. The low three bits say what it holds: ints,
+// bools, unit and unapplied primitives keep their payload in the upper 32
+// bits, while closures and partially applied primitives point to objects on
+// the collected heap (see gc.h), whose alignment leaves those bits clear, as
+// do the thunks of the lazy evaluator.
 typedef struct Value {
-    union {
-        unsigned int int_val;
-        bool bool_val;
-        Closure closure;
-        struct {
-            struct Value *args[3];
-            PrimitiveOp op;
-            unsigned int num_args;
-        } primitive;
-    } data;
-    enum { VAL_UNIT, VAL_INT, VAL_BOOL, VAL_CLOSURE, VAL_PRIMITIVE } type;
+    uint64_t bits;
 } Value;
 
+typedef enum {
+    VAL_UNIT,
+    VAL_INT,
+    VAL_BOOL,
+    VAL_CLOSURE,
+    VAL_PRIMITIVE,
+    VAL_THUNK
+} ValueType;
+
+enum {
+    TAG_CLOSURE,  // Zero, so a closure is its pointer
+    TAG_PARTIAL,
+    TAG_INT,
+    TAG_BOOL,
+    TAG_UNIT,
+    TAG_PRIMITIVE,
+    TAG_THUNK,
+    TAG_MASK = 7
+};
+
+// Flat closure: holds copies of only the free variables of its body. The
+// lambda node gives both the body for eval() and the bytecode for the VM.
+typedef struct Closure {
+    Exp *lambda;
+    unsigned int num_captured;
+    Value captured[];
+} Closure;
+
+// A primitive that has been given some but not all of its arguments
+typedef struct {
+    PrimitiveOp op;
+    unsigned int num_args;
+    Value args[2];
+} Partial;
+
+// A suspended expression of eval_lazy(), replaced by its value once forced
+typedef struct {
+    enum { THUNK_DELAYED, THUNK_FORCING, THUNK_DONE } state;
+    Exp *exp;
+    struct Env *env;  // Until forced
+    Value value;      // Once done
+} Thunk;
+
+static inline unsigned int value_tag(Value v) {
+    return (unsigned int)(v.bits & TAG_MASK);
+}
+
+static inline ValueType value_type(Value v) {
+    switch (value_tag(v)) {
+        case TAG_CLOSURE:
+            return VAL_CLOSURE;
+        case TAG_INT:
+            return VAL_INT;
+        case TAG_BOOL:
+            return VAL_BOOL;
+        case TAG_UNIT:
+            return VAL_UNIT;
+        case TAG_THUNK:
+            return VAL_THUNK;
+        default:
+            return VAL_PRIMITIVE;
+    }
+}
+
+static inline Value val_unit(void) { return (Value){TAG_UNIT}; }
+static inline Value val_int(unsigned int n) {
+    return (Value){(uint64_t)n << 32 | TAG_INT};
+}
+static inline Value val_bool(bool b) {
+    return (Value){(uint64_t)b << 32 | TAG_BOOL};
+}
+static inline Value val_closure(Closure *closure) {
+    return (Value){(uint64_t)(uintptr_t)closure};
+}
+static inline Value val_partial(Partial *partial) {
+    return (Value){(uint64_t)(uintptr_t)partial | TAG_PARTIAL};
+}
+static inline Value val_thunk(Thunk *thunk) {
+    return (Value){(uint64_t)(uintptr_t)thunk | TAG_THUNK};
+}
+
+static inline bool is_int(Value v) { return value_tag(v) == TAG_INT; }
+static inline bool is_bool(Value v) { return value_tag(v) == TAG_BOOL; }
+static inline bool is_closure(Value v) {
+    return value_tag(v) == TAG_CLOSURE;
+}
+static inline bool is_thunk(Value v) { return value_tag(v) == TAG_THUNK; }
+
+static inline unsigned int as_int(Value v) {
+    return (unsigned int)(v.bits >> 32);
+}
+static inline bool as_bool(Value v) { return (v.bits >> 32) != 0; }
+static inline Closure *as_closure(Value v) {
+    return (Closure *)(uintptr_t)v.bits;
+}
+static inline Partial *as_partial(Value v) {
+    return (Partial *)(uintptr_t)(v.bits & ~(uint64_t)TAG_MASK);
+}
+static inline Thunk *as_thunk(Value v) {
+    return (Thunk *)(uintptr_t)(v.bits & ~(uint64_t)TAG_MASK);
+}
+
+// Number of arguments a primitive takes, and the global it is bound to
+unsigned int primitive_arity(PrimitiveOp op);
+const char *primitive_name(PrimitiveOp op);
 Value make_primitive(PrimitiveOp op);
-Value apply_primitive(Value *prim, Value *arg);
+// The primitive of an unapplied primitive value, false for anything else
+bool unapplied_primitive(Value v, PrimitiveOp *op);
+// A runtime error is reported at offset, that of the application
+Value apply_primitive(Value prim, Value arg, unsigned int offset);
 
-// Environment for variable bindings
+// Environment frame: one per function activation, holding the parameter
+// in slot 0 followed by the let-bound locals of the body, plus the running
+// closure, whose captured values the body reads, and the global slots. Only
+// the global frame carries names; they are used by resolve() and never at
+// runtime. Frames and closures live on the collected heap, see gc.h.
 struct Env {
-    char *name;
-    Value value;
-    Env *next;
+    Closure *closure;
+    Value *globals;
+    const Symbol *names;
+    unsigned int size;
+    Value slots[];
 };
 
-// Function declarations
-Exp *make_int(unsigned int val);
-Exp *make_bool(bool val);
-Exp *make_var(const char *name);
-Exp *make_lambda(const char *param, Exp *body);
-Exp *make_apply(Exp *fn, Exp *arg);
-Exp *make_let(const char *var, Exp *val, Exp *body);
-Exp *make_unit();
+// A tree is built in one array, children before their parents, and its
+// nodes named by their index meanwhile, as the array moves when it grows.
+// finish_exp() puts the root first and fixes the array in memory; free_exp()
+// on the root then frees the whole tree at once. Index 0 is kept for the
+// root, so NO_EXP can stand for no node.
+typedef unsigned int ExpId;
+#define NO_EXP 0
+
+typedef struct {
+    Exp *nodes;
+    unsigned int count;
+    unsigned int capacity;
+} ExpBuilder;
+
+void init_exp_builder(ExpBuilder *builder);
+// Drop a tree that will not be finished
+void discard_exp_builder(ExpBuilder *builder);
+Exp *finish_exp(ExpBuilder *builder, ExpId root);
+static inline Exp *exp_at(const ExpBuilder *builder, ExpId id) {
+    return &builder->nodes[id];
+}
+
+ExpId make_int(ExpBuilder *builder, unsigned int val);
+ExpId make_bool(ExpBuilder *builder, bool val);
+ExpId make_var(ExpBuilder *builder, Symbol name);
+ExpId make_lambda(ExpBuilder *builder, Symbol param, ExpId body);
+ExpId make_apply(ExpBuilder *builder, ExpId fn, ExpId arg);
+ExpId make_let(ExpBuilder *builder, Symbol var, ExpId val, ExpId body);
+ExpId make_unit(ExpBuilder *builder);
+// Record where a node starts, for the parser
+static inline ExpId at_offset(ExpBuilder *builder, ExpId id,
+                              unsigned int offset) {
+    exp_at(builder, id)->offset = offset;
+    return id;
+}
 
-Env *extend_env(const char *name, Value value, Env *env);
-Value *lookup_env(const char *name, Env *env);
-void free_env(Env *env);
+Env *new_frame(unsigned int size, Closure *closure, Value *globals);
+// A closure over lambda whose captured values are still to be filled in
+Closure *new_closure(Exp *lambda);
+// A closure over lambda with its free variables copied from env
+Value close_over(Exp *lambda, Env *env);
 
 Value eval(Exp *exp, Env *env);
+// Free a tree given its root, as returned by finish_exp()
 void free_exp(Exp *exp);
 void free_value(Value value);
 
@@ -0,0 +1,297 @@
+#include "lazy.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "gc.h"
+#include "primitives.h"
+
+// What to do with the value of the expression being evaluated, which is
+// forced before it is handed on
+typedef struct {
+    enum {
+        K_CALL,    // The function of an application: call it
+        K_STRICT,  // The argument of a primitive called with it: apply it
+        K_PRIM,    // An argument of a primitive: evaluate the next or apply
+        K_UPDATE   // The expression of a thunk: overwrite it with the value
+    } kind;
+    union {
+        struct {
+            Exp *exp;  // The application
+            Env *env;
+        } call;  // K_CALL
+        struct {
+            Value fn;
+            Exp *exp;  // The application, for where an error is
+        } strict;      // K_STRICT
+        struct {
+            Exp *exp;
+            Env *env;
+            Value first;        // Once the second argument is being evaluated
+            unsigned int next;  // Index of the argument being evaluated
+        } prim;                 // K_PRIM
+        Value thunk;            // K_UPDATE
+    } data;
+} Kont;
+
+typedef struct {
+    Kont *frames;
+    unsigned int size;
+    unsigned int capacity;
+} KontStack;
+
+static void push(KontStack *ks, Kont k) {
+    if (ks->size == ks->capacity) {
+        ks->capacity *= 2;
+        ks->frames = realloc(ks->frames, ks->capacity * sizeof(Kont));
+        if (ks->frames == NULL) {
+            fprintf(stderr, "Fatal: continuation stack exhausted\n");
+            exit(1);
+        }
+    }
+    ks->frames[ks->size++] = k;
+}
+
+static void trace_konts(void *data) {
+    KontStack *ks = data;
+    for (unsigned int i = 0; i < ks->size; i++) {
+        Kont *k = &ks->frames[i];
+        switch (k->kind) {
+            case K_CALL:
+                gc_mark_env(k->data.call.env);
+                break;
+            case K_STRICT:
+                gc_mark_value(k->data.strict.fn);
+                break;
+            case K_PRIM:
+                gc_mark_env(k->data.prim.env);
+                if (k->data.prim.next > 0) {
+                    gc_mark_value(k->data.prim.first);
+                }
+                break;
+            case K_UPDATE:
+                gc_mark_value(k->data.thunk);
+                break;
+        }
+    }
+}
+
+static Value lookup(Exp *exp, Env *env) {
+    switch (exp->data.var.ref.scope) {
+        case VAR_LOCAL:
+            return env->slots[exp->data.var.ref.index];
+        case VAR_FREE:
+            return env->closure->captured[exp->data.var.ref.index];
+        case VAR_GLOBAL:
+            return env->globals[exp->data.var.ref.index];
+    }
+    return val_unit();
+}
+
+// Suspend exp in env. resolve() never reuses a slot of a frame, so what
+// the thunk reads of env stays as it is and the frame can be shared.
+static Value delay(Exp *exp, Env *env) {
+    switch (exp->type) {
+        case EXP_UNIT:
+            return val_unit();
+        case EXP_INT:
+            return val_int(exp->data.int_val);
+        case EXP_BOOL:
+            return val_bool(exp->data.bool_val);
+        case EXP_VAR:
+            return lookup(exp, env);
+        case EXP_LAMBDA:
+            return close_over(exp, env);
+        default:
+            break;
+    }
+
+    unsigned int saved_roots = gc_save_roots();
+    gc_root_env(&env);
+    Thunk *thunk = gc_alloc(GC_THUNK, sizeof(Thunk));
+    thunk->state = THUNK_DELAYED;
+    thunk->exp = exp;
+    thunk->env = env;
+    gc_restore_roots(saved_roots);
+    return val_thunk(thunk);
+}
+
+static Value run_lazy(Exp *exp, Env *env, KontStack *ks) {
+    Value val = val_unit();
+
+    // The continuations and the registers are all the machine holds
+    unsigned int saved_roots = gc_save_roots();
+    gc_push_tracer(trace_konts, ks);
+    gc_root_env(&env);
+    gc_root_value(&val);
+
+    for (;;) {
+        // Descend into exp until it yields a value, possibly a thunk
+        while (exp != NULL) {
+            switch (exp->type) {
+                case EXP_UNIT:
+                case EXP_INT:
+                case EXP_BOOL:
+                case EXP_VAR:
+                case EXP_LAMBDA:
+                    val = delay(exp, env);
+                    break;
+
+                case EXP_APPLY:
+                    push(ks, (Kont){K_CALL, .data.call = {exp, env}});
+                    exp = apply_fn(exp);
+                    continue;
+
+                case EXP_LET: {
+                    Exp *e1 = let_value(exp);
+                    unsigned int slot = exp->data.let.slot;
+                    val = delay(e1, env);
+                    env->slots[slot] = val;
+
+                    // As in eval(), a recursive lambda captured its own
+                    // slot before it was filled in
+                    if (e1->type == EXP_LAMBDA) {
+                        for (unsigned int i = 0;
+                             i < e1->data.lambda.num_captures; i++) {
+                            VarRef ref = e1->data.lambda.captures[i];
+                            if (ref.scope == VAR_LOCAL && ref.index == slot) {
+                                as_closure(val)->captured[i] = val;
+                            }
+                        }
+                    }
+                    exp = let_body(exp);
+                    continue;
+                }
+
+                case EXP_PRIM:
+                    push(ks, (Kont){K_PRIM, .data.prim = {exp, env,
+                                                           val_unit(), 0}});
+                    exp = prim_arg(exp, 0);
+                    continue;
+            }
+            exp = NULL;
+        }
+
+        // Every continuation needs the value, so a thunk is forced here:
+        // its expression runs above an update of it, however long the
+        // chain of thunks it depends on
+        if (is_thunk(val)) {
+            Thunk *thunk = as_thunk(val);
+            switch (thunk->state) {
+                case THUNK_DONE:
+                    val = thunk->value;
+                    break;
+                case THUNK_FORCING:
+                    runtime_error(thunk->exp->offset,
+                                  "infinite loop, a value depends on itself");
+                case THUNK_DELAYED:
+                    thunk->state = THUNK_FORCING;
+                    push(ks, (Kont){K_UPDATE, .data.thunk = val});
+                    exp = thunk->exp;
+                    env = thunk->env;
+                    continue;
+            }
+        }
+
+        // Hand the value to the innermost continuation
+        if (ks->size == 0) {
+            gc_restore_roots(saved_roots);
+            return val;
+        }
+        Kont *top = &ks->frames[ks->size - 1];
+        switch (top->kind) {
+            case K_CALL: {
+                Exp *apply = top->data.call.exp;
+                ValueType fn_type = value_type(val);
+                if (fn_type != VAL_CLOSURE && fn_type != VAL_PRIMITIVE) {
+                    runtime_error(apply->offset,
+                                  "cannot apply a non-function value");
+                }
+                if (fn_type == VAL_PRIMITIVE) {
+                    // Primitives are strict in their arguments
+                    exp = apply_arg(apply);
+                    env = top->data.call.env;
+                    top->kind = K_STRICT;
+                    top->data.strict.fn = val;
+                    top->data.strict.exp = apply;
+                    break;
+                }
+
+                // Thunks may hold on to a frame, so every call gets a fresh
+                // one. The closure stays reachable from val meanwhile.
+                Env *caller = top->data.call.env;
+                Value arg = delay(apply_arg(apply), caller);
+                Exp *lambda = as_closure(val)->lambda;
+                unsigned int saved = gc_save_roots();
+                gc_root_value(&arg);
+                env = new_frame(lambda->data.lambda.frame_size,
+                                as_closure(val), caller->globals);
+                gc_restore_roots(saved);
+                env->slots[0] = arg;
+                ks->size--;
+                exp = lambda_body(lambda);
+                break;
+            }
+
+            case K_STRICT:
+                ks->size--;
+                val = apply_primitive(top->data.strict.fn, val,
+                                      top->data.strict.exp->offset);
+                break;
+
+            case K_PRIM: {
+                Exp *prim = top->data.prim.exp;
+                PrimitiveOp op = prim->data.prim.op;
+                if (op == PRIM_IF) {
+                    // Continue with the branch taken, in tail position
+                    if (!is_bool(val)) {
+                        runtime_error(prim->offset,
+                                      "if expects a boolean condition");
+                    }
+                    env = top->data.prim.env;
+                    ks->size--;
+                    exp = prim_arg(prim, as_bool(val) ? 1 : 2);
+                } else if (op == PRIM_SUCC) {
+                    ks->size--;
+                    val = prim_succ(val, prim->offset);
+                } else if (top->data.prim.next == 0) {
+                    top->data.prim.first = val;
+                    top->data.prim.next = 1;
+                    env = top->data.prim.env;
+                    exp = prim_arg(prim, 1);
+                } else {
+                    ks->size--;
+                    val = prim_binary(op, top->data.prim.first, val,
+                                      prim->offset);
+                }
+                break;
+            }
+
+            case K_UPDATE: {
+                // The frame is no longer needed once the value is known
+                Thunk *thunk = as_thunk(top->data.thunk);
+                ks->size--;
+                thunk->value = val;
+                thunk->state = THUNK_DONE;
+                thunk->env = NULL;
+                break;
+            }
+        }
+    }
+}
+
+Value eval_lazy(Exp *exp, Env *env) {
+    // A runtime error unwinds past the machine, so frees its continuations
+    // on the way
+    KontStack ks = {malloc(64 * sizeof(Kont)), 0, 64};
+    RuntimeHandler handler;
+    push_runtime_handler(&handler);
+    if (setjmp(handler.jump) != 0) {
+        free(ks.frames);
+        forward_runtime_error(&handler);
+    }
+    Value val = run_lazy(exp, env, &ks);
+    pop_runtime_handler(&handler);
+    free(ks.frames);
+    return val;
+}
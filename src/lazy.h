@@ -0,0 +1,10 @@
+#pragma once
+#include "lambda.h"
+
+// Evaluate a resolved expression call-by-need: the argument of an
+// application and the bound value of a let become thunks, evaluated the
+// first time their value is needed and then overwritten with it, so an
+// argument that is never used is never evaluated and one that is used
+// repeatedly is evaluated once. Literals, lambdas and variables are already
+// values and are passed on as they are. The result is never a thunk.
+Value eval_lazy(Exp *exp, Env *env);
@@ -1,169 +1,132 @@
 #include "lexer.h"
 
-#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-Lexer *lexer_init(const char *input) {
-    Lexer *lexer = (Lexer *)malloc(sizeof(Lexer));
+void lexer_init(Lexer *lexer, const char *input, unsigned int length,
+                unsigned int position) {
     lexer->input = input;
-    lexer->position = 0;
-    lexer->line = 1;
-    lexer->column = 1;
-
-    // Initialize token
-    lexer->current.type = TOKEN_EOF;
+    lexer->length = length;
+    lexer->position = position;
+    lexer->scanner = get_scanner(scan_level());
 
     // Get the first token
     lexer_next(lexer);
+}
 
-    return lexer;
+// Skip whitespace and comments from p
+static const char *skip_whitespace(const Scanner *scanner, const char *p,
+                                   const char *end) {
+    for (;;) {
+        // Most runs between tokens are a single space, too short to be
+        // worth a call
+        while (p < end && *p == ' ') {
+            p++;
+        }
+        if (p < end && is_space_char(*p)) {
+            p = scanner->spaces(p, end);
+        }
+        if (p == end || *p != '#') {
+            return p;
+        }
+        const char *newline = memchr(p, '\n', (size_t)(end - p));
+        p = newline != NULL ? newline : end;
+    }
 }
 
-static void skip_whitespace(Lexer *lexer) {
-    while (lexer->input[lexer->position] != '\0') {
-        if (isspace(lexer->input[lexer->position])) {
-            if (lexer->input[lexer->position] == '\n') {
-                lexer->line++;
-                lexer->column = 1;
-            } else {
-                lexer->column++;
+// The keyword spelled by the length characters at p, or TOKEN_IDENTIFIER
+static TokenType keyword(const char *p, unsigned int length) {
+    switch (length) {
+        case 2:
+            return memcmp(p, "in", 2) == 0 ? TOKEN_IN : TOKEN_IDENTIFIER;
+        case 3:
+            return memcmp(p, "let", 3) == 0 ? TOKEN_LET : TOKEN_IDENTIFIER;
+        case 4:
+            if (memcmp(p, "true", 4) == 0) {
+                return TOKEN_TRUE;
             }
-            lexer->position++;
-        } else if (lexer->input[lexer->position] == '#') {
-            // Skip comments
-            while (lexer->input[lexer->position] != '\0' &&
-                   lexer->input[lexer->position] != '\n') {
-                lexer->position++;
-            }
-        } else {
-            break;
-        }
+            return memcmp(p, "unit", 4) == 0 ? TOKEN_UNIT : TOKEN_IDENTIFIER;
+        case 5:
+            return memcmp(p, "false", 5) == 0 ? TOKEN_FALSE
+                                              : TOKEN_IDENTIFIER;
+        default:
+            return TOKEN_IDENTIFIER;
     }
 }
-static bool is_id_char(char c) { return isalnum(c) || c == '_' || c == '\''; }
 
 // Get the next token
 void lexer_next(Lexer *lexer) {
-    // Free previous token if needed
-    if (lexer->current.type == TOKEN_IDENTIFIER) {
-        free(lexer->current.data.identifier);
-    }
-
-    // Skip whitespace and comments
-    skip_whitespace(lexer);
-
-    // Check for end of input
-    if (lexer->input[lexer->position] == '\0') {
-        lexer->current.type = TOKEN_EOF;
+    const char *end = lexer->input + lexer->length;
+    const char *begin =
+        skip_whitespace(lexer->scanner, lexer->input + lexer->position, end);
+    const char *p = begin;
+    Token *token = &lexer->current;
+
+    if (p == end) {
+        token->type = TOKEN_EOF;
+        token->offset = lexer->length;
+        token->length = 0;
         return;
     }
-
-    // Check for single character tokens
-    switch (lexer->input[lexer->position]) {
+    switch (*p) {
         case '(':
-            lexer->current.type = TOKEN_LPAREN;
-            lexer->position++;
-            lexer->column++;
-            return;
-
+            token->type = TOKEN_LPAREN;
+            p++;
+            break;
         case ')':
-            lexer->current.type = TOKEN_RPAREN;
-            lexer->position++;
-            lexer->column++;
-            return;
-
+            token->type = TOKEN_RPAREN;
+            p++;
+            break;
         case '.':
-            lexer->current.type = TOKEN_DOT;
-            lexer->position++;
-            lexer->column++;
-            return;
-
+            token->type = TOKEN_DOT;
+            p++;
+            break;
         case '=':
-            lexer->current.type = TOKEN_EQUALS;
-            lexer->position++;
-            lexer->column++;
-            return;
-
+            token->type = TOKEN_EQUALS;
+            p++;
+            break;
         case '\\':  // Lambda
-            lexer->current.type = TOKEN_LAMBDA;
-            lexer->position++;
-            lexer->column++;
-            return;
-    }
-
-    // Check for numbers
-    if (isdigit(lexer->input[lexer->position])) {
-        int value = 0;
-        int start_pos = lexer->position;
-
-        while (isdigit(lexer->input[lexer->position])) {
-            value = value * 10 + (lexer->input[lexer->position] - '0');
-            lexer->position++;
-        }
-
-        lexer->current.type = TOKEN_INT;
-        lexer->current.data.int_val = value;
-        lexer->column += (lexer->position - start_pos);
-        return;
-    }
-
-    // Check for identifiers and keywords
-    if (isalpha(lexer->input[lexer->position]) ||
-        lexer->input[lexer->position] == '_') {
-        int start_pos = lexer->position;
-
-        while (is_id_char(lexer->input[lexer->position])) {
-            lexer->position++;
-        }
-
-        int len = lexer->position - start_pos;
-        lexer->column += (int)len;
-
-        // Check for keywords
-        if (len == 3 && strncmp(lexer->input + start_pos, "let", 3) == 0) {
-            lexer->current.type = TOKEN_LET;
-        } else if (len == 2 &&
-                   strncmp(lexer->input + start_pos, "in", 2) == 0) {
-            lexer->current.type = TOKEN_IN;
-        } else if (len == 4 &&
-                   strncmp(lexer->input + start_pos, "true", 4) == 0) {
-            lexer->current.type = TOKEN_TRUE;
-        } else if (len == 5 &&
-                   strncmp(lexer->input + start_pos, "false", 5) == 0) {
-            lexer->current.type = TOKEN_FALSE;
-        } else if (len == 4 &&
-                   strncmp(lexer->input + start_pos, "unit", 4) == 0) {
-            lexer->current.type = TOKEN_UNIT;
-        } else {
-            // Regular identifier
-            lexer->current.type = TOKEN_IDENTIFIER;
-            lexer->current.data.identifier = (char *)malloc(len + 1);
-            strncpy(lexer->current.data.identifier, lexer->input + start_pos,
-                    len);
-            lexer->current.data.identifier[len] = '\0';
-        }
-
-        return;
+            token->type = TOKEN_LAMBDA;
+            p++;
+            break;
+        case ';':
+            if (p + 1 < end && p[1] == ';') {
+                token->type = TOKEN_END;
+                p += 2;
+            } else {
+                token->type = TOKEN_ERROR;
+                p++;
+            }
+            break;
+        default:
+            if (is_digit_char(*p)) {
+                int value = 0;
+                while (p < end && is_digit_char(*p)) {
+                    value = value * 10 + (*p - '0');
+                    p++;
+                }
+                token->type = TOKEN_INT;
+                token->int_val = value;
+            } else if (is_alpha_char(*p) || *p == '_') {
+                p = lexer->scanner->identifier(p + 1, end);
+                token->type = keyword(begin, (unsigned int)(p - begin));
+            } else {
+                // Left for the parser to report
+                token->type = TOKEN_ERROR;
+                p++;
+            }
+            break;
     }
 
-    fprintf(stderr, "Unexpected character '%c' at line %d, column %d\n",
-            lexer->input[lexer->position], lexer->line, lexer->column);
-    exit(1);
-}
-
-void lexer_free(Lexer *lexer) {
-    if (lexer->current.type == TOKEN_IDENTIFIER) {
-        free(lexer->current.data.identifier);
-    }
-    free(lexer);
+    token->offset = (unsigned int)(begin - lexer->input);
+    token->length = (unsigned int)(p - begin);
+    lexer->position = (unsigned int)(p - lexer->input);
 }
 
-void token_free(Token *token) {
-    if (token->type == TOKEN_IDENTIFIER) {
-        free(token->data.identifier);
-    }
+Symbol token_symbol(const Lexer *lexer) {
+    return intern_n(lexer->input + lexer->current.offset,
+                    lexer->current.length);
 }
 
 char *string_of_tokentype(TokenType tt) {
@@ -194,6 +157,10 @@ char *string_of_tokentype(TokenType tt) {
             return "FALSE\0";
         case TOKEN_UNIT:
             return "UNIT\0";
+        case TOKEN_END:
+            return "END\0";
+        case TOKEN_ERROR:
+            return "ERROR\0";
         default:
             return "NotImplemented";
     }
@@ -2,6 +2,9 @@
 
 #include <stdbool.h>
 
+#include "scan.h"
+#include "symbol.h"
+
 typedef enum {
     TOKEN_EOF,
     TOKEN_LPAREN,
@@ -15,24 +18,31 @@ typedef enum {
     TOKEN_INT,
     TOKEN_TRUE,
     TOKEN_FALSE,
-    TOKEN_UNIT
+    TOKEN_UNIT,
+    TOKEN_END,   // ";;", ending an expression in a program
+    TOKEN_ERROR  // A character no token starts with
 } TokenType;
+// A token is a view of the input it was read from and owns nothing. An
+// identifier is interned only when the parser builds a node that names it.
 typedef struct {
     TokenType type;
-    union {
-        char *identifier;
-        int int_val;
-    } data;
+    unsigned int offset;  // Into the input
+    unsigned int length;
+    int int_val;  // For TOKEN_INT
 } Token;
+// The input need not be NUL-terminated, so that a mapped file can be read
+// in place
 typedef struct {
     const char *input;
-    int position;
-    int line;
-    int column;
+    unsigned int length;
+    unsigned int position;
+    const Scanner *scanner;  // The one for scan_level() when initialized
     Token current;
 } Lexer;
-Lexer *lexer_init(const char *input);
+// Start reading length bytes of input at position
+void lexer_init(Lexer *lexer, const char *input, unsigned int length,
+                unsigned int position);
 void lexer_next(Lexer *lexer);
-void lexer_free(Lexer *lexer);
-void token_free(Token *token);
+// The symbol for the current token, which must be an identifier
+Symbol token_symbol(const Lexer *lexer);
 char *string_of_tokentype(TokenType tt);
@@ -1,32 +1,158 @@
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <setjmp.h>
 #include <stdio.h>
 #include <readline/history.h>
 #include <readline/readline.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "batch.h"
+#include "cek.h"
+#include "compile.h"
+#include "error.h"
+#include "gc.h"
 #include "infer.h"
+#include "lazy.h"
 #include "lambda.h"
 #include "parser.h"
 #include "primitives.h"
+#include "resolve.h"
+#include "specialize.h"
+#include "vm.h"
 
 #define INPUT_BUFFER_SIZE 1024
 
-#define MAX_LINE_LENGTH 1024
+// Evaluation backend, selected on the command line
+typedef enum { ENGINE_EVAL, ENGINE_CEK, ENGINE_VM, ENGINE_LAZY } Engine;
+static Engine engine = ENGINE_EVAL;
+static bool show_gc_stats = false;
+// Inference state. The types inferred for each expression are freed back to
+// those of the standard environment once it has been evaluated.
+static InferContext *checker;
+static TypeMark standard_types;
+
+// Evaluate a resolved, type-checked expression with the selected engine
+static Value run(Exp *exp, unsigned int frame_size, Env *runtime_env) {
+    specialize(exp);
+    if (engine == ENGINE_VM) {
+        // The program is freed also when a runtime error unwinds past
+        Program *program = compile(exp, frame_size);
+        RuntimeHandler handler;
+        push_runtime_handler(&handler);
+        if (setjmp(handler.jump) != 0) {
+            free_program(program);
+            forward_runtime_error(&handler);
+        }
+        Value result = vm_run(program, runtime_env);
+        pop_runtime_handler(&handler);
+        free_program(program);
+        return result;
+    }
+    Env *frame = new_frame(frame_size, NULL, runtime_env->slots);
+    switch (engine) {
+        case ENGINE_CEK:
+            return eval_cek(exp, frame);
+        case ENGINE_LAZY:
+            return eval_lazy(exp, frame);
+        default:
+            return eval(exp, frame);
+    }
+}
+
+// Resolve and run a type-checked expression, catching an error in error
+// rather than ending the session. Returns false if there was one.
+static bool try_run(Exp *exp, Env *runtime_env, Value *result, Error *error) {
+    unsigned int frame_size;
+    if (!resolve(exp, runtime_env, &frame_size, error)) {
+        return false;
+    }
+    RuntimeHandler handler;
+    push_runtime_handler(&handler);
+    unsigned int saved_roots = gc_save_roots();
+    if (setjmp(handler.jump) != 0) {
+        gc_restore_roots(saved_roots);
+        pop_runtime_handler(&handler);
+        *error = handler.error;
+        return false;
+    }
+    *result = run(exp, frame_size, runtime_env);
+    pop_runtime_handler(&handler);
+    return true;
+}
+
+// Print an error in source to stderr. Errors in a file are placed by the
+// file name and line the source starts on.
+static void report_error(const Error *error, const char *source,
+                         const char *filename, int first_line) {
+    int line, column;
+    error_position(error, source, &line, &column);
+    if (filename == NULL) {
+        char *message = error_to_string(error, source);
+        fprintf(stderr, "%s\n", message);
+        free(message);
+    } else if (line == 0) {
+        fprintf(stderr, "%s:%d: %s error: %s\n", filename, first_line,
+                error_kind_name(error->kind), error->message);
+    } else {
+        fprintf(stderr, "%s:%d:%d: %s error: %s\n", filename,
+                first_line + line - 1, column, error_kind_name(error->kind),
+                error->message);
+    }
+}
+
+// Type-check a parsed expression from source, then run it and print its
+// type and value. Returns false, having reported it, if either fails. The
+// caller frees exp afterwards; the types released here refer to it.
+static bool check_and_run(Exp *exp, const char *source, const char *filename,
+                          int first_line, Env *runtime_env,
+                          TypeEnv *type_env) {
+    Error error;
+    Type *type = infer(checker, exp, type_env, &error);
+    if (type == NULL) {
+        report_error(&error, source, filename, first_line);
+        type_arena_release(checker, standard_types);
+        return false;
+    }
+    char *type_str = type_to_string(type);
+    printf("Type: %s\n", type_str);
+    free(type_str);
+
+    Value result;
+    bool ok = try_run(exp, runtime_env, &result, &error);
+    if (ok) {
+        printf("Value: ");
+        string_of_value(result);
+        printf("\n\n");
+    } else {
+        report_error(&error, source, filename, first_line);
+    }
+    type_arena_release(checker, standard_types);
+    return ok;
+}
+
+// Returns false if the file could not be read or any line in it failed
 bool process_file_line_by_line(const char *filename, Env *runtime_env,
                                TypeEnv *type_env) {
     FILE *file = NULL;
-    char line[MAX_LINE_LENGTH];
+    char *line = NULL;
+    size_t line_capacity = 0;
     int line_count = 0;
+    bool ok = true;
     file = fopen(filename, "r");
     if (!file) {
         fprintf(stderr, "Error opening file '%s': %s\n", filename,
                 strerror(errno));
         return false;
     }
-    while (fgets(line, sizeof(line), file) != NULL) {
+    ssize_t read;
+    while ((read = getline(&line, &line_capacity, file)) != -1) {
         line_count++;
-        size_t line_len = strlen(line);
+        size_t line_len = (size_t)read;
         if (line_len > 0 && line[line_len - 1] == '\n') {
             line[line_len - 1] = '\0';
             line_len--;
@@ -38,25 +164,25 @@ bool process_file_line_by_line(const char *filename, Env *runtime_env,
         // Process the line
         printf("%s\n", line);
 
-        Exp *exp = NULL;
-
-        exp = parse(line);
+        Error error;
+        Exp *exp = parse(line, &error);
+        if (exp == NULL) {
+            report_error(&error, line, filename, line_count);
+            ok = false;
+            continue;
+        }
         printf("Expression: ");
         print_exp(exp);
         printf("\n");
-
-        Type *type = infer(exp, type_env);
-        char *type_str = type_to_string(type);
-        printf("Type: %s\n", type_str);
-
-        Value result = eval(exp, runtime_env);
-        printf("Value: ");
-        string_of_value(result);
-        printf("\n\n");
-
-        // Free the expression when done
+        if (!check_and_run(exp, line, filename, line_count, runtime_env,
+                           type_env)) {
+            ok = false;
+        }
+        free_exp(exp);
     }
 
+    free(line);
+
     // Check if we stopped because of an error
     if (ferror(file)) {
         fprintf(stderr, "Error reading file: %s\n", strerror(errno));
@@ -66,34 +192,195 @@ bool process_file_line_by_line(const char *filename, Env *runtime_env,
 
     // Cleanup
     fclose(file);
-    return true;
+    return ok;
+}
+
+// Run a file as one program of expressions each ended by ";;", which may
+// span lines. The file is mapped and parsed in place. Returns false if the
+// file could not be read or any expression in it failed.
+bool process_program(const char *filename, Env *runtime_env,
+                     TypeEnv *type_env) {
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "Error opening file '%s': %s\n", filename,
+                strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        return false;
+    }
+    // Offsets into the source are unsigned ints
+    if ((unsigned long long)st.st_size >= UINT_MAX) {
+        fprintf(stderr, "File '%s' is too large\n", filename);
+        close(fd);
+        return false;
+    }
+    unsigned int length = (unsigned int)st.st_size;
+    const char *source = "";
+    if (length > 0) {
+        source = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (source == MAP_FAILED) {
+            fprintf(stderr, "Error mapping file '%s': %s\n", filename,
+                    strerror(errno));
+            close(fd);
+            return false;
+        }
+        madvise((void *)source, length, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    bool ok = true;
+    unsigned int position = 0;
+    for (;;) {
+        Exp *exp;
+        Error error;
+        ParseResult parsed =
+            parse_next(source, length, &position, &exp, &error);
+        if (parsed == PARSE_END) {
+            break;
+        }
+        if (parsed == PARSE_ERROR) {
+            report_error(&error, source, filename, 1);
+            ok = false;
+            continue;
+        }
+        if (!check_and_run(exp, source, filename, 1, runtime_env,
+                           type_env)) {
+            ok = false;
+        }
+        free_exp(exp);
+    }
+
+    if (length > 0) {
+        munmap((void *)source, length);
+    }
+    return ok;
 }
+// Type-check every line of a file without evaluating, spreading the lines
+// over jobs threads, and print their types or errors in order. Returns
+// false if the file could not be read or any line did not check.
+bool check_file(const char *filename, unsigned int jobs) {
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        fprintf(stderr, "Error opening file '%s': %s\n", filename,
+                strerror(errno));
+        return false;
+    }
+    char **lines = NULL;
+    unsigned int count = 0;
+    unsigned int capacity = 0;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t read;
+    while ((read = getline(&line, &line_capacity, file)) != -1) {
+        size_t line_len = (size_t)read;
+        if (line_len > 0 && line[line_len - 1] == '\n') {
+            line[--line_len] = '\0';
+        }
+        if (line_len == 0) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            lines = realloc(lines, capacity * sizeof(char *));
+            if (lines == NULL) {
+                fprintf(stderr, "Fatal: failed to allocate lines.\n");
+                exit(1);
+            }
+        }
+        lines[count++] = strdup(line);
+    }
+    free(line);
+    if (ferror(file)) {
+        fprintf(stderr, "Error reading file: %s\n", strerror(errno));
+        fclose(file);
+        return false;
+    }
+    fclose(file);
+
+    char **types = malloc((count == 0 ? 1 : count) * sizeof(char *));
+    unsigned int failures =
+        check_batch((const char *const *)lines, count, types, jobs);
+    for (unsigned int i = 0; i < count; i++) {
+        printf("%s : %s\n", lines[i], types[i]);
+        free(lines[i]);
+        free(types[i]);
+    }
+    free(lines);
+    free(types);
+    return failures == 0;
+}
+
 void debug(Env *runtime_env, TypeEnv *type_env) {
-    Exp *exp =
-        make_apply(make_apply(make_lambda("x", make_lambda("y", make_var("y"))),
-                              make_int(1)),
-                   make_int(2));
-    Type *type = infer(exp, type_env);
-    char *type_str = type_to_string(type);
-    Value result = eval(exp, runtime_env);
-    printf("Type: %s\n", type_str);
-    printf("Value: ");
-    string_of_value(result);
-    printf("\n\n");
+    ExpBuilder nodes;
+    init_exp_builder(&nodes);
+    ExpId k = make_lambda(&nodes, intern("x"),
+                          make_lambda(&nodes, intern("y"),
+                                      make_var(&nodes, intern("y"))));
+    ExpId root = make_apply(&nodes,
+                            make_apply(&nodes, k, make_int(&nodes, 1)),
+                            make_int(&nodes, 2));
+    Exp *exp = finish_exp(&nodes, root);
+    check_and_run(exp, NULL, NULL, 0, runtime_env, type_env);
+    free_exp(exp);
 }
 
 int main(int argc, char *argv[]) {
+    const char *filename = NULL;
+    bool check_only = false;
+    bool whole_program = false;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--vm") == 0) {
+            engine = ENGINE_VM;
+        } else if (strcmp(argv[i], "--cek") == 0) {
+            engine = ENGINE_CEK;
+        } else if (strcmp(argv[i], "--lazy") == 0) {
+            engine = ENGINE_LAZY;
+        } else if (strcmp(argv[i], "--gc-stats") == 0) {
+            show_gc_stats = true;
+        } else if (strcmp(argv[i], "--check") == 0) {
+            check_only = true;
+        } else if (strcmp(argv[i], "--program") == 0) {
+            whole_program = true;
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc &&
+                   atol(argv[i + 1]) > 0) {
+            jobs = atol(argv[++i]);
+        } else if (argv[i][0] == '-' || filename != NULL) {
+            fprintf(stderr,
+                    "Usage: %s [--cek | --vm | --lazy] [--gc-stats] "
+                    "[[--program] file]\n"
+                    "       %s --check [--jobs N] file\n",
+                    argv[0], argv[0]);
+            return EXIT_FAILURE;
+        } else {
+            filename = argv[i];
+        }
+    }
+    if (check_only) {
+        if (filename == NULL) {
+            fprintf(stderr, "--check needs a file\n");
+            return EXIT_FAILURE;
+        }
+        return check_file(filename, jobs > 0 ? (unsigned int)jobs : 1)
+                   ? EXIT_SUCCESS
+                   : EXIT_FAILURE;
+    }
+
     Env *runtime_env = init_standard_env();
-    TypeEnv *type_env = init_standard_type_env();
+    gc_root_env(&runtime_env);
+    checker = new_infer_context();
+    TypeEnv *type_env = init_standard_type_env(checker);
+    standard_types = type_arena_mark(checker);
     debug(runtime_env, type_env);
     printf("Lambda Calculus Interpreter with Hindley-Milner Type Inference\n");
     printf("Type 'exit' to quit\n\n");
-    if (argc == 2) {
-        const char *filename = argv[1];
-        if (!process_file_line_by_line(filename, runtime_env, type_env)) {
-            return EXIT_FAILURE;
-        }
-        return EXIT_FAILURE;
+    bool ok = true;
+    if (filename != NULL) {
+        ok = whole_program
+                 ? process_program(filename, runtime_env, type_env)
+                 : process_file_line_by_line(filename, runtime_env, type_env);
     } else {
         char *input = NULL;
         while (1) {
@@ -108,25 +395,41 @@ int main(int argc, char *argv[]) {
 
             add_history(input);  // Add to history
 
-            current_level = 0;
-            current_typevar = 0;
-            Exp *exp = NULL;
-
-            exp = parse(input);
+            Error error;
+            Exp *exp = parse(input, &error);
+            if (exp == NULL) {
+                report_error(&error, input, NULL, 0);
+                free(input);
+                continue;
+            }
             print_exp(exp);
             printf("\n");
-            Type *type = infer(exp, type_env);
-            char *type_str = type_to_string(type);
-            Value result = eval(exp, runtime_env);
-            printf("Type: %s\n", type_str);
-            printf("Value: ");
-            string_of_value(result);
-            printf("\n\n");
-        }
-        free(input);
-    }
-    // Free environments
-    free_env(runtime_env);
+            Type *type = infer(checker, exp, type_env, &error);
+            if (type == NULL) {
+                report_error(&error, input, NULL, 0);
+            } else {
+                char *type_str = type_to_string(type);
+                Value result;
+                if (try_run(exp, runtime_env, &result, &error)) {
+                    printf("Type: %s\n", type_str);
+                    printf("Value: ");
+                    string_of_value(result);
+                    printf("\n\n");
+                } else {
+                    report_error(&error, input, NULL, 0);
+                }
+                free(type_str);
+            }
+            type_arena_release(checker, standard_types);
+            free_exp(exp);
+            free(input);
+        }
+    }
+    if (show_gc_stats) {
+        gc_print_stats(stderr);
+    }
+    // The runtime environment belongs to the collector
     free_type_env(type_env);
-    return 0;
+    free_infer_context(checker);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
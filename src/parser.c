@@ -6,157 +6,285 @@
 
 #include "lexer.h"
 
-// Helper function to check token type and advance
-static void expect(Lexer *lexer, TokenType type) {
-    if (lexer->current.type == type) {
-        lexer_next(lexer);
+typedef struct {
+    Lexer *lexer;
+    Error *error;
+    ExpBuilder nodes;
+} Parser;
+
+// Report a syntax error at the current token. Parse functions return NO_EXP
+// after one, and what they built is dropped with the whole tree.
+static ExpId syntax_error(Parser *p, const char *message) {
+    Lexer *lexer = p->lexer;
+    if (lexer->current.type == TOKEN_ERROR) {
+        set_error(p->error, ERROR_SYNTAX, lexer->current.offset,
+                  "unexpected character '%c'",
+                  lexer->input[lexer->current.offset]);
     } else {
-        fprintf(stdout, "%*s\n", lexer->position, "^");
-        fprintf(stderr, "Syntax error: expected token type %s, got %s\n",
-                string_of_tokentype(type),
-                string_of_tokentype(lexer->current.type));
-        exit(1);
+        set_error(p->error, ERROR_SYNTAX, lexer->current.offset,
+                  "%s, got %s", message,
+                  string_of_tokentype(lexer->current.type));
     }
+    return NO_EXP;
 }
 
-// Forward declarations for recursive parsing
-static Exp *parse_expr(Lexer *lexer);
-static Exp *parse_atom(Lexer *lexer);
-static Exp *parse_application(Lexer *lexer);
-
-// Parse a lambda expression (λx.e)
-static Exp *parse_lambda(Lexer *lexer) {
-    expect(lexer, TOKEN_LAMBDA);
-
-    // Parse parameter
-    if (lexer->current.type != TOKEN_IDENTIFIER) {
-        fprintf(stderr, "Syntax error: expected identifier after lambda\n");
-        exit(1);
+// Helper function to check token type and advance
+static bool expect(Parser *p, TokenType type) {
+    if (p->lexer->current.type != type) {
+        char message[64];
+        snprintf(message, sizeof(message), "expected %s",
+                 string_of_tokentype(type));
+        syntax_error(p, message);
+        return false;
     }
-
-    char *param = strdup(lexer->current.data.identifier);
-    lexer_next(lexer);
-
-    // Parse dot
-    expect(lexer, TOKEN_DOT);
-
-    // Parse body
-    Exp *body = parse_expr(lexer);
-
-    return make_lambda(param, body);
+    lexer_next(p->lexer);
+    return true;
 }
 
-// Parse a let expression (let x = e1 in e2)
-static Exp *parse_let(Lexer *lexer) {
-    expect(lexer, TOKEN_LET);
-
-    // Parse variable name
-    if (lexer->current.type != TOKEN_IDENTIFIER) {
-        fprintf(stderr, "Syntax error: expected identifier after let\n");
-        exit(1);
+// The parser keeps the constructs it is inside of on a stack of its own
+// rather than the C stack, so nesting is limited only by memory. Each frame
+// waits for an expression: the next argument of an application, the inside
+// of parentheses, the body of a lambda, or the value or body of a let.
+typedef enum {
+    FRAME_APPLY,      // Application so far, in fn; NO_EXP before any atom
+    FRAME_PAREN,      // Inside parentheses
+    FRAME_LAMBDA,     // Body of a lambda binding name
+    FRAME_LET_VALUE,  // Value of a let binding name
+    FRAME_LET_BODY    // Body of a let binding name to value
+} FrameKind;
+
+typedef struct {
+    FrameKind kind;
+    unsigned int start;  // Offset of the construct, for its node
+    Symbol name;
+    ExpId exp;  // fn for FRAME_APPLY, value for FRAME_LET_BODY
+} Frame;
+
+typedef struct {
+    Frame *frames;
+    unsigned int size;
+    unsigned int capacity;
+} FrameStack;
+
+static void push_frame(FrameStack *stack, FrameKind kind, unsigned int start,
+                       Symbol name, ExpId exp) {
+    if (stack->size == stack->capacity) {
+        stack->capacity = stack->capacity == 0 ? 32 : stack->capacity * 2;
+        stack->frames =
+            realloc(stack->frames, stack->capacity * sizeof(Frame));
+        if (stack->frames == NULL) {
+            fprintf(stderr, "Fatal: failed to grow the parser stack.\n");
+            exit(1);
+        }
     }
+    stack->frames[stack->size++] = (Frame){kind, start, name, exp};
+}
 
-    char *var = strdup(lexer->current.data.identifier);
-    lexer_next(lexer);
-
-    // Parse equals sign
-    expect(lexer, TOKEN_EQUALS);
-
-    // Parse value expression
-    Exp *val = parse_expr(lexer);
-
-    // Parse 'in' keyword
-    expect(lexer, TOKEN_IN);
-
-    // Parse body expression
-    Exp *body = parse_expr(lexer);
+// Whether the current token can start an argument of an application. A let
+// can only start the function.
+static bool starts_argument(TokenType type) {
+    switch (type) {
+        case TOKEN_IDENTIFIER:
+        case TOKEN_LPAREN:
+        case TOKEN_INT:
+        case TOKEN_TRUE:
+        case TOKEN_FALSE:
+        case TOKEN_UNIT:
+        case TOKEN_LAMBDA:
+            return true;
+        default:
+            return false;
+    }
+}
 
-    return make_let(var, val, body);
+// The binder after a lambda or let, which must be an identifier
+static bool expect_binder(Parser *p, const char *message, Symbol *name) {
+    if (p->lexer->current.type != TOKEN_IDENTIFIER) {
+        syntax_error(p, message);
+        return false;
+    }
+    *name = token_symbol(p->lexer);
+    lexer_next(p->lexer);
+    return true;
 }
 
-// Parse an atomic expression (literal, variable, or parenthesized expression)
-static Exp *parse_atom(Lexer *lexer) {
-    switch (lexer->current.type) {
-        case TOKEN_INT: {
-            unsigned int val = lexer->current.data.int_val;
+// Parse an application of atoms, each a literal, a variable, a
+// parenthesized expression, a lambda or a let, whose bodies run as far as
+// possible
+static ExpId parse_expr(Parser *p) {
+    Lexer *lexer = p->lexer;
+    ExpBuilder *nodes = &p->nodes;
+    FrameStack stack = {NULL, 0, 0};
+    ExpId result = NO_EXP;
+    push_frame(&stack, FRAME_APPLY, lexer->current.offset, 0, NO_EXP);
+
+    for (;;) {
+        // Read the next atom of the application on top, if it has one
+        Frame *app = &stack.frames[stack.size - 1];
+        TokenType type = lexer->current.type;
+        unsigned int start = lexer->current.offset;
+        ExpId atom = NO_EXP;
+        if (app->exp != NO_EXP && !starts_argument(type)) {
+            // The application is complete
+        } else if (type == TOKEN_INT) {
+            atom = make_int(nodes, (unsigned int)lexer->current.int_val);
+        } else if (type == TOKEN_TRUE || type == TOKEN_FALSE) {
+            atom = make_bool(nodes, type == TOKEN_TRUE);
+        } else if (type == TOKEN_UNIT) {
+            atom = make_unit(nodes);
+        } else if (type == TOKEN_IDENTIFIER) {
+            atom = make_var(nodes, token_symbol(lexer));
+        } else if (type == TOKEN_LPAREN) {
             lexer_next(lexer);
-            return make_int(val);
-        }
-
-        case TOKEN_TRUE: {
+            push_frame(&stack, FRAME_PAREN, start, 0, NO_EXP);
+            push_frame(&stack, FRAME_APPLY, lexer->current.offset, 0, NO_EXP);
+            continue;
+        } else if (type == TOKEN_LAMBDA) {
+            Symbol param;
             lexer_next(lexer);
-            return make_bool(true);
-        }
-
-        case TOKEN_FALSE: {
-            lexer_next(lexer);
-            return make_bool(false);
-        }
-
-        case TOKEN_UNIT: {
+            if (!expect_binder(p, "expected identifier after lambda",
+                               &param) ||
+                !expect(p, TOKEN_DOT)) {
+                break;
+            }
+            push_frame(&stack, FRAME_LAMBDA, start, param, NO_EXP);
+            push_frame(&stack, FRAME_APPLY, lexer->current.offset, 0, NO_EXP);
+            continue;
+        } else if (type == TOKEN_LET) {
+            Symbol var;
             lexer_next(lexer);
-            return make_unit();
+            if (!expect_binder(p, "expected identifier after let", &var) ||
+                !expect(p, TOKEN_EQUALS)) {
+                break;
+            }
+            push_frame(&stack, FRAME_LET_VALUE, start, var, NO_EXP);
+            push_frame(&stack, FRAME_APPLY, lexer->current.offset, 0, NO_EXP);
+            continue;
+        } else {
+            syntax_error(p, "expected an expression");
+            break;
         }
 
-        case TOKEN_IDENTIFIER: {
-            char *name = strdup(lexer->current.data.identifier);
+        if (atom != NO_EXP) {
+            at_offset(nodes, atom, start);
             lexer_next(lexer);
-            return make_var(name);
+        } else {
+            // The application is complete, and with it whatever construct
+            // was waiting for it, which becomes an atom itself
+            atom = app->exp;
+            stack.size--;
+            if (stack.size == 0) {
+                result = atom;
+                break;
+            }
+            Frame *frame = &stack.frames[stack.size - 1];
+            switch (frame->kind) {
+                case FRAME_PAREN:
+                    if (!expect(p, TOKEN_RPAREN)) {
+                        goto done;
+                    }
+                    break;
+                case FRAME_LAMBDA:
+                    atom = at_offset(nodes,
+                                     make_lambda(nodes, frame->name, atom),
+                                     frame->start);
+                    break;
+                case FRAME_LET_VALUE:
+                    // Go on with the body
+                    if (!expect(p, TOKEN_IN)) {
+                        goto done;
+                    }
+                    frame->kind = FRAME_LET_BODY;
+                    frame->exp = atom;
+                    push_frame(&stack, FRAME_APPLY, lexer->current.offset, 0,
+                               NO_EXP);
+                    continue;
+                case FRAME_LET_BODY:
+                    atom = at_offset(
+                        nodes, make_let(nodes, frame->name, frame->exp, atom),
+                        frame->start);
+                    break;
+                case FRAME_APPLY:
+                    break;
+            }
+            stack.size--;
         }
 
-        case TOKEN_LPAREN: {
-            lexer_next(lexer);
-            Exp *expr = parse_expr(lexer);
-            expect(lexer, TOKEN_RPAREN);
-            return expr;
-        }
+        // Add the atom to the application now on top
+        app = &stack.frames[stack.size - 1];
+        app->exp = app->exp == NO_EXP
+                       ? atom
+                       : at_offset(nodes, make_apply(nodes, app->exp, atom),
+                                   app->start);
+    }
 
-        case TOKEN_LAMBDA:
-            return parse_lambda(lexer);
+done:
+    free(stack.frames);
+    return result;
+}
 
-        case TOKEN_LET:
-            return parse_let(lexer);
+// Print an error for a caller that passed none, and end the process
+static _Noreturn void fail(const Error *error, const char *source) {
+    char *message = error_to_string(error, source);
+    fprintf(stderr, "%s\n", message);
+    free(message);
+    exit(1);
+}
 
-        default:
-            fprintf(stderr, "%*s\n", lexer->position, "^");
-            fprintf(stderr, "Syntax error: unexpected token type %s\n",
-                    string_of_tokentype(lexer->current.type));
-            exit(1);
+// Parse an expression running to the end of the input, or in a program
+// also to a ";;", and finish its tree. NULL after a syntax error.
+static Exp *parse_tree(Parser *p, bool in_program) {
+    init_exp_builder(&p->nodes);
+    ExpId root = parse_expr(p);
+    TokenType next = p->lexer->current.type;
+    if (root != NO_EXP && next != TOKEN_EOF &&
+        !(in_program && next == TOKEN_END)) {
+        root = syntax_error(p, in_program ? "expected ;; or end of input"
+                                          : "expected end of input");
+    }
+    if (root == NO_EXP) {
+        discard_exp_builder(&p->nodes);
+        return NULL;
     }
+    return finish_exp(&p->nodes, root);
 }
 
-// Parse function application
-static Exp *parse_application(Lexer *lexer) {
-    Exp *fn = parse_atom(lexer);
-
-    while (lexer->current.type == TOKEN_IDENTIFIER ||
-           lexer->current.type == TOKEN_LPAREN ||
-           lexer->current.type == TOKEN_INT ||
-           lexer->current.type == TOKEN_TRUE ||
-           lexer->current.type == TOKEN_FALSE ||
-           lexer->current.type == TOKEN_UNIT ||
-           lexer->current.type == TOKEN_LAMBDA) {
-        Exp *arg = parse_atom(lexer);
-        fn = make_apply(fn, arg);
+// Parse the entire input
+Exp *parse(const char *input, Error *error) {
+    Error local;
+    Lexer lexer;
+    lexer_init(&lexer, input, (unsigned int)strlen(input), 0);
+    Parser p = {&lexer, error != NULL ? error : &local, {0}};
+    Exp *result = parse_tree(&p, false);
+    if (result == NULL && error == NULL) {
+        fail(&local, input);
     }
-
-    return fn;
+    return result;
 }
 
-// Parse an expression
-static Exp *parse_expr(Lexer *lexer) { return parse_application(lexer); }
-
-// Parse the entire input
-Exp *parse(const char *input) {
-    Lexer *lexer = lexer_init(input);
-    Exp *result = parse_expr(lexer);
-
-    if (lexer->current.type != TOKEN_EOF) {
-        fprintf(stderr, "%*s\n", lexer->position, "^");
-        fprintf(stderr, "Syntax error: unexpected tokens after expression\n");
-        exit(1);
+ParseResult parse_next(const char *source, unsigned int length,
+                       unsigned int *position, Exp **exp, Error *error) {
+    Error local;
+    Lexer lexer;
+    lexer_init(&lexer, source, length, *position);
+    if (lexer.current.type == TOKEN_EOF) {
+        *position = length;
+        return PARSE_END;
+    }
+    Parser p = {&lexer, error != NULL ? error : &local, {0}};
+    Exp *result = parse_tree(&p, true);
+    if (result == NULL) {
+        if (error == NULL) {
+            fail(&local, source);
+        }
+        // Carry on after the expression in error
+        while (lexer.current.type != TOKEN_END &&
+               lexer.current.type != TOKEN_EOF) {
+            lexer_next(&lexer);
+        }
     }
 
-    lexer_free(lexer);
-    return result;
+    *position = lexer.current.offset + lexer.current.length;
+    *exp = result;
+    return result != NULL ? PARSE_OK : PARSE_ERROR;
 }
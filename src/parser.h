@@ -1,6 +1,18 @@
 #pragma once
+#include "error.h"
 #include "lambda.h"
 #include "lexer.h"
 
-Exp *parse(const char *input);
-Exp *parse_expression(Lexer *lexer);
+// Parse a whole expression. On a syntax error NULL is returned and error
+// says what and where; with a NULL error it is printed and ends the process.
+Exp *parse(const char *input, Error *error);
+
+typedef enum { PARSE_OK, PARSE_ERROR, PARSE_END } ParseResult;
+
+// Parse the next expression of a program: expressions each ended by ";;",
+// which the last may leave out. source is length bytes that need not be
+// NUL-terminated, and parsing starts at *position, which is moved past the
+// ";;" ending the expression, even one in error. Returns PARSE_END with
+// nothing left but whitespace and comments.
+ParseResult parse_next(const char *source, unsigned int length,
+                       unsigned int *position, Exp **exp, Error *error);
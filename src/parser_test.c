@@ -39,9 +39,9 @@ int main() {
 
     // Test 4: Manual construction of the expression
     printf("\nTest 4: Manually building (\\x.\\y.x) 1 2\n");
-    Exp *lambda_body = make_var("x");
-    Exp *lambda = make_lambda("y", lambda_body);
-    Exp *outer_lambda = make_lambda("x", lambda);
+    Exp *lambda_body = make_var(intern("x"));
+    Exp *lambda = make_lambda(intern("y"), lambda_body);
+    Exp *outer_lambda = make_lambda(intern("x"), lambda);
     Exp *app1 = make_apply(outer_lambda, make_int(1));
     Exp *app2 = make_apply(app1, make_int(2));
 
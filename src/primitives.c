@@ -3,98 +3,89 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-Value prim_add(Value a, Value b) {
-    if (a.type != VAL_INT || b.type != VAL_INT) {
-        fprintf(stderr, "Type error: add expects two integers\n");
-        exit(1);
+Value prim_add(Value a, Value b, unsigned int offset) {
+    if (!is_int(a) || !is_int(b)) {
+        runtime_error(offset, "add expects two integers");
     }
-    printf("%d, %d\n", a.data.int_val, b.data.int_val);
-    Value result;
-    result.type = VAL_INT;
-    result.data.int_val = a.data.int_val + b.data.int_val;
-    return result;
+    return val_int(as_int(a) + as_int(b));
 }
 
-Value prim_subtract(Value a, Value b) {
-    if (a.type != VAL_INT || b.type != VAL_INT) {
-        fprintf(stderr, "Type error: subtract expects two integers\n");
-        exit(1);
+Value prim_subtract(Value a, Value b, unsigned int offset) {
+    if (!is_int(a) || !is_int(b)) {
+        runtime_error(offset, "subtract expects two integers");
     }
 
-    Value result;
-    result.type = VAL_INT;
-    result.data.int_val = a.data.int_val - b.data.int_val;
-    return result;
+    return val_int(as_int(a) - as_int(b));
 }
 
-Value prim_multiply(Value a, Value b) {
-    if (a.type != VAL_INT || b.type != VAL_INT) {
-        fprintf(stderr, "Type error: multiply expects two integers\n");
-        exit(1);
+Value prim_multiply(Value a, Value b, unsigned int offset) {
+    if (!is_int(a) || !is_int(b)) {
+        runtime_error(offset, "multiply expects two integers");
     }
 
-    Value result;
-    result.type = VAL_INT;
-    result.data.int_val = a.data.int_val * b.data.int_val;
-    return result;
+    return val_int(as_int(a) * as_int(b));
 }
 
 Value prim_equals(Value a, Value b) {
-    Value result;
-    result.type = VAL_BOOL;
-
-    if (a.type != b.type) {
-        result.data.bool_val = false;
-        return result;
-    }
-
-    switch (a.type) {
+    // Unit, ints and bools are equal exactly when their words are; functions
+    // never compare equal
+    switch (value_type(a)) {
         case VAL_UNIT:
-            result.data.bool_val = true;
-            break;
-
         case VAL_INT:
-            result.data.bool_val = a.data.int_val == b.data.int_val;
-            break;
-
         case VAL_BOOL:
-            result.data.bool_val = a.data.bool_val == b.data.bool_val;
-            break;
-
+            return val_bool(a.bits == b.bits);
         default:
-            result.data.bool_val = false;
+            return val_bool(false);
     }
+}
 
-    return result;
+Value prim_if(Value cond, Value then_val, Value else_val,
+              unsigned int offset) {
+    if (!is_bool(cond)) {
+        runtime_error(offset, "if expects a boolean condition");
+    }
+    return as_bool(cond) ? then_val : else_val;
 }
 
-Value prim_if(Value cond, Value then_val, Value else_val) {
-    if (cond.type != VAL_BOOL) {
-        fprintf(stderr, "Type error: if expects a boolean condition\n");
-        exit(1);
+Value prim_succ(Value val, unsigned int offset) {
+    if (!is_int(val)) {
+        runtime_error(offset, "succ expects an integer argument");
     }
-    return cond.data.bool_val ? then_val : else_val;
+    return val_int(as_int(val) + 1);
 }
 
-Value prim_succ(Value val) {
-    if (val.type != VAL_INT) {
-        fprintf(stderr, "Type error: Succ expects an integer argument\n");
-        exit(1);
+Value prim_binary(PrimitiveOp op, Value a, Value b, unsigned int offset) {
+    switch (op) {
+        case PRIM_ADD:
+            return prim_add(a, b, offset);
+        case PRIM_SUBTRACT:
+            return prim_subtract(a, b, offset);
+        case PRIM_MULTIPLY:
+            return prim_multiply(a, b, offset);
+        case PRIM_EQUALS:
+            return prim_equals(a, b);
+        default:
+            runtime_error(offset, "not a binary primitive: %s",
+                          primitive_name(op));
     }
-    Value result;
-    result.type = VAL_INT;
-    result.data.int_val = ++val.data.int_val;
-    return result;
 }
 
-// returns a newly constructed env. add
+static Symbol standard_names[6];
+
+// returns a newly constructed env holding a single named global frame
 Env *init_standard_env() {
-    Env *env = NULL;
-    env = extend_env("add", make_primitive(PRIM_ADD), env);
-    env = extend_env("subtract", make_primitive(PRIM_SUBTRACT), env);
-    env = extend_env("multiply", make_primitive(PRIM_MULTIPLY), env);
-    env = extend_env("equals", make_primitive(PRIM_EQUALS), env);
-    env = extend_env("if", make_primitive(PRIM_IF), env);
-    env = extend_env("succ", make_primitive(PRIM_SUCC), env);
+    static const char *names[] = {"add",    "subtract", "multiply",
+                                  "equals", "if",       "succ"};
+    for (unsigned int i = 0; i < 6; i++) {
+        standard_names[i] = intern(names[i]);
+    }
+    Env *env = new_frame(6, NULL, NULL);
+    env->names = standard_names;
+    env->slots[0] = make_primitive(PRIM_ADD);
+    env->slots[1] = make_primitive(PRIM_SUBTRACT);
+    env->slots[2] = make_primitive(PRIM_MULTIPLY);
+    env->slots[3] = make_primitive(PRIM_EQUALS);
+    env->slots[4] = make_primitive(PRIM_IF);
+    env->slots[5] = make_primitive(PRIM_SUCC);
     return env;
 }
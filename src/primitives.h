@@ -1,10 +1,14 @@
 #pragma once
 #include "lambda.h"
-Value prim_add(Value a, Value b);
-Value prim_subtract(Value a, Value b);
-Value prim_multiply(Value a, Value b);
+// A runtime error in a primitive is reported at offset, that of the call
+Value prim_add(Value a, Value b, unsigned int offset);
+Value prim_subtract(Value a, Value b, unsigned int offset);
+Value prim_multiply(Value a, Value b, unsigned int offset);
 Value prim_equals(Value a, Value b);
-Value prim_if(Value cond, Value then_val, Value else_val);
-Value prim_succ(Value val);
+Value prim_if(Value cond, Value then_val, Value else_val,
+              unsigned int offset);
+Value prim_succ(Value val, unsigned int offset);
+// One of add, subtract, multiply and equals
+Value prim_binary(PrimitiveOp op, Value a, Value b, unsigned int offset);
 
 Env *init_standard_env();
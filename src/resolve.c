@@ -0,0 +1,353 @@
+#include "resolve.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Compile-time binding, kept on a stack while its scope is resolved. The
+// bindings on the stack are exactly those in scope, innermost last.
+typedef struct {
+    Symbol name;
+    unsigned int level;  // Function nesting level: 0 globals, 1 top level
+    unsigned int slot;
+} Binding;
+
+// A free variable of a function and where its creator finds the value
+typedef struct {
+    unsigned int binding;  // Index on the stack of bindings
+    VarRef from;
+} Capture;
+
+// Resolution state of a function whose body is being walked
+typedef struct {
+    unsigned int next_slot;  // Next free slot, and so the frame size
+    Capture *captures;
+    unsigned int num_captures;
+    unsigned int capacity;
+} Function;
+
+// An expression resolve() is inside of, with its children resolved so far
+typedef struct {
+    Exp *exp;
+    unsigned int state;
+    bool tail;  // Whether exp is the last thing its function body evaluates
+} ResolveFrame;
+
+// The walk keeps its bindings, functions and expressions on stacks of its
+// own rather than the C stack, so a tree of any depth can be resolved
+typedef struct {
+    Env *globals;
+    Error *error;  // Set on the first error, after which the walk stops
+    Binding *bindings;
+    unsigned int num_bindings;
+    unsigned int bindings_capacity;
+    Function *functions;  // By level - 1, the innermost last
+    unsigned int num_functions;
+    unsigned int functions_capacity;
+    ResolveFrame *frames;
+    unsigned int num_frames;
+    unsigned int frames_capacity;
+} Resolver;
+
+static void *grow(void *array, unsigned int *capacity, size_t size) {
+    *capacity = *capacity == 0 ? 64 : *capacity * 2;
+    void *p = realloc(array, *capacity * size);
+    if (p == NULL) {
+        fprintf(stderr, "Fatal: failed to grow resolver stack.\n");
+        exit(1);
+    }
+    return p;
+}
+
+static void push_binding(Resolver *r, Symbol name, unsigned int level,
+                         unsigned int slot) {
+    if (r->num_bindings == r->bindings_capacity) {
+        r->bindings =
+            grow(r->bindings, &r->bindings_capacity, sizeof(Binding));
+    }
+    r->bindings[r->num_bindings++] = (Binding){name, level, slot};
+}
+
+static void push_function(Resolver *r) {
+    if (r->num_functions == r->functions_capacity) {
+        r->functions =
+            grow(r->functions, &r->functions_capacity, sizeof(Function));
+    }
+    // A lambda body runs in a fresh frame with the param in slot 0
+    unsigned int first_slot = r->num_functions > 0 ? 1 : 0;
+    r->functions[r->num_functions++] = (Function){first_slot, NULL, 0, 0};
+}
+
+static void push_frame(Resolver *r, Exp *exp, bool tail) {
+    if (r->num_frames == r->frames_capacity) {
+        r->frames = grow(r->frames, &r->frames_capacity, sizeof(ResolveFrame));
+    }
+    r->frames[r->num_frames++] = (ResolveFrame){exp, 0, tail};
+}
+
+static VarRef add_capture(Function *fn, unsigned int b, VarRef from) {
+    if (fn->num_captures == fn->capacity) {
+        fn->capacity = fn->capacity == 0 ? 4 : fn->capacity * 2;
+        fn->captures = realloc(fn->captures, fn->capacity * sizeof(Capture));
+        if (fn->captures == NULL) {
+            fprintf(stderr, "Fatal: failed to grow captures.\n");
+            exit(1);
+        }
+    }
+    fn->captures[fn->num_captures] = (Capture){b, from};
+    return (VarRef){VAR_FREE, fn->num_captures++};
+}
+
+// Find binding b from inside the innermost function, adding it to the
+// captures of that function and of every function in between when it
+// belongs to an enclosing frame
+static VarRef locate(Resolver *r, unsigned int b) {
+    Binding *binding = &r->bindings[b];
+    if (binding->level == 0) {
+        // Globals are read through the frame and never captured
+        return (VarRef){VAR_GLOBAL, binding->slot};
+    }
+
+    // The innermost function that captures b already, or the one binding it
+    VarRef from = {VAR_LOCAL, binding->slot};
+    unsigned int level = r->num_functions;
+    while (level > binding->level) {
+        Function *fn = &r->functions[level - 1];
+        unsigned int i = 0;
+        while (i < fn->num_captures && fn->captures[i].binding != b) {
+            i++;
+        }
+        if (i < fn->num_captures) {
+            from = (VarRef){VAR_FREE, i};
+            break;
+        }
+        level--;
+    }
+
+    // Each function inside of it captures b from the one around it
+    for (level++; level <= r->num_functions; level++) {
+        from = add_capture(&r->functions[level - 1], b, from);
+    }
+    return from;
+}
+
+// Index of the binding of name in scope, or UINT_MAX
+static unsigned int lookup(Resolver *r, Symbol name) {
+    for (unsigned int i = r->num_bindings; i > 0; i--) {
+        if (r->bindings[i - 1].name == name) {
+            return i - 1;
+        }
+    }
+    return UINT_MAX;
+}
+
+// Turn exp into an EXP_PRIM node when it applies a primitive of the global
+// frame to exactly as many arguments as it takes
+static bool saturate(Exp *exp, Resolver *r) {
+    Exp *args[3];
+    unsigned int num_args = 0;
+    Exp *head = exp;
+    while (head->type == EXP_APPLY) {
+        if (num_args == 3) {
+            return false;
+        }
+        args[num_args++] = apply_arg(head);
+        head = apply_fn(head);
+    }
+    if (head->type != EXP_VAR) {
+        return false;
+    }
+    unsigned int b = lookup(r, head->data.var.name);
+    PrimitiveOp op;
+    if (b == UINT_MAX || r->bindings[b].level != 0 ||
+        !unapplied_primitive(r->globals->slots[r->bindings[b].slot], &op) ||
+        primitive_arity(op) != num_args) {
+        return false;
+    }
+
+    // The inner applications and the variable are left unused in the tree's
+    // array, and freed with it
+    exp->type = EXP_PRIM;
+    exp->data.prim.op = op;
+    exp->data.prim.rep = REP_BOXED;
+    for (unsigned int i = 0; i < num_args; i++) {
+        exp->data.prim.args[i] = exp_ref(exp, args[num_args - 1 - i]);
+    }
+    return true;
+}
+
+// Resolve a variable, returning false once an error has been set
+static bool resolve_var(Exp *exp, Resolver *r) {
+    unsigned int b = lookup(r, exp->data.var.name);
+    if (b == UINT_MAX) {
+        set_error(r->error, ERROR_TYPE, exp->offset, "unbound variable %s",
+                  symbol_name(exp->data.var.name));
+        return false;
+    }
+    PrimitiveOp op;
+    if (r->bindings[b].level == 0 &&
+        unapplied_primitive(r->globals->slots[r->bindings[b].slot], &op) &&
+        op == PRIM_IF) {
+        // Applied in full it would have become an EXP_PRIM node
+        set_error(r->error, ERROR_TYPE, exp->offset,
+                  "if has to be applied to a condition and both branches");
+        return false;
+    }
+    exp->data.var.ref = locate(r, b);
+    return true;
+}
+
+// Give a lambda whose body has been resolved the captures of the innermost
+// function, and leave it
+static void finish_lambda(Exp *exp, Resolver *r) {
+    Function *inner = &r->functions[--r->num_functions];
+    r->num_bindings--;
+    exp->data.lambda.frame_size = inner->next_slot;
+    exp->data.lambda.num_captures = inner->num_captures;
+    free(exp->data.lambda.captures);
+    exp->data.lambda.captures = NULL;
+    if (inner->num_captures > 0) {
+        exp->data.lambda.captures =
+            malloc(inner->num_captures * sizeof(VarRef));
+        if (exp->data.lambda.captures == NULL) {
+            fprintf(stderr, "Fatal: failed to allocate captures.\n");
+            exit(1);
+        }
+        for (unsigned int i = 0; i < inner->num_captures; i++) {
+            exp->data.lambda.captures[i] = inner->captures[i].from;
+        }
+    }
+    free(inner->captures);
+}
+
+// Returns false once an error has been set
+static bool resolve_exp(Exp *exp, Resolver *r) {
+    bool tail = true;
+    for (;;) {
+        // Descend into exp until it has nothing left to resolve under it
+        while (exp != NULL) {
+            Function *fn = &r->functions[r->num_functions - 1];
+            switch (exp->type) {
+                case EXP_UNIT:
+                case EXP_INT:
+                case EXP_BOOL:
+                    break;
+
+                case EXP_VAR:
+                    if (!resolve_var(exp, r)) {
+                        return false;
+                    }
+                    break;
+
+                case EXP_LAMBDA:
+                    push_function(r);
+                    push_binding(r, exp->data.lambda.param, r->num_functions,
+                                 0);
+                    push_frame(r, exp, tail);
+                    exp = lambda_body(exp);
+                    tail = true;
+                    continue;
+
+                case EXP_APPLY:
+                    if (saturate(exp, r)) {
+                        continue;
+                    }
+                    exp->data.apply.tail = tail;
+                    push_frame(r, exp, tail);
+                    exp = apply_fn(exp);
+                    tail = false;
+                    continue;
+
+                case EXP_PRIM:
+                    // The branches of an if are in tail position, as only
+                    // one of them is evaluated and nothing is done with its
+                    // value
+                    push_frame(r, exp, tail);
+                    exp = prim_arg(exp, 0);
+                    tail = false;
+                    continue;
+
+                case EXP_LET:
+                    // Slots are not reused once the scope of a binding has
+                    // ended, so each is written once per frame and the
+                    // thunks of eval_lazy() can share the frame they are
+                    // made in
+                    push_binding(r, exp->data.let.var, r->num_functions,
+                                 fn->next_slot);
+                    exp->data.let.slot = fn->next_slot++;
+                    push_frame(r, exp, tail);
+                    exp = let_value(exp);
+                    tail = false;
+                    continue;
+            }
+            exp = NULL;
+        }
+
+        // Go on with the next child of the innermost expression left
+        if (r->num_frames == 0) {
+            return true;
+        }
+        ResolveFrame *frame = &r->frames[r->num_frames - 1];
+        Exp *parent = frame->exp;
+        frame->state++;
+        switch (parent->type) {
+            case EXP_LAMBDA:
+                finish_lambda(parent, r);
+                break;
+
+            case EXP_APPLY:
+                if (frame->state == 1) {
+                    exp = apply_arg(parent);
+                    tail = false;
+                    continue;
+                }
+                break;
+
+            case EXP_PRIM:
+                if (frame->state < primitive_arity(parent->data.prim.op)) {
+                    exp = prim_arg(parent, frame->state);
+                    tail = frame->tail && parent->data.prim.op == PRIM_IF;
+                    continue;
+                }
+                break;
+
+            case EXP_LET:
+                if (frame->state == 1) {
+                    exp = let_body(parent);
+                    tail = frame->tail;
+                    continue;
+                }
+                r->num_bindings--;
+                break;
+
+            default:
+                break;
+        }
+        r->num_frames--;
+    }
+}
+
+bool resolve(Exp *exp, Env *globals, unsigned int *frame_size,
+             Error *error) {
+    Resolver r = {globals, error, NULL, 0, 0, NULL, 0, 0, NULL, 0, 0};
+
+    // Global slots form the outermost scope
+    unsigned int num_globals = globals->names != NULL ? globals->size : 0;
+    for (unsigned int i = 0; i < num_globals; i++) {
+        push_binding(&r, globals->names[i], 0, i);
+    }
+
+    push_function(&r);
+    bool ok = resolve_exp(exp, &r);
+    *frame_size = r.functions[0].next_slot;
+
+    // After an error the functions being walked still own their captures
+    for (unsigned int i = 0; i < r.num_functions; i++) {
+        free(r.functions[i].captures);
+    }
+    free(r.bindings);
+    free(r.functions);
+    free(r.frames);
+    return ok;
+}
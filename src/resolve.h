@@ -0,0 +1,15 @@
+#pragma once
+#include "lambda.h"
+
+// Rewrite every variable in exp into a frame slot, captured-array index or
+// global slot, so that eval() never compares names, and compute the free
+// variables each lambda has to capture. Applications in tail position are
+// marked so that eval() can run them in the caller's frame, and calls that
+// give a primitive of globals all its arguments become EXP_PRIM nodes, which
+// evaluate the primitive directly and only the branch of an if that is
+// taken. exp is resolved as the body of a top-level frame, and frame_size set
+// to the number of slots that frame needs. A variable bound nowhere is an
+// error, as is a use of if without a condition and both branches, since if
+// evaluates only one of them: false is returned and error says where.
+bool resolve(Exp *exp, Env *globals, unsigned int *frame_size,
+             Error *error);
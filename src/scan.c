@@ -0,0 +1,169 @@
+#include "scan.h"
+
+#include <stddef.h>
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define HAVE_X86_SIMD 0
+#endif
+
+static const char *spaces_scalar(const char *p, const char *end) {
+    while (p < end && is_space_char(*p)) {
+        p++;
+    }
+    return p;
+}
+
+static const char *identifier_scalar(const char *p, const char *end) {
+    while (p < end && is_id_char(*p)) {
+        p++;
+    }
+    return p;
+}
+
+static const Scanner scalar_scanner = {spaces_scalar, identifier_scalar};
+
+#if HAVE_X86_SIMD
+// Each vector version tests a whole block for membership of the class, and
+// finds the first byte outside it from the movemask. There are no unsigned
+// byte comparisons, so x - lo <= hi - lo is tested as min(x - lo, hi - lo)
+// == x - lo. The last partial block is left to the scalar version.
+
+static inline __m128i in_range_sse2(__m128i x, char lo, char hi) {
+    __m128i offset = _mm_sub_epi8(x, _mm_set1_epi8(lo));
+    return _mm_cmpeq_epi8(
+        _mm_min_epu8(offset, _mm_set1_epi8((char)(hi - lo))), offset);
+}
+
+static inline __m128i spaces_mask_sse2(__m128i x) {
+    return _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')),
+                        in_range_sse2(x, '\t', '\r'));
+}
+
+static inline __m128i identifier_mask_sse2(__m128i x) {
+    __m128i letter = in_range_sse2(_mm_or_si128(x, _mm_set1_epi8(0x20)), 'a',
+                                   'z');
+    __m128i other = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('_')),
+                                 _mm_cmpeq_epi8(x, _mm_set1_epi8('\'')));
+    return _mm_or_si128(_mm_or_si128(letter, in_range_sse2(x, '0', '9')),
+                        other);
+}
+
+static const char *spaces_sse2(const char *p, const char *end) {
+    while (end - p >= 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)p);
+        unsigned int outside =
+            ~(unsigned int)_mm_movemask_epi8(spaces_mask_sse2(x)) & 0xFFFF;
+        if (outside != 0) {
+            return p + __builtin_ctz(outside);
+        }
+        p += 16;
+    }
+    return spaces_scalar(p, end);
+}
+
+static const char *identifier_sse2(const char *p, const char *end) {
+    while (end - p >= 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)p);
+        unsigned int outside =
+            ~(unsigned int)_mm_movemask_epi8(identifier_mask_sse2(x));
+        outside &= 0xFFFF;
+        if (outside != 0) {
+            return p + __builtin_ctz(outside);
+        }
+        p += 16;
+    }
+    return identifier_scalar(p, end);
+}
+
+static const Scanner sse2_scanner = {spaces_sse2, identifier_sse2};
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static inline __m256i in_range_avx2(__m256i x, char lo, char hi) {
+    __m256i offset = _mm256_sub_epi8(x, _mm256_set1_epi8(lo));
+    return _mm256_cmpeq_epi8(
+        _mm256_min_epu8(offset, _mm256_set1_epi8((char)(hi - lo))), offset);
+}
+
+AVX2 static inline __m256i spaces_mask_avx2(__m256i x) {
+    return _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')),
+                           in_range_avx2(x, '\t', '\r'));
+}
+
+AVX2 static inline __m256i identifier_mask_avx2(__m256i x) {
+    __m256i letter = in_range_avx2(
+        _mm256_or_si256(x, _mm256_set1_epi8(0x20)), 'a', 'z');
+    __m256i other =
+        _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('_')),
+                        _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\'')));
+    return _mm256_or_si256(
+        _mm256_or_si256(letter, in_range_avx2(x, '0', '9')), other);
+}
+
+AVX2 static const char *spaces_avx2(const char *p, const char *end) {
+    while (end - p >= 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)p);
+        unsigned int outside =
+            ~(unsigned int)_mm256_movemask_epi8(spaces_mask_avx2(x));
+        if (outside != 0) {
+            return p + __builtin_ctz(outside);
+        }
+        p += 32;
+    }
+    return spaces_sse2(p, end);
+}
+
+AVX2 static const char *identifier_avx2(const char *p, const char *end) {
+    while (end - p >= 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)p);
+        unsigned int outside =
+            ~(unsigned int)_mm256_movemask_epi8(identifier_mask_avx2(x));
+        if (outside != 0) {
+            return p + __builtin_ctz(outside);
+        }
+        p += 32;
+    }
+    return identifier_sse2(p, end);
+}
+
+static const Scanner avx2_scanner = {spaces_avx2, identifier_avx2};
+#endif
+
+ScanLevel best_scan_level(void) {
+#if HAVE_X86_SIMD
+    if (__builtin_cpu_supports("avx2")) {
+        return SCAN_AVX2;
+    }
+    return SCAN_SSE2;
+#else
+    return SCAN_SCALAR;
+#endif
+}
+
+// -1 until set_scan_level() is called
+static int chosen_level = -1;
+
+ScanLevel scan_level(void) {
+    return chosen_level < 0 ? best_scan_level() : (ScanLevel)chosen_level;
+}
+
+void set_scan_level(ScanLevel level) { chosen_level = (int)level; }
+
+const Scanner *get_scanner(ScanLevel level) {
+    if (level > best_scan_level()) {
+        level = best_scan_level();
+    }
+    switch (level) {
+#if HAVE_X86_SIMD
+        case SCAN_AVX2:
+            return &avx2_scanner;
+        case SCAN_SSE2:
+            return &sse2_scanner;
+#endif
+        default:
+            return &scalar_scanner;
+    }
+}
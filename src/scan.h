@@ -0,0 +1,39 @@
+#pragma once
+#include <stdbool.h>
+
+// Finding where runs of whitespace and of identifier characters end, which
+// is most of the lexer's work. Besides a version going a byte at a time
+// there are ones classifying 16 (SSE2) or 32 (AVX2) bytes at once, picked
+// by what the CPU supports.
+typedef enum { SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2 } ScanLevel;
+
+typedef struct {
+    // The first byte from p on that is not whitespace, or end
+    const char *(*spaces)(const char *p, const char *end);
+    // The first byte from p on that cannot be part of an identifier, or end
+    const char *(*identifier)(const char *p, const char *end);
+} Scanner;
+
+// The best level this CPU supports
+ScanLevel best_scan_level(void);
+// The level lexers use: the best one unless set_scan_level() has been
+// called, which should happen before any lexing starts
+ScanLevel scan_level(void);
+void set_scan_level(ScanLevel level);
+// The scanner for level, or for the best level below it if the CPU does not
+// support it, so lexers always get one
+const Scanner *get_scanner(ScanLevel level);
+
+// Character classes, without the locale lookups of <ctype.h>
+static inline bool is_space_char(char c) {
+    return c == ' ' || (unsigned char)(c - '\t') <= '\r' - '\t';
+}
+static inline bool is_digit_char(char c) {
+    return (unsigned char)(c - '0') <= 9;
+}
+static inline bool is_alpha_char(char c) {
+    return (unsigned char)((c | 0x20) - 'a') <= 'z' - 'a';
+}
+static inline bool is_id_char(char c) {
+    return is_digit_char(c) || is_alpha_char(c) || c == '_' || c == '\'';
+}
@@ -0,0 +1,82 @@
+#include "specialize.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Representation of the values of exp, when its type is known
+static Rep exp_rep(Exp *exp) {
+    switch (exp->type) {
+        case EXP_INT:
+            return REP_INT;
+        case EXP_BOOL:
+            return REP_BOOL;
+        case EXP_UNIT:
+        case EXP_LAMBDA:
+            return REP_BOXED;
+        default:
+            break;
+    }
+    if (exp->inferred_type == NULL) {
+        return REP_BOXED;
+    }
+    switch (find_type(exp->inferred_type)->kind) {
+        case TYPE_INT:
+            return REP_INT;
+        case TYPE_BOOL:
+            return REP_BOOL;
+        default:
+            return REP_BOXED;
+    }
+}
+
+// A node specialize() is inside of, with its children visited so far
+typedef struct {
+    Exp *exp;
+    unsigned int next;
+} SpecializeFrame;
+
+// The arguments of a primitive are marked before it, so the nodes being
+// visited are kept on a stack of their own and any depth of tree is walked
+void specialize(Exp *root) {
+    SpecializeFrame *frames = NULL;
+    unsigned int size = 0;
+    unsigned int capacity = 0;
+    Exp *exp = root;
+    for (;;) {
+        if (exp != NULL && exp_num_children(exp) > 0) {
+            if (size == capacity) {
+                capacity = capacity == 0 ? 64 : capacity * 2;
+                frames = realloc(frames, capacity * sizeof(SpecializeFrame));
+                if (frames == NULL) {
+                    fprintf(stderr, "Fatal: failed to grow the stack.\n");
+                    exit(1);
+                }
+            }
+            frames[size++] = (SpecializeFrame){exp, 0};
+        }
+        if (size == 0) {
+            break;
+        }
+        SpecializeFrame *frame = &frames[size - 1];
+        exp = frame->exp;
+        if (frame->next < exp_num_children(exp)) {
+            exp = exp_child(exp, frame->next++);
+            continue;
+        }
+        size--;
+        if (exp->type == EXP_PRIM) {
+            // An equals on functions or an if choosing between them keeps
+            // its boxed arguments
+            Rep rep = exp_rep(exp);
+            for (unsigned int i = 0; i < primitive_arity(exp->data.prim.op);
+                 i++) {
+                if (exp_rep(prim_arg(exp, i)) == REP_BOXED) {
+                    rep = REP_BOXED;
+                }
+            }
+            exp->data.prim.rep = rep;
+        }
+        exp = NULL;
+    }
+    free(frames);
+}
@@ -0,0 +1,9 @@
+#pragma once
+#include "lambda.h"
+
+// Mark the EXP_PRIM nodes of a resolved expression whose value and
+// arguments the inferred types say are ints or bools, so that eval()
+// computes them on raw integers without boxing or checking tags.
+// Polymorphic code, and code that was never type-checked, keeps the generic
+// path. The inferred types must still be alive.
+void specialize(Exp *exp);
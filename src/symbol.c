@@ -0,0 +1,143 @@
+#include "symbol.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Names indexed by symbol, and an open-addressed hash table of symbols
+// keyed by name. The table is kept at most half full. Parsers on different
+// threads intern at the same time and nearly every name is already there,
+// so lookups take no lock: both arrays are published through atomic
+// pointers, and a name is stored before the bucket that leads to it. Only
+// adding a name takes the lock. A grown array keeps the one it replaced,
+// which a reader may still be using, so neither is ever freed.
+typedef struct Names {
+    struct Names *previous;
+    unsigned int capacity;
+    const char *names[];
+} Names;
+
+typedef struct Table {
+    struct Table *previous;
+    unsigned int size;
+    atomic_uint buckets[];  // Symbol + 1, 0 marks an empty bucket
+} Table;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic(Names *) names = NULL;
+static _Atomic(Table *) table = NULL;
+static unsigned int num_symbols = 0;  // Only used under the lock
+
+static uint32_t hash(const char *name, size_t length) {
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return h;
+}
+
+// Symbol + 1 of the name in the table, or 0 with *empty set to the bucket
+// where it would go
+static Symbol find(Table *t, const char *name, size_t length,
+                   unsigned int *empty) {
+    if (t == NULL) {
+        return 0;
+    }
+    unsigned int i = hash(name, length) & (t->size - 1);
+    for (;;) {
+        Symbol entry =
+            atomic_load_explicit(&t->buckets[i], memory_order_acquire);
+        if (entry == 0) {
+            *empty = i;
+            return 0;
+        }
+        // Loaded after the bucket, so the array holds its name
+        const char *candidate =
+            atomic_load_explicit(&names, memory_order_acquire)
+                ->names[entry - 1];
+        if (strncmp(candidate, name, length) == 0 &&
+            candidate[length] == '\0') {
+            return entry;
+        }
+        i = (i + 1) & (t->size - 1);
+    }
+}
+
+static void grow_table(void) {
+    Table *old = atomic_load_explicit(&table, memory_order_relaxed);
+    Names *n = atomic_load_explicit(&names, memory_order_relaxed);
+    unsigned int new_size = old == NULL ? 256 : old->size * 2;
+    Table *new_table =
+        calloc(1, sizeof(Table) + new_size * sizeof(atomic_uint));
+    if (new_table == NULL) {
+        fprintf(stderr, "Fatal: failed to grow symbol table.\n");
+        exit(1);
+    }
+    new_table->previous = old;
+    new_table->size = new_size;
+    for (Symbol s = 0; s < num_symbols; s++) {
+        unsigned int i =
+            hash(n->names[s], strlen(n->names[s])) & (new_size - 1);
+        while (atomic_load_explicit(&new_table->buckets[i],
+                                    memory_order_relaxed) != 0) {
+            i = (i + 1) & (new_size - 1);
+        }
+        atomic_init(&new_table->buckets[i], s + 1);
+    }
+    atomic_store_explicit(&table, new_table, memory_order_release);
+}
+
+static void add_name(const char *name) {
+    Names *n = atomic_load_explicit(&names, memory_order_relaxed);
+    if (n == NULL || num_symbols == n->capacity) {
+        unsigned int capacity = n == NULL ? 64 : n->capacity * 2;
+        Names *new_names = malloc(sizeof(Names) + capacity * sizeof(char *));
+        if (new_names == NULL) {
+            fprintf(stderr, "Fatal: failed to grow symbol table.\n");
+            exit(1);
+        }
+        new_names->previous = n;
+        new_names->capacity = capacity;
+        if (n != NULL) {
+            memcpy(new_names->names, n->names, num_symbols * sizeof(char *));
+        }
+        atomic_store_explicit(&names, new_names, memory_order_release);
+        n = new_names;
+    }
+    n->names[num_symbols] = name;
+}
+
+Symbol intern_n(const char *name, size_t length) {
+    unsigned int empty;
+    Symbol entry = find(atomic_load_explicit(&table, memory_order_acquire),
+                        name, length, &empty);
+    if (entry != 0) {
+        return entry - 1;
+    }
+
+    // Another thread may have added the name or grown the table meanwhile
+    pthread_mutex_lock(&lock);
+    Table *t = atomic_load_explicit(&table, memory_order_relaxed);
+    if (t == NULL || 2 * (num_symbols + 1) > t->size) {
+        grow_table();
+        t = atomic_load_explicit(&table, memory_order_relaxed);
+    }
+    entry = find(t, name, length, &empty);
+    if (entry == 0) {
+        add_name(strndup(name, length));
+        entry = ++num_symbols;
+        atomic_store_explicit(&t->buckets[empty], entry, memory_order_release);
+    }
+    pthread_mutex_unlock(&lock);
+    return entry - 1;
+}
+
+Symbol intern(const char *name) { return intern_n(name, strlen(name)); }
+
+const char *symbol_name(Symbol symbol) {
+    return atomic_load_explicit(&names, memory_order_acquire)->names[symbol];
+}
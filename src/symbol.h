@@ -0,0 +1,11 @@
+#pragma once
+#include <stddef.h>
+
+// Interned identifier. Every spelling is stored once and gets a small id,
+// so names compare with == and are never copied. Interning is thread-safe,
+// and looking up a name already interned takes no lock.
+typedef unsigned int Symbol;
+
+Symbol intern(const char *name);
+Symbol intern_n(const char *name, size_t length);
+const char *symbol_name(Symbol symbol);
@@ -1,63 +1,260 @@
 #include <assert.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <setjmp.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "batch.h"
+#include "cek.h"
+#include "compile.h"
+#include "error.h"
+#include "gc.h"
 #include "infer.h"
+#include "lazy.h"
+#include "lexer.h"
 #include "lambda.h"
 #include "parser.h"
 #include "primitives.h"
+#include "resolve.h"
+#include "scan.h"
+#include "specialize.h"
+#include "symbol.h"
+#include "vm.h"
 
-void test_eval(const char *expr, Value expected) {
-    printf("Testing: %s\n", expr);
-
-    Env *env = init_standard_env();
-    Exp *exp = parse(expr);
-
-    Value result = eval(exp, env);
+// Check a value computed by one of the engines against the expected one
+static void check_value(const char *label, Value result, Value expected) {
+    assert(value_type(result) == value_type(expected));
 
-    assert(result.type == expected.type);
-
-    switch (result.type) {
+    switch (value_type(result)) {
         case VAL_INT:
-            assert(result.data.int_val == expected.data.int_val);
-            printf("  Result: %d (expected %d)\n", result.data.int_val,
-                   expected.data.int_val);
+            assert(as_int(result) == as_int(expected));
+            printf("  %s: %d (expected %d)\n", label, as_int(result),
+                   as_int(expected));
             break;
 
         case VAL_BOOL:
-            assert(result.data.bool_val == expected.data.bool_val);
-            printf("  Result: %s (expected %s)\n",
-                   result.data.bool_val ? "true" : "false",
-                   expected.data.bool_val ? "true" : "false");
+            assert(as_bool(result) == as_bool(expected));
+            printf("  %s: %s (expected %s)\n", label,
+                   as_bool(result) ? "true" : "false",
+                   as_bool(expected) ? "true" : "false");
             break;
         case VAL_UNIT:
-            printf("  Result: () (expected ())\n");
+            printf("  %s: () (expected ())\n", label);
             break;
 
         case VAL_CLOSURE:
-            printf("  Result: <function> (expected <function>)\n");
+            printf("  %s: <function> (expected <function>)\n", label);
             break;
 
         case VAL_PRIMITIVE:
-            printf("  Result: <primitive> (expected <primitive>)\n");
+            printf("  %s: <primitive> (expected <primitive>)\n", label);
             break;
         default:
             printf("Not implemented yet");
     }
 }
 
+// Resolve an expression with no unbound variables, returning the size of
+// its top-level frame
+static unsigned int resolve_ok(Exp *exp, Env *env) {
+    unsigned int frame_size;
+    Error error;
+    assert(resolve(exp, env, &frame_size, &error));
+    return frame_size;
+}
+
+// Infer the type of an expression that is well typed
+static Type *infer_ok(InferContext *ctx, Exp *exp, TypeEnv *env) {
+    Error error;
+    Type *type = infer(ctx, exp, env, &error);
+    assert(type != NULL);
+    return type;
+}
+
+// Evaluate an expression with the tree walker, the CEK machine, the VM and
+// call-by-need
+void test_eval(const char *expr, Value expected) {
+    printf("Testing: %s\n", expr);
+
+    Env *env = init_standard_env();
+    Exp *exp = parse(expr, NULL);
+    unsigned int frame_size = resolve_ok(exp, env);
+
+    Env *frame = new_frame(frame_size, NULL, env->slots);
+    check_value("Result", eval(exp, frame), expected);
+    check_value("CEK result", eval_cek(exp, frame), expected);
+    frame = new_frame(frame_size, NULL, env->slots);
+    check_value("Lazy result", eval_lazy(exp, frame), expected);
+
+    Program *program = compile(exp, frame_size);
+    check_value("VM result", vm_run(program, env), expected);
+    free_program(program);
+}
+
+// Evaluate call-by-need only, for expressions the strict engines never finish;
+// returns the bytes allocated on the way
+size_t test_eval_lazy(const char *expr, Value expected) {
+    printf("Testing: %s\n", expr);
+
+    Env *env = init_standard_env();
+    Exp *exp = parse(expr, NULL);
+    unsigned int frame_size = resolve_ok(exp, env);
+
+    GcStats before, after;
+    gc_get_stats(&before);
+    Env *frame = new_frame(frame_size, NULL, env->slots);
+    check_value("Lazy result", eval_lazy(exp, frame), expected);
+    gc_get_stats(&after);
+    return after.bytes_allocated - before.bytes_allocated;
+}
+
+// Type-check an expression and run it with every engine, as the
+// interpreter does; the expression is too large to print
+static void test_run_large(const char *expr, Value expected) {
+    InferContext *ctx = new_infer_context();
+    TypeEnv *type_env = init_standard_type_env(ctx);
+    Exp *exp = parse(expr, NULL);
+    infer_ok(ctx, exp, type_env);
+    free_type_env(type_env);
+    free_infer_context(ctx);
+
+    Env *env = init_standard_env();
+    unsigned int frame_size = resolve_ok(exp, env);
+    Env *frame = new_frame(frame_size, NULL, env->slots);
+    check_value("Result", eval(exp, frame), expected);
+    check_value("CEK result", eval_cek(exp, frame), expected);
+    frame = new_frame(frame_size, NULL, env->slots);
+    check_value("Lazy result", eval_lazy(exp, frame), expected);
+
+    Program *program = compile(exp, frame_size);
+    check_value("VM result", vm_run(program, env), expected);
+    free_program(program);
+    free_exp(exp);
+}
+
+// Run an expression with every engine without type-checking it first, and
+// check that each stops with the same runtime error at the same place
+void test_runtime_error(const char *expr, const char *message) {
+    printf("Testing runtime error: %s\n", expr);
+
+    Env *env = init_standard_env();
+    Exp *exp = parse(expr, NULL);
+    unsigned int frame_size = resolve_ok(exp, env);
+    Program *program = compile(exp, frame_size);
+    for (int engine = 0; engine < 4; engine++) {
+        RuntimeHandler handler;
+        push_runtime_handler(&handler);
+        unsigned int saved_roots = gc_save_roots();
+        if (setjmp(handler.jump) == 0) {
+            Env *frame = new_frame(frame_size, NULL, env->slots);
+            switch (engine) {
+                case 0:
+                    eval(exp, frame);
+                    break;
+                case 1:
+                    eval_cek(exp, frame);
+                    break;
+                case 2:
+                    eval_lazy(exp, frame);
+                    break;
+                default:
+                    vm_run(program, env);
+                    break;
+            }
+            assert(!"expected a runtime error");
+        }
+        gc_restore_roots(saved_roots);
+        pop_runtime_handler(&handler);
+        char *error_str = error_to_string(&handler.error, expr);
+        printf("  %s\n", error_str);
+        assert(handler.error.kind == ERROR_RUNTIME);
+        assert(strcmp(error_str, message) == 0);
+        free(error_str);
+    }
+    free_program(program);
+    free_exp(exp);
+}
+
+// Evaluate with eval() after specializing on the inferred types, and check
+// how the node found by path is represented: each character of path steps
+// into a let body (b), let value (v), lambda body (l) or primitive argument
+// (0-2)
+void test_eval_specialized(const char *expr, Value expected, const char *path,
+                           Rep rep) {
+    printf("Testing specialized: %s\n", expr);
+
+    InferContext *ctx = new_infer_context();
+    TypeEnv *type_env = init_standard_type_env(ctx);
+    Env *env = init_standard_env();
+    Exp *exp = parse(expr, NULL);
+    infer_ok(ctx, exp, type_env);
+    unsigned int frame_size = resolve_ok(exp, env);
+    specialize(exp);
+
+    Exp *node = exp;
+    for (const char *p = path; *p != '\0'; p++) {
+        switch (*p) {
+            case 'b':
+                node = let_body(node);
+                break;
+            case 'v':
+                node = let_value(node);
+                break;
+            case 'l':
+                node = lambda_body(node);
+                break;
+            default:
+                node = prim_arg(node, (unsigned int)(*p - '0'));
+                break;
+        }
+    }
+    assert(node->type == EXP_PRIM && node->data.prim.rep == rep);
+
+    Env *frame = new_frame(frame_size, NULL, env->slots);
+    check_value("Result", eval(exp, frame), expected);
+    free_exp(exp);
+    free_type_env(type_env);
+    free_infer_context(ctx);
+}
+
 // Helper to check that an expression has the expected type
 void test_type(const char *expr, const char *expected_type) {
     printf("Testing type of: %s\n", expr);
 
-    TypeEnv *env = init_standard_type_env();
-    Exp *exp = parse(expr);
+    InferContext *ctx = new_infer_context();
+    TypeEnv *env = init_standard_type_env(ctx);
+    Exp *exp = parse(expr, NULL);
 
-    Type *type = infer(exp, env);
+    Type *type = infer_ok(ctx, exp, env);
     char *type_str = type_to_string(type);
 
     printf("  Type: %s (expected %s)\n", type_str, expected_type);
     assert(strcmp(type_str, expected_type) == 0);
+    free(type_str);
+    free_type_env(env);
+    free_infer_context(ctx);
+}
+
+// Check that an expression is rejected with the expected type error
+void test_type_error(const char *expr, const char *message) {
+    printf("Testing type error in: %s\n", expr);
+
+    InferContext *ctx = new_infer_context();
+    TypeEnv *env = init_standard_type_env(ctx);
+    Exp *exp = parse(expr, NULL);
+
+    Error error;
+    assert(infer(ctx, exp, env, &error) == NULL);
+    char *error_str = error_to_string(&error, expr);
+    printf("  %s\n", error_str);
+    assert(error.kind == ERROR_TYPE && strcmp(error_str, message) == 0);
+    free(error_str);
+    free_exp(exp);
+    free_type_env(env);
+    free_infer_context(ctx);
 }
 
 // Test basic expressions
@@ -65,14 +262,14 @@ void test_basic_expressions() {
     printf("\n=== Testing Basic Expressions ===\n");
 
     // Integer literals
-    Value expected_int = {.type = VAL_INT, .data = {.int_val = 42}};
+    Value expected_int = val_int(42);
     test_eval("42", expected_int);
 
     // Boolean literals
-    Value expected_true = {.type = VAL_BOOL, .data = {.bool_val = true}};
+    Value expected_true = val_bool(true);
     test_eval("true", expected_true);
 
-    Value expected_false = {.type = VAL_BOOL, .data = {.bool_val = false}};
+    Value expected_false = val_bool(false);
     test_eval("false", expected_false);
 
     // Identity function
@@ -94,40 +291,67 @@ void test_arithmetic() {
     printf("\n=== Testing Arithmetic Primitives ===\n");
 
     // Addition
-    Value expected_sum = {.type = VAL_INT, .data = {.int_val = 15}};
+    Value expected_sum = val_int(15);
     test_eval("(add 10 5)", expected_sum);
 
     // Subtraction
-    Value expected_diff = {.type = VAL_INT, .data = {.int_val = 5}};
+    Value expected_diff = val_int(5);
     test_eval("subtract 10 5", expected_diff);
 
     // Multiplication
-    Value expected_prod = {.type = VAL_INT, .data = {.int_val = 50}};
+    Value expected_prod = val_int(50);
     test_eval("multiply 10 5", expected_prod);
 
     // Check types
-    test_type("add", "unit -> unit -> unit");
-    test_type("subtract", "unit -> unit -> unit");
-    test_type("multiply", "unit -> unit -> unit");
+    test_type("add", "int -> int -> int");
+    test_type("subtract", "int -> int -> int");
+    test_type("multiply", "int -> int -> int");
 
     // Nested arithmetic
-    Value expected_nested = {.type = VAL_INT, .data = {.int_val = 25}};
+    Value expected_nested = val_int(25);
     test_eval("add (multiply 2 10) 5", expected_nested);
 
     // Error cases
 }
 
+// Test calls that give a primitive all its arguments
+void test_saturated_primitives() {
+    printf("\n=== Testing Saturated Primitive Calls ===\n");
+
+    Env *env = init_standard_env();
+    Exp *exp = parse("add (multiply 2 10) 5", NULL);
+    resolve_ok(exp, env);
+    assert(exp->type == EXP_PRIM && exp->data.prim.op == PRIM_ADD);
+    assert(prim_arg(exp, 0)->type == EXP_PRIM);
+    assert(prim_arg(exp, 1)->type == EXP_INT);
+    free_exp(exp);
+
+    // Partial applications and shadowed names are left alone
+    exp = parse("(\\add.add 1 2) (\\x.\\y.x)", NULL);
+    resolve_ok(exp, env);
+    assert(lambda_body(apply_fn(exp))->type == EXP_APPLY);
+    free_exp(exp);
+    test_eval("let add = \\x.\\y.x in add 1 2", val_int(1));
+
+    // Only the branch taken is evaluated
+    test_eval("if true 1 ((\\x.x x) (\\x.x x))", val_int(1));
+    test_eval("let fix = \\f.(\\x.f (\\v.x x v)) (\\x.f (\\v.x x v)) in "
+              "let count = fix (\\self.\\n.if (equals n 0) 0 "
+              "(self (subtract n 1))) in count 100000",
+              val_int(0));
+}
+
 // Test comparison primitives
 void test_comparisons() {
     printf("\n=== Testing Comparison Primitives ===\n");
 
     // Equality - true cases
-    Value expected_true = {.type = VAL_BOOL, .data = {.bool_val = true}};
+    Value expected_true = val_bool(true);
     test_eval("equals 5 5", expected_true);
     test_eval("equals true true", expected_true);
 
     // Equality - false cases
-    Value expected_false = {.type = VAL_BOOL, .data = {.bool_val = false}};
+    Value expected_false = val_bool(false);
     test_eval("equals 5 10", expected_false);
     test_eval("equals true false", expected_false);
 
@@ -135,7 +359,7 @@ void test_comparisons() {
     test_eval("equals 5 true", expected_false);
 
     // Check type
-    test_type("equals", "'a -> 'a -> unit");
+    test_type("equals", "'a -> 'a -> bool");
 }
 
 // Test if-then-else construct
@@ -143,11 +367,11 @@ void test_if_then_else() {
     printf("\n=== Testing If-Then-Else Construct ===\n");
 
     // Basic if-then-else with true condition
-    Value expected_true_branch = {.type = VAL_INT, .data = {.int_val = 1}};
+    Value expected_true_branch = val_int(1);
     test_eval("if true 1 2", expected_true_branch);
 
     // Basic if-then-else with false condition
-    Value expected_false_branch = {.type = VAL_INT, .data = {.int_val = 2}};
+    Value expected_false_branch = val_int(2);
     test_eval("if false 1 2", expected_false_branch);
 
     // Nested if-then-else
@@ -157,13 +381,31 @@ void test_if_then_else() {
     test_eval("if (equals (add 2 3) 5) 1 2", expected_true_branch);
 
     // Check type
-    test_type("if", "unit -> 'a -> 'a -> 'a");
-
-    // Error cases
+    test_type("\\c.\\t.\\e.if c t e", "bool -> 'a -> 'a -> 'a");
+
+    // Only the branch taken is evaluated, so if is not a value of its own:
+    // it has to be given a condition and both branches, and may be given
+    // more. A local binding named if is an ordinary variable.
+    test_type_error("if", "1:1: Type error: if has to be applied to a "
+                          "condition and both branches");
+    test_type_error("let pick = if true in pick 1 2",
+                    "1:12: Type error: if has to be applied to a condition "
+                    "and both branches");
+    test_eval("if false succ (add 1) 5", val_int(6));
+    test_type("let if = \\x.x in if 3", "int");
+    Env *env = init_standard_env();
+    Exp *exp = parse("(\\x.x) if", NULL);
+    unsigned int frame_size;
+    Error error;
+    assert(!resolve(exp, env, &frame_size, &error));
+    assert(error.offset == 7 && strcmp(error.message,
+                                       "if has to be applied to a condition "
+                                       "and both branches") == 0);
+    free_exp(exp);
 
     // Both branches must have the same type
-    test_type("if true 1 2", "unit");
-    test_type("if true \\x.x \\y.y", "'a -> 'a");
+    test_type("if true 1 2", "int");
+    test_type("if true (\\x.x) (\\y.y)", "'a -> 'a");
 }
 
 // Test let bindings
@@ -171,7 +413,7 @@ void test_let_bindings() {
     printf("\n=== Testing Let Bindings ===\n");
 
     // Simple let binding
-    Value expected_int = {.type = VAL_INT, .data = {.int_val = 42}};
+    Value expected_int = val_int(42);
     test_eval("let x = 42 in x", expected_int);
 
     // Let binding with function
@@ -185,22 +427,43 @@ void test_let_bindings() {
 
     // Let polymorphism
     test_type("let id = \\x.x in id", "'a -> 'a");
-    test_type("let id = \\x.x in id 42", "unit");
-    test_type("let id = \\x.x in id true", "unit");
+    test_type("let id = \\x.x in id 42", "int");
+    test_type("let id = \\x.x in id true", "bool");
+    test_type("let id = \\x.x in let n = id 1 in id true", "bool");
+    test_type("let k = \\a.\\b.\\c.\\d.\\e.a in let x = k 1 in k",
+              "'a -> 'b -> 'c -> 'd -> 'e -> 'a");
+
+    // Leaving a scope brings back the binding it shadowed
+    test_type("(\\x.let x = true in x) 1", "bool");
+    test_type("let x = 1 in let y = (\\x.x) true in x", "int");
+    test_type("let add = \\x.x in let y = add true in add", "'a -> 'a");
 
     // Let with recursive function
-    Value expected_factorial = {.type = VAL_INT, .data = {.int_val = 120}};
+    Value expected_factorial = val_int(120);
     test_eval(
         "let fact = \\n.if (equals n 0) 1 (multiply n (fact (subtract n "
         "1))) in fact 5",
         expected_factorial);
 
     // Let with multiple recursion
-    Value expected_fib = {.type = VAL_INT, .data = {.int_val = 5}};
+    Value expected_fib = val_int(5);
     test_eval(
         "let fib = \\n.if (equals n 0) 0 (if (equals n 1) 1 (add (fib "
         "(subtract n 1)) (fib (subtract n 2)))) in fib 5",
         expected_fib);
+
+    // Only a lambda can refer to itself: any other value would be used
+    // before it exists
+    test_type_error("let f = if true (\\n.if (equals n 0) 0 (f (subtract n "
+                    "1))) succ in f 3",
+                    "1:40: Type error: f is used in its own definition, "
+                    "which is not a lambda");
+    test_type_error("let x = add x 1 in x",
+                    "1:13: Type error: x is used in its own definition, "
+                    "which is not a lambda");
+    test_eval("let f = \\n.if (equals n 0) 0 ((\\g.g (subtract n 1)) f) "
+              "in f 3",
+              val_int(0));
 }
 
 // Test higher-order functions
@@ -208,7 +471,7 @@ void test_higher_order() {
     printf("\n=== Testing Higher-Order Functions ===\n");
 
     // Function composition
-    Value expected_int = {.type = VAL_INT, .data = {.int_val = 42}};
+    Value expected_int = val_int(42);
     test_eval(
         "let compose = \\f.\\g.\\x.f (g x) in let double = \\x.add x x in "
         "let inc = \\x.add x 1 in ((compose double inc) 20)",
@@ -228,9 +491,808 @@ void test_higher_order() {
     // Map function
     test_type("\\f.\\x.f x", "('a -> 'b) -> 'a -> 'b");
 
-    // Y combinator
-    test_type("\\f.(\\x.f (x x)) (\\x.f (x x))", "('a -> 'a) -> 'a");
+    // Every use of f is unified with the same variable
+    test_type("\\f.\\x.f (f (f x))", "('a -> 'a) -> 'a -> 'a");
+
+    // Fixed point. The Y combinator itself has no type: x x fails the
+    // occurs check, so the recursion has to go through a let.
+    test_type("let fix = \\f.\\x.f (fix f) x in fix",
+              "(('a -> 'b) -> 'a -> 'b) -> 'a -> 'b");
+}
+// Test recursion deeper than the C stack allows
+void test_deep_recursion() {
+    printf("\n=== Testing Deep Recursion ===\n");
+
+    // Negate true 2^20 times with a Church numeral; every step is a tail
+    // call, so eval() runs it in constant stack space as well
+    Value expected_true = val_bool(true);
+    test_eval(
+        "let two = \\f.\\x.f (f x) in let mul = \\a.\\b.\\f.a (b f) in "
+        "let n16 = two two two in "
+        "let n = mul n16 (mul n16 (mul n16 (mul n16 n16))) in "
+        "let not = \\p.\\a.\\b.p b a in n not (\\x.\\y.x) true false",
+        expected_true);
+
+    // The same count as a chain of 2^20 successors, which nests a non-tail
+    // call per step; no engine keeps those on the C stack
+    test_eval(
+        "let succ = \\n.\\f.\\x.f (n f x) in let zero = \\f.\\x.x in "
+        "let two = \\f.\\x.f (f x) in let mul = \\a.\\b.\\f.a (b f) in "
+        "let n16 = two two two in "
+        "let n = mul n16 (mul n16 (mul n16 (mul n16 n16))) succ zero in "
+        "let not = \\p.\\a.\\b.p b a in n not (\\x.\\y.x) true false",
+        expected_true);
+}
+
+void test_gc() {
+    printf("\n=== Testing Garbage Collection ===\n");
+    GcStats before, after;
+    gc_get_stats(&before);
+
+    // A chain of 2^16 successor closures has to survive the collections
+    // made while it is being built and then walked
+    Value expected_true = val_bool(true);
+    test_eval(
+        "let succ = \\n.\\f.\\x.f (n f x) in let zero = \\f.\\x.x in "
+        "let two = \\f.\\x.f (f x) in let mul = \\a.\\b.\\f.a (b f) in "
+        "let n16 = two two two in "
+        "let n = mul n16 (mul n16 (mul n16 n16)) succ zero in "
+        "let not = \\p.\\a.\\b.p b a in n not (\\x.\\y.x) true false",
+        expected_true);
+
+    // Nothing is rooted between evaluations, so all of it is garbage now
+    gc_collect();
+    gc_get_stats(&after);
+    assert(after.collections > before.collections + 1);
+    assert(after.live_bytes == 0);
+    printf("  %lu collections, %lu objects freed\n",
+           after.collections - before.collections,
+           after.objects_freed - before.objects_freed);
+}
+
+void test_lazy() {
+    printf("\n=== Testing Call-by-Need ===\n");
+
+    // Arguments that are never used are never evaluated
+    test_eval_lazy("(\\x.\\y.x) 1 ((\\x.x x) (\\x.x x))", val_int(1));
+    test_eval_lazy("let loop = (\\x.x x) (\\x.x x) in "
+                   "let k = \\a.\\b.a in k true loop",
+                   val_bool(true));
+    test_eval_lazy("let f = \\x. if false x 2 in f ((\\x.x x) (\\x.x x))",
+                   val_int(2));
+
+    // A thunk used three times is evaluated once
+    size_t once = test_eval_lazy(
+        "let two = \\f.\\x.f (f x) in let mul = \\a.\\b.\\f.a (b f) in "
+        "let n16 = two two two in let n = mul n16 (mul n16 n16) in "
+        "n (\\k. add k 1) 0",
+        val_int(4096));
+    size_t shared = test_eval_lazy(
+        "let two = \\f.\\x.f (f x) in let mul = \\a.\\b.\\f.a (b f) in "
+        "let n16 = two two two in let n = mul n16 (mul n16 n16) in "
+        "let c = n (\\k. add k 1) 0 in add c (add c c)",
+        val_int(3 * 4096));
+    printf("  %zu bytes allocated for one use, %zu for three\n", once, shared);
+    assert(shared < 2 * once);
+
+    // Thunks share the frame they are made in, so a function binding ten
+    // times as many lets allocates about ten times as much
+    size_t bytes[2];
+    for (unsigned int k = 0; k < 2; k++) {
+        unsigned int lets = k == 0 ? 20 : 200;
+        char *source = malloc(lets * 40 + 64);
+        int length = sprintf(source, "let f = \\x0.");
+        for (unsigned int i = 1; i <= lets; i++) {
+            length += sprintf(source + length, "let x%u = add x%u 1 in ", i,
+                              i - 1);
+        }
+        sprintf(source + length, "x%u in f 0", lets);
+        bytes[k] = test_eval_lazy(source, val_int(lets));
+        free(source);
+    }
+    printf("  %zu bytes allocated for 20 lets, %zu for 200\n", bytes[0],
+           bytes[1]);
+    assert(bytes[1] < 20 * bytes[0]);
+
+    // An accumulator is a chain of thunks as long as the loop, forced
+    // without using the C stack
+    test_eval_lazy("let loop = \\n.\\acc.if (equals n 0) acc "
+                   "(loop (subtract n 1) (add acc n)) in loop 300000 0",
+                   val_int(2050477040u));
+}
+
+void test_type_sharing() {
+    printf("\n=== Testing Type Sharing ===\n");
+    InferContext *ctx = new_infer_context();
+    TypeEnv *env = init_standard_type_env(ctx);
+
+    // Closed types are built once and compared by address
+    Type *int_to_int = type_function(ctx, type_int(), type_int());
+    assert(infer_ok(ctx, parse("42", NULL), env) == type_int());
+    assert(infer_ok(ctx, parse("succ", NULL), env) == int_to_int);
+    assert(find_type(infer_ok(ctx, parse("add 1", NULL), env)) ==
+           int_to_int);
+    assert(type_function(ctx, type_int(),
+                         type_function(ctx, type_int(), type_int())) ==
+           infer_ok(ctx, parse("add", NULL), env));
+    Type *var = new_typevar(ctx);
+    assert(type_function(ctx, var, type_int()) !=
+           type_function(ctx, var, type_int()));
+
+    // Instances share every part without quantified variables
+    Type *var_to_var = type_function(ctx, var, var);
+    PolyType *mono = dont_generalize(var_to_var);
+    assert(instantiate(ctx, mono) == var_to_var);
+    Type **quantified = malloc(sizeof(Type *));
+    quantified[0] = new_typevar(ctx);
+    PolyType *poly =
+        quantify(type_function(ctx, quantified[0], var_to_var), quantified, 1);
+    Type *instance = instantiate(ctx, poly);
+    assert(instance->data.function.param != quantified[0]);
+    assert(instance->data.function.param->kind == TYPE_VAR);
+    assert(instance->data.function.result == var_to_var);
+    free_polytype(mono);
+    free_polytype(poly);
+
+    // A release frees everything made after the mark, in the same places
+    TypeMark inner = type_arena_mark(ctx);
+    Type *bool_to_bool = type_function(ctx, type_bool(), type_bool());
+    type_arena_release(ctx, inner);
+    assert(type_function(ctx, type_unit(), type_unit()) == bool_to_bool);
+    assert(type_function(ctx, type_bool(), type_bool()) != bool_to_bool);
+    free_type_env(env);
+    free_infer_context(ctx);
+    printf("  ok\n");
+}
+
+void test_batch() {
+    printf("\n=== Testing Batch Checking ===\n");
+    const char *programs[] = {
+        "42",
+        "\\x.x",
+        "let id = \\x.x in id id",
+        "\\f.\\x.f (f (f x))",
+        "if (equals 1 2) (\\x.add x 1) succ",
+        "let compose = \\f.\\g.\\x.f (g x) in compose succ succ",
+        "\\x.\\y.\\z.x z (y z)",
+        "let k = \\x.\\y.x in k true",
+    };
+    const char *expected[] = {
+        "int",
+        "'a -> 'a",
+        "'a -> 'a",
+        "('a -> 'a) -> 'a -> 'a",
+        "int -> int",
+        "int -> int",
+        "('a -> 'b -> 'c) -> ('a -> 'b) -> 'a -> 'c",
+        "'a -> bool",
+    };
+    unsigned int num_programs = sizeof(programs) / sizeof(programs[0]);
+
+    // Many copies, so that every thread checks some of each
+    unsigned int count = 64 * num_programs;
+    const char **sources = malloc(count * sizeof(char *));
+    char **types = malloc(count * sizeof(char *));
+    for (unsigned int i = 0; i < count; i++) {
+        sources[i] = programs[i % num_programs];
+    }
+    for (unsigned int threads = 1; threads <= 4; threads += 3) {
+        check_batch(sources, count, types, threads);
+        for (unsigned int i = 0; i < count; i++) {
+            assert(strcmp(types[i], expected[i % num_programs]) == 0);
+            free(types[i]);
+        }
+    }
+    free(sources);
+    free(types);
+    printf("  ok\n");
+}
+
+void test_specialize() {
+    printf("\n=== Testing Specialization ===\n");
+
+    // Integer code runs unboxed from the outermost primitive down
+    test_eval_specialized("add (multiply 2 3) (succ 4)", val_int(11), "",
+                          REP_INT);
+    test_eval_specialized("add (multiply 2 3) (succ 4)", val_int(11), "1",
+                          REP_INT);
+    test_eval_specialized("equals (add 1 2) 3", val_bool(true), "", REP_BOOL);
+    test_eval_specialized("if (equals 1 2) 2 (subtract 7 4)", val_int(3), "",
+                          REP_INT);
+    test_eval_specialized("let f = \\x.add x 1 in f 41", val_int(42), "vl",
+                          REP_INT);
+    test_eval_specialized(
+        "let sum = \\n.if (equals n 0) 0 (add n (sum (subtract n 1))) in "
+        "sum 100",
+        val_int(5050), "vl2", REP_INT);
+    test_eval_specialized("subtract 0 1", val_int(4294967295u), "", REP_INT);
+
+    // Polymorphic code keeps boxed values
+    test_eval_specialized("let pick = \\x.\\y.if true x y in pick 1 2",
+                          val_int(1), "vll", REP_BOXED);
+    test_eval_specialized("let same = \\x.equals x x in same true",
+                          val_bool(true), "vl", REP_BOXED);
+    test_eval_specialized("equals (\\x.x) (\\x.x)", val_bool(false), "",
+                          REP_BOXED);
+    test_eval_specialized("let f = if true (\\x.x) succ in f 5", val_int(5),
+                          "v", REP_BOXED);
+
+    // Resolved before inference the additions are primitives inside closed
+    // lambdas, so the second one is a memo hit and still runs unboxed
+    printf("Testing specialized memo hit\n");
+    InferContext *ctx = new_infer_context();
+    TypeEnv *type_env = init_standard_type_env(ctx);
+    Env *env = init_standard_env();
+    Exp *exp = parse("let a = \\y.add y 1 in let b = \\y.add y 1 in b (a 1)",
+                     NULL);
+    unsigned int frame_size = resolve_ok(exp, env);
+    infer_ok(ctx, exp, type_env);
+    specialize(exp);
+    Exp *first = lambda_body(let_value(exp));
+    Exp *second = lambda_body(let_value(let_body(exp)));
+    assert(first->type == EXP_PRIM && first->data.prim.rep == REP_INT);
+    assert(second->type == EXP_PRIM && second->data.prim.rep == REP_INT);
+    Env *frame = new_frame(frame_size, NULL, env->slots);
+    check_value("Result", eval(exp, frame), val_int(3));
+    free_exp(exp);
+    free_type_env(type_env);
+    free_infer_context(ctx);
+}
+
+// Type variables made while inferring copies of a closed combinator
+static typevar_id typevars_for_copies(const char *combinator,
+                                      unsigned int copies) {
+    InferContext *ctx = new_infer_context();
+    TypeEnv *env = init_standard_type_env(ctx);
+    char *source = malloc(copies * (strlen(combinator) + 20) + 3);
+    source[0] = '\0';
+    for (unsigned int i = 0; i < copies; i++) {
+        sprintf(source + strlen(source), "let c%u = %s in ", i, combinator);
+    }
+    strcat(source, "c0");
+    Exp *exp = parse(source, NULL);
+    free(source);
+    typevar_id before = new_typevar_id(ctx);
+    infer_ok(ctx, exp, env);
+    typevar_id used = new_typevar_id(ctx) - before;
+    free_exp(exp);
+    free_type_env(env);
+    free_infer_context(ctx);
+    return used;
+}
+
+void test_closed_memo() {
+    printf("\n=== Testing Memoised Closed Terms ===\n");
+
+    // Equal up to renaming, or only similar
+    test_type("let k = \\x.\\y.x in let s = \\x.\\y.y in k (s 1) true",
+              "'a -> 'a");
+    test_type("(\\a.\\b.a) ((\\x.\\y.x) 1) true", "'a -> int");
+    test_type("(\\f.\\x.f x) (\\f.\\x.f x) succ 1", "int");
+    test_type("let i = \\x.x in (\\x.x) i ((\\x.x) 1)", "int");
+    test_type("\\z.(\\x.\\y.x) z ((\\x.\\y.y) z)", "'a -> 'a");
+    test_type("\\z.(\\x.equals x x) z", "'a -> bool");
+
+    // Only the first copy is inferred, the others are instantiated
+    const char *combinator = "\\f.\\x.f (f (f (f x)))";
+    typevar_id one = typevars_for_copies(combinator, 1);
+    typevar_id many = typevars_for_copies(combinator, 20);
+    printf("  %d type variables for one copy, %d for twenty\n", one, many);
+    assert(many < 20 * one / 2);
+
+    // In a nest of closed lambdas only the outermost one is generalized,
+    // so the work grows linearly with the depth
+    int depth = 2000;
+    char *nest = malloc((size_t)depth * 9 + 2);
+    char *p = nest;
+    for (int i = 0; i < depth; i++) {
+        p += sprintf(p, "\\x%d.", i);
+    }
+    strcpy(p, "1");
+    typevar_id nested = typevars_for_copies(nest, 1);
+    printf("  %d type variables for %d nested lambdas\n", nested, depth);
+    assert(nested < 4 * depth);
+    free(nest);
+
+    // Entries go with the types released
+    InferContext *ctx = new_infer_context();
+    TypeEnv *env = init_standard_type_env(ctx);
+    TypeMark mark = type_arena_mark(ctx);
+    for (int i = 0; i < 3; i++) {
+        Exp *exp = parse("(\\x.\\y.x) (\\x.\\y.x)", NULL);
+        char *type_str = type_to_string(infer_ok(ctx, exp, env));
+        assert(strcmp(type_str, "'a -> 'b -> 'c -> 'b") == 0);
+        free(type_str);
+        type_arena_release(ctx, mark);
+        free_exp(exp);
+    }
+    free_type_env(env);
+    free_infer_context(ctx);
+}
+
+void test_type_printing() {
+    printf("\n=== Testing Type Printing ===\n");
+
+    // Equal subtrees too large to repeat are printed once
+    test_type("let p = \\x.\\y.y x x in let q = \\x.p (p x) in "
+              "let r = \\x.q (q x) in r",
+              "'a -> (t1 -> t1 -> 'b) -> 'b where t1 = (t2 -> t2 -> 'c) -> "
+              "'c, t2 = ((('a -> 'a -> 'd) -> 'd) -> (('a -> 'a -> 'd) -> "
+              "'d) -> 'e) -> 'e");
+    test_type("\\a.\\b.\\c.\\d.\\e.\\f.\\g.\\h.\\i.\\j.\\k.\\l.\\m."
+              "\\n.\\o.\\p.\\q.\\r.\\s.\\t.\\u.\\v.\\w.\\x.\\y.\\z."
+              "\\z1.z1",
+              "'a -> 'b -> 'c -> 'd -> 'e -> 'f -> 'g -> 'h -> 'i -> 'j -> "
+              "'k -> 'l -> 'm -> 'n -> 'o -> 'p -> 'q -> 'r -> 's -> 't -> "
+              "'u -> 'v -> 'w -> 'x -> 'y -> 'z -> 'a1 -> 'a1");
+
+    // A type whose tree doubles at every level prints in linear space
+    InferContext *ctx = new_infer_context();
+    Type *type = type_function(ctx, new_typevar(ctx), type_int());
+    for (int i = 0; i < 64; i++) {
+        type = type_function(ctx, type, type);
+    }
+    char *type_str = type_to_string(type);
+    printf("  %.60s... (%zu characters)\n", type_str, strlen(type_str));
+    assert(strncmp(type_str, "t1 -> t1 where t1 = t2 -> t2, t2 = ", 35) == 0);
+    assert(strlen(type_str) < 64 * 20);
+    free(type_str);
+    free_infer_context(ctx);
+}
+
+void test_errors() {
+    printf("\n=== Testing Errors ===\n");
+
+    // Syntax errors are returned with where they were found
+    const char *syntax[] = {"(\\x.x", "\\x.x $ 1", "1 )", "let x = 1 x", ""};
+    const char *syntax_messages[] = {
+        "1:6: Syntax error: expected RPAREN, got EOF",
+        "1:6: Syntax error: unexpected character '$'",
+        "1:3: Syntax error: expected end of input, got RPAREN",
+        "1:12: Syntax error: expected IN, got EOF",
+        "1:1: Syntax error: expected an expression, got EOF",
+    };
+    for (unsigned int i = 0; i < sizeof(syntax) / sizeof(syntax[0]); i++) {
+        Error error;
+        assert(parse(syntax[i], &error) == NULL);
+        assert(error.kind == ERROR_SYNTAX);
+        char *message = error_to_string(&error, syntax[i]);
+        printf("  %s\n", message);
+        assert(strcmp(message, syntax_messages[i]) == 0);
+        free(message);
+    }
+
+    // So are type errors, and the environment is left as it was
+    InferContext *ctx = new_infer_context();
+    TypeEnv *env = init_standard_type_env(ctx);
+    TypeMark mark = type_arena_mark(ctx);
+    const char *ill_typed[] = {"add true 1", "\\f.f f",
+                               "let f = \\x.x in f y",
+                               "let g = \\x.x in \\y.g (y y)"};
+    const char *type_messages[] = {
+        "1:1: Type error: cannot unify int -> int -> int with bool -> 'a",
+        "1:4: Type error: 'a and 'a -> 'b would make a recursive type",
+        "1:19: Type error: unbound variable y",
+        "1:23: Type error: 'a and 'a -> 'b would make a recursive type",
+    };
+    for (unsigned int i = 0; i < sizeof(ill_typed) / sizeof(ill_typed[0]);
+         i++) {
+        Error error;
+        Exp *exp = parse(ill_typed[i], &error);
+        assert(infer(ctx, exp, env, &error) == NULL);
+        assert(error.kind == ERROR_TYPE);
+        char *message = error_to_string(&error, ill_typed[i]);
+        printf("  %s\n", message);
+        assert(strcmp(message, type_messages[i]) == 0);
+        free(message);
+        type_arena_release(ctx, mark);
+        free_exp(exp);
+
+        exp = parse("let f = succ in f", NULL);
+        char *type_str = type_to_string(infer_ok(ctx, exp, env));
+        assert(strcmp(type_str, "int -> int") == 0);
+        free(type_str);
+        type_arena_release(ctx, mark);
+        free_exp(exp);
+    }
+    free_type_env(env);
+    free_infer_context(ctx);
+
+    // Runtime errors unwind to the handler, placed at the call that failed
+    test_runtime_error("add true 1",
+                       "1:1: Runtime error: add expects two integers");
+    test_runtime_error("(\\x.x 1) 2",
+                       "1:5: Runtime error: cannot apply a non-function value");
+    test_runtime_error("if 1 2 3",
+                       "1:1: Runtime error: if expects a boolean condition");
+    test_runtime_error("let f = \\x.succ x in f true",
+                       "1:12: Runtime error: succ expects an integer argument");
+    test_runtime_error("let a = add in a 1 unit",
+                       "1:16: Runtime error: add expects two integers");
+    test_runtime_error(
+        "let a = 2 in succ (a 3)",
+        "1:20: Runtime error: cannot apply a non-function value");
+
+    // Resolving untyped code reports an unbound variable the way the type
+    // checker does
+    Env *standard = init_standard_env();
+    const char *unbound = "let f = \\x.add x y in f 1";
+    Exp *unbound_exp = parse(unbound, NULL);
+    unsigned int unbound_size;
+    Error unbound_error;
+    assert(!resolve(unbound_exp, standard, &unbound_size, &unbound_error));
+    char *unbound_str = error_to_string(&unbound_error, unbound);
+    printf("  %s\n", unbound_str);
+    assert(strcmp(unbound_str, "1:18: Type error: unbound variable y") == 0);
+    free(unbound_str);
+    free_exp(unbound_exp);
+
+    // The CEK machine and the VM free their stacks when an error unwinds
+    // them, so a session can go on hitting errors without growing
+    unsigned int test_roots = gc_save_roots();
+    Env *globals = init_standard_env();
+    gc_root_env(&globals);
+    Exp *exp = parse("(\\f.f 1) (\\x.add x true)", NULL);
+    unsigned int frame_size = resolve_ok(exp, globals);
+    Program *program = compile(exp, frame_size);
+    size_t before = 0;
+    for (int i = 0; i < 20000; i++) {
+        if (i == 1000) {
+            before = mallinfo2().uordblks;
+        }
+        RuntimeHandler handler;
+        push_runtime_handler(&handler);
+        unsigned int saved_roots = gc_save_roots();
+        if (setjmp(handler.jump) == 0) {
+            if (i % 2 == 0) {
+                eval_cek(exp, new_frame(frame_size, NULL, globals->slots));
+            } else {
+                vm_run(program, globals);
+            }
+            assert(!"expected a runtime error");
+        }
+        gc_restore_roots(saved_roots);
+        pop_runtime_handler(&handler);
+    }
+    size_t after = mallinfo2().uordblks;
+    printf("  heap grew by %zu bytes over 19000 errors\n",
+           after > before ? after - before : 0);
+    // The collector's heap grows by about a megabyte; a leak would be
+    // several kilobytes per error
+    assert(after < before + (8u << 20));
+    gc_restore_roots(test_roots);
+    gc_collect();
+    free_program(program);
+    free_exp(exp);
+    printf("  ok\n");
+}
+
+void test_values() {
+    printf("\n=== Testing Value Representation ===\n");
+
+    assert(sizeof(Value) == 8);
+    assert(as_int(val_int(0)) == 0);
+    assert(as_int(val_int(4294967295u)) == 4294967295u);
+    assert(as_bool(val_bool(true)) && !as_bool(val_bool(false)));
+    assert(value_type(val_unit()) == VAL_UNIT);
+    assert(value_type(make_primitive(PRIM_IF)) == VAL_PRIMITIVE);
+
+    // Partial applications keep their arguments on the heap
+    test_eval("let inc = add 1 in let twice = \\f.\\x.f (f x) in "
+              "twice inc 40",
+              val_int(42));
+    test_eval("let same = equals 2 in same 2", val_bool(true));
+}
+
+void test_lexer() {
+    printf("\n=== Testing Lexer ===\n");
+
+    // Tokens are slices of the input
+    const char *input = "let f_1' = \\x.add x 42 in # comment\n f_1' unit";
+    TokenType types[] = {TOKEN_LET,        TOKEN_IDENTIFIER, TOKEN_EQUALS,
+                         TOKEN_LAMBDA,     TOKEN_IDENTIFIER, TOKEN_DOT,
+                         TOKEN_IDENTIFIER, TOKEN_IDENTIFIER, TOKEN_INT,
+                         TOKEN_IN,         TOKEN_IDENTIFIER, TOKEN_UNIT,
+                         TOKEN_EOF};
+    const char *spellings[] = {"let", "f_1'", "=",    "\\", "x",
+                               ".",   "add",  "x",    "42", "in",
+                               "f_1'", "unit", ""};
+    Lexer lexer;
+    lexer_init(&lexer, input, (unsigned int)strlen(input), 0);
+    for (unsigned int i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        Token token = lexer.current;
+        assert(token.type == types[i]);
+        assert(token.length == strlen(spellings[i]));
+        assert(strncmp(input + token.offset, spellings[i], token.length) ==
+               0);
+        if (token.type == TOKEN_INT) {
+            assert(token.int_val == 42);
+        }
+        lexer_next(&lexer);
+    }
+    assert(lexer.current.type == TOKEN_EOF);
+
+    // Names are interned on demand
+    lexer_init(&lexer, "add", 3, 0);
+    assert(token_symbol(&lexer) == intern("add"));
+    printf("  ok\n");
+}
+
+void test_scanners() {
+    printf("\n=== Testing Vector Scanning ===\n");
+
+    // Every supported scanner finds the same ends as the scalar one, for
+    // runs of every length and starting at every alignment
+    const char alphabet[] = " \t\n\r\v\fazAZ09_'.#;()\\\x80\xff";
+    char input[512];
+    srand(1);
+    for (int round = 0; round < 64; round++) {
+        // Long runs of one class with the odd byte of another
+        for (unsigned int i = 0; i < sizeof(input); i++) {
+            unsigned int run = i / (unsigned int)(1 + round % 40);
+            if (rand() % 8 == 0) {
+                input[i] = alphabet[rand() % (int)(sizeof(alphabet) - 1)];
+            } else if (run % 2 == 0) {
+                input[i] = " \t\n"[rand() % 3];
+            } else {
+                input[i] = "aZ9_'"[rand() % 5];
+            }
+        }
+        const char *end = input + sizeof(input);
+        const Scanner *scalar = get_scanner(SCAN_SCALAR);
+        for (ScanLevel level = SCAN_SSE2; level <= SCAN_AVX2; level++) {
+            const Scanner *scanner = get_scanner(level);
+            for (const char *p = input; p <= end; p++) {
+                assert(scanner->spaces(p, end) == scalar->spaces(p, end));
+                assert(scanner->identifier(p, end) ==
+                       scalar->identifier(p, end));
+            }
+        }
+    }
+    // A level the CPU lacks falls back to the best one it has
+    assert(get_scanner(SCAN_AVX2) == get_scanner(best_scan_level()));
+    set_scan_level(SCAN_AVX2);
+    Exp *exp = parse("let x = 1 in x", NULL);
+    assert(exp->type == EXP_LET);
+    free_exp(exp);
+    set_scan_level(best_scan_level());
+    printf("  best level %d\n", best_scan_level());
+    printf("  ok\n");
+}
+
+void test_programs() {
+    printf("\n=== Testing Programs ===\n");
+
+    // Expressions end at ";;" and may span lines; one in error is skipped
+    // and the rest still parse. The source is read only up to its length.
+    const char *source = "let x =\n 1 in\n x ;; (\\x. ;; # comment\n"
+                         "\\y.y;;\n  true  \n;; never read";
+    unsigned int length = (unsigned int)(strstr(source, ";; never") - source);
+    unsigned int position = 0;
+    Exp *exp;
+    Error error;
+    assert(parse_next(source, length, &position, &exp, &error) == PARSE_OK);
+    assert(exp->type == EXP_LET);
+    free_exp(exp);
+    assert(parse_next(source, length, &position, &exp, &error) ==
+           PARSE_ERROR);
+    assert(error.kind == ERROR_SYNTAX && error.offset == 25);
+    assert(parse_next(source, length, &position, &exp, &error) == PARSE_OK);
+    assert(exp->type == EXP_LAMBDA);
+    free_exp(exp);
+    assert(parse_next(source, length, &position, &exp, &error) == PARSE_OK);
+    assert(exp->type == EXP_BOOL);
+    free_exp(exp);
+    assert(position == length);
+    assert(parse_next(source, length, &position, &exp, &error) == PARSE_END);
+
+    // With no limit on the length of an expression
+    unsigned int n = 2000;
+    char *large = malloc(7 * n + 2);
+    char *p = large;
+    for (unsigned int i = 0; i < n; i++) {
+        p += sprintf(p, "succ (");
+    }
+    p += sprintf(p, "0");
+    memset(p, ')', n);
+    p += n;
+    position = 0;
+    assert(parse_next(large, (unsigned int)(p - large), &position, &exp,
+                      &error) == PARSE_OK);
+    assert(position == (unsigned int)(p - large));
+    free(large);
+    printf("  ok\n");
+}
+
+void test_exp_arena() {
+    printf("\n=== Testing Expression Arena ===\n");
+
+    // A tree's nodes are one array with the root first, so children are
+    // found by 32-bit offsets and freeing is one free()
+    printf("  %zu bytes per node\n", sizeof(Exp));
+    assert(sizeof(Exp) <= 56);
+    ExpBuilder nodes;
+    init_exp_builder(&nodes);
+    ExpId x = make_var(&nodes, intern("x"));
+    ExpId id = make_lambda(&nodes, intern("x"), x);
+    ExpId root = make_apply(&nodes, id, make_int(&nodes, 7));
+    Exp *exp = finish_exp(&nodes, root);
+    assert(exp->type == EXP_APPLY);
+    assert(apply_fn(exp)->type == EXP_LAMBDA);
+    assert(lambda_body(apply_fn(exp))->data.var.name == intern("x"));
+    assert(apply_arg(exp)->data.int_val == 7);
+    free_exp(exp);
+
+    // Children come before their parents; the root was moved to the front
+    exp = parse("let f = \\x.x in f (f 1)", NULL);
+    Exp *value = let_value(exp);
+    Exp *body = let_body(exp);
+    assert(value > exp && lambda_body(value) < value);
+    assert(apply_fn(body) < body && apply_arg(body) < body);
+    free_exp(exp);
+    printf("  ok\n");
 }
+
+// Print exp to a string, which the caller frees
+static char *print_to_string(Exp *exp) {
+    fflush(stdout);
+    int saved = dup(fileno(stdout));
+    FILE *file = tmpfile();
+    assert(saved >= 0 && file != NULL);
+    dup2(fileno(file), fileno(stdout));
+    print_exp(exp);
+    fflush(stdout);
+    dup2(saved, fileno(stdout));
+    close(saved);
+    long size = ftell(file);
+    char *text = malloc((size_t)size + 1);
+    rewind(file);
+    assert(fread(text, 1, (size_t)size, file) == (size_t)size);
+    text[size] = '\0';
+    fclose(file);
+    return text;
+}
+
+void test_deep_nesting() {
+    printf("\n=== Testing Deep Nesting ===\n");
+
+    // Neither the parser nor printing use the C stack for nesting, so
+    // both go far deeper than it would allow
+    unsigned int n = 1000000;
+    char *source = malloc(13 * n + 2);
+    memset(source, '(', n);
+    strcpy(source + n, "1");
+    memset(source + n + 1, ')', n);
+    source[2 * n + 1] = '\0';
+    Exp *exp = parse(source, NULL);
+    assert(exp->type == EXP_INT && exp->data.int_val == 1);
+    free_exp(exp);
+
+    // Unclosed, the error is still at the end
+    source[n + 1] = '\0';
+    Error error;
+    assert(parse(source, &error) == NULL);
+    assert(error.kind == ERROR_SYNTAX && error.offset == n + 1);
+
+    free(source);
+
+    // Nested lambdas, lets and applications far deeper than the C stack
+    // would allow check and run with every engine: no pass recurses
+    n = 100000;
+    source = malloc(24 * n + 32);
+    for (unsigned int shape = 0; shape < 3; shape++) {
+        char *p = source;
+        unsigned int expected = 5;
+        switch (shape) {
+            case 0:
+                p += sprintf(p, "let f = ");
+                for (unsigned int i = 0; i < n - 2; i++) {
+                    p += sprintf(p, "\\x%u. ", i);
+                }
+                sprintf(p, "x0 in 5");
+                break;
+            case 1:
+                for (unsigned int i = 0; i < n - 1; i++) {
+                    p += sprintf(p, "let x%u = %u in ", i, i);
+                }
+                sprintf(p, "x5");
+                break;
+            default:
+                for (unsigned int i = 0; i < n - 1; i++) {
+                    p += sprintf(p, "succ (");
+                }
+                p += sprintf(p, "1");
+                memset(p, ')', n - 1);
+                p[n - 1] = '\0';
+                expected = n;
+                break;
+        }
+        test_run_large(source, val_int(expected));
+    }
+    free(source);
+
+    // Printed the way it was before
+    exp = parse("let f = \\x. add x 1 in f (f (if true 1 2)) unit", NULL);
+    char *text = print_to_string(exp);
+    assert(strcmp(text, "(let f = (lambda x. ((add x) 1)) in "
+                        "((f (f (((if true) 1) 2))) ()))") == 0);
+    free(text);
+    free_exp(exp);
+
+    n = 100000;
+    source = malloc(4 * n + 2);
+    char *p = source;
+    for (unsigned int i = 0; i < n; i++) {
+        p += sprintf(p, "(f ");
+    }
+    *p++ = 'x';
+    memset(p, ')', n);
+    p[n] = '\0';
+    exp = parse(source, NULL);
+    text = print_to_string(exp);
+    assert(strcmp(text, source) == 0);
+    free(text);
+    free_exp(exp);
+    free(source);
+    printf("  ok\n");
+}
+
+#define INTERNED_NAMES 20000
+
+// Interns names n0, n1, ... starting at an offset given by the thread and
+// returns the symbol of each
+static void *intern_names(void *data) {
+    unsigned int start = (unsigned int)(unsigned long)data * 5000;
+    Symbol *symbols = malloc(INTERNED_NAMES * sizeof(Symbol));
+    for (unsigned int k = 0; k < INTERNED_NAMES; k++) {
+        unsigned int i = (start + k) % INTERNED_NAMES;
+        char name[16];
+        snprintf(name, sizeof(name), "n%u", i);
+        symbols[i] = intern(name);
+    }
+    return symbols;
+}
+
+void test_symbols() {
+    printf("\n=== Testing Symbol Interning ===\n");
+
+    Symbol x = intern("x");
+    assert(intern("x") == x);
+    assert(intern_n("xs", 1) == x);
+    assert(intern("xs") != x);
+    assert(strcmp(symbol_name(intern("xs")), "xs") == 0);
+
+    // Parsed names are the same symbols
+    Exp *exp = parse("\\x.x", NULL);
+    assert(exp->data.lambda.param == x);
+    assert(lambda_body(exp)->data.var.name == x);
+    free_exp(exp);
+
+    // Threads interning the same new names, each in its own order, agree
+    pthread_t threads[4];
+    for (unsigned long t = 0; t < 4; t++) {
+        int started = pthread_create(&threads[t], NULL, intern_names,
+                                     (void *)t);
+        assert(started == 0);
+    }
+    Symbol *seen[4];
+    for (unsigned int t = 0; t < 4; t++) {
+        pthread_join(threads[t], (void **)&seen[t]);
+    }
+    for (unsigned int i = 0; i < INTERNED_NAMES; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "n%u", i);
+        for (unsigned int t = 0; t < 4; t++) {
+            assert(seen[t][i] == seen[0][i]);
+        }
+        assert(strcmp(symbol_name(seen[0][i]), name) == 0);
+    }
+    for (unsigned int t = 0; t < 4; t++) {
+        free(seen[t]);
+    }
+    printf("  ok\n");
+}
+
 // Add this function to tests.c
 
 // Test multi-argument application
@@ -238,19 +1300,19 @@ void test_multi_arg_application() {
     printf("\n=== Testing Multi-Argument Application ===\n");
 
     // Primitive application
-    Value expected_sum = {.type = VAL_INT, .data = {.int_val = 3}};
+    Value expected_sum = val_int(3);
     test_eval("add 1 2", expected_sum);
 
     // Lambda application with multiple arguments
-    Value expected_first = {.type = VAL_INT, .data = {.int_val = 1}};
+    Value expected_first = val_int(1);
     test_eval("(\\x.\\y.x) 1 2", expected_first);
 
     // Lambda application with multiple arguments returning the second argument
-    Value expected_second = {.type = VAL_INT, .data = {.int_val = 2}};
+    Value expected_second = val_int(2);
     test_eval("(\\x.\\y.y) 1 2", expected_second);
 
     // More complex lambda applications
-    Value expected_complex = {.type = VAL_INT, .data = {.int_val = 5}};
+    Value expected_complex = val_int(5);
     test_eval("(\\f.\\x.f (f x)) (\\y.add y 1) 3", expected_complex);
 
     // Nested applications
@@ -266,6 +1328,45 @@ int main() {
     printf("Running Lambda Calculus Interpreter Tests\n");
     printf("=========================================\n");
 
+    // Symbol interning
+    test_symbols();
+
+    // Tokens as views of the input
+    test_lexer();
+
+    // Programs of several expressions
+    test_programs();
+
+    // Scanning many bytes at once
+    test_scanners();
+
+    // Trees allocated as one array
+    test_exp_arena();
+
+    // Nesting deeper than the C stack
+    test_deep_nesting();
+
+    // Tagged values
+    test_values();
+
+    // Shared type nodes
+    test_type_sharing();
+
+    // Checking independent programs in parallel
+    test_batch();
+
+    // Types with shared parts
+    test_type_printing();
+
+    // Inferring repeated closed terms once
+    test_closed_memo();
+
+    // Syntax, type and runtime errors
+    test_errors();
+
+    // Unboxed evaluation of monomorphic code
+    test_specialize();
+
     // multi-arg application
     test_multi_arg_application();
     // Basic expressions
@@ -274,6 +1375,9 @@ int main() {
     // Arithmetic primitives
     test_arithmetic();
 
+    // Saturated primitive calls
+    test_saturated_primitives();
+
     // Comparison primitives
     test_comparisons();
 
@@ -286,6 +1390,15 @@ int main() {
     // Higher-order functions
     test_higher_order();
 
+    // Deep recursion
+    test_deep_recursion();
+
+    // Garbage collection
+    test_gc();
+
+    // Call-by-need evaluation
+    test_lazy();
+
     printf("\nAll tests passed!\n");
     return 0;
 }
@@ -1,207 +1,580 @@
 #include "types.h"
 
+#include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-level current_level = 0;
-typevar_id current_typevar = 0;
+// Arena chunks are kept once allocated and reused after a release
+typedef struct TypeChunk {
+    struct TypeChunk *next;
+    size_t size;
+    char data[];
+} TypeChunk;
+
+#define CHUNK_SIZE (64 * 1024)
+
+typedef struct {
+    unsigned int hash;
+    const void *key;
+    PolyType *polytype;
+    unsigned int next;  // Next entry in the bucket plus one, or 0
+} TypeMemo;
+
+struct InferContext {
+    level current_level;
+    typevar_id current_typevar;
+    // Variables already collected by the generalization in progress carry
+    // its stamp, so each is found in constant time however many there are
+    unsigned int visit_stamp;
+
+    TypeChunk *first_chunk;
+    TypeChunk *current_chunk;
+    size_t chunk_used;
+
+    // Closed function types, chained by hash in buckets and listed in the
+    // order they were made, so a release can unlink the newest from their
+    // buckets
+    Type **buckets;
+    unsigned int num_buckets;
+    Type **interned;
+    unsigned int num_interned;
+    unsigned int interned_capacity;
+
+    // Memoised polytypes, chained by hash like the closed types
+    TypeMemo *memos;
+    unsigned int num_memos;
+    unsigned int memos_capacity;
+    unsigned int *memo_buckets;  // Index of the newest entry plus one
+    unsigned int num_memo_buckets;
+};
+
+InferContext *new_infer_context(void) {
+    InferContext *ctx = calloc(1, sizeof(InferContext));
+    if (ctx == NULL) {
+        fprintf(stderr, "Fatal: failed to allocate inference context.\n");
+        exit(1);
+    }
+    return ctx;
+}
 
-void enter_level() { current_level++; }
-void exit_level() { current_level--; }
+void free_infer_context(InferContext *ctx) {
+    TypeChunk *chunk = ctx->first_chunk;
+    while (chunk != NULL) {
+        TypeChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(ctx->buckets);
+    free(ctx->interned);
+    for (unsigned int i = 0; i < ctx->num_memos; i++) {
+        free_polytype(ctx->memos[i].polytype);
+    }
+    free(ctx->memos);
+    free(ctx->memo_buckets);
+    free(ctx);
+}
 
-typevar_id new_typevar_id() { return ++current_typevar; }
+void enter_level(InferContext *ctx) { ctx->current_level++; }
+void exit_level(InferContext *ctx) { ctx->current_level--; }
+
+typevar_id new_typevar_id(InferContext *ctx) { return ++ctx->current_typevar; }
+
+static Type unit_type = {TYPE_UNIT, true, {NULL}};
+static Type int_type = {TYPE_INT, true, {NULL}};
+static Type bool_type = {TYPE_BOOL, true, {NULL}};
+
+Type *type_unit(void) { return &unit_type; }
+Type *type_int(void) { return &int_type; }
+Type *type_bool(void) { return &bool_type; }
+
+static void *arena_alloc(InferContext *ctx, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    if (ctx->current_chunk == NULL ||
+        ctx->chunk_used + size > ctx->current_chunk->size) {
+        TypeChunk *next = ctx->current_chunk == NULL
+                              ? ctx->first_chunk
+                              : ctx->current_chunk->next;
+        if (next == NULL || next->size < size) {
+            size_t chunk_size = size > CHUNK_SIZE ? size : CHUNK_SIZE;
+            TypeChunk *chunk = malloc(sizeof(TypeChunk) + chunk_size);
+            if (chunk == NULL) {
+                fprintf(stderr, "Fatal: failed to allocate type arena.\n");
+                exit(1);
+            }
+            chunk->size = chunk_size;
+            chunk->next = next;
+            if (ctx->current_chunk == NULL) {
+                ctx->first_chunk = chunk;
+            } else {
+                ctx->current_chunk->next = chunk;
+            }
+            next = chunk;
+        }
+        ctx->current_chunk = next;
+        ctx->chunk_used = 0;
+    }
+    void *p = ctx->current_chunk->data + ctx->chunk_used;
+    ctx->chunk_used += size;
+    return p;
+}
 
-Type *new_typevar() {
-    Type *type = (Type *)malloc(sizeof(
-        Type));  // create wrapper for error checking in case of failed malloc
-    type->kind = TYPE_VAR;
-    type->data.var = (TypeVar *)malloc(sizeof(TypeVar));
-    type->data.var->kind = UNBOUND;
-    type->data.var->data.free.id = new_typevar_id();
-    type->data.var->data.free.level = current_level;
-    return type;
+TypeMark type_arena_mark(InferContext *ctx) {
+    return (TypeMark){ctx->current_chunk, ctx->chunk_used, ctx->num_interned,
+                      ctx->num_memos};
+}
+
+static unsigned int bucket_of(InferContext *ctx, Type *param, Type *result) {
+    uintptr_t h = (uintptr_t)param * 31 + (uintptr_t)result;
+    h ^= h >> 17;
+    return (unsigned int)(h * 0x9E3779B1u) & (ctx->num_buckets - 1);
+}
+
+void type_arena_release(InferContext *ctx, TypeMark mark) {
+    // Types made last are at the front of their bucket
+    while (ctx->num_interned > mark.interned) {
+        Type *t = ctx->interned[--ctx->num_interned];
+        unsigned int b =
+            bucket_of(ctx, t->data.function.param, t->data.function.result);
+        ctx->buckets[b] = t->data.function.chain;
+    }
+    while (ctx->num_memos > mark.memos) {
+        TypeMemo *memo = &ctx->memos[--ctx->num_memos];
+        ctx->memo_buckets[memo->hash & (ctx->num_memo_buckets - 1)] =
+            memo->next;
+        free_polytype(memo->polytype);
+    }
+    ctx->current_chunk = mark.chunk;
+    ctx->chunk_used = mark.used;
+}
+
+PolyType *type_memo_find(InferContext *ctx, unsigned int hash, const void *key,
+                         TypeMemoEqual equal, const void **found) {
+    if (ctx->num_memo_buckets == 0) {
+        return NULL;
+    }
+    unsigned int i = ctx->memo_buckets[hash & (ctx->num_memo_buckets - 1)];
+    while (i != 0) {
+        TypeMemo *memo = &ctx->memos[i - 1];
+        if (memo->hash == hash && equal(memo->key, key)) {
+            *found = memo->key;
+            return memo->polytype;
+        }
+        i = memo->next;
+    }
+    return NULL;
+}
+
+void type_memo_add(InferContext *ctx, unsigned int hash, const void *key,
+                   PolyType *polytype) {
+    if (ctx->num_memos == ctx->memos_capacity) {
+        ctx->memos_capacity =
+            ctx->memos_capacity == 0 ? 64 : ctx->memos_capacity * 2;
+        ctx->memos =
+            realloc(ctx->memos, ctx->memos_capacity * sizeof(TypeMemo));
+        if (ctx->memos == NULL) {
+            fprintf(stderr, "Fatal: failed to grow type memo.\n");
+            exit(1);
+        }
+    }
+    if (ctx->num_memos >= ctx->num_memo_buckets) {
+        // Rebuild oldest first, so the newest entry stays at the front of
+        // its bucket for a release
+        free(ctx->memo_buckets);
+        ctx->num_memo_buckets =
+            ctx->num_memo_buckets == 0 ? 64 : ctx->num_memo_buckets * 2;
+        ctx->memo_buckets = calloc(ctx->num_memo_buckets, sizeof(unsigned int));
+        if (ctx->memo_buckets == NULL) {
+            fprintf(stderr, "Fatal: failed to grow type memo.\n");
+            exit(1);
+        }
+        for (unsigned int i = 0; i < ctx->num_memos; i++) {
+            TypeMemo *memo = &ctx->memos[i];
+            unsigned int b = memo->hash & (ctx->num_memo_buckets - 1);
+            memo->next = ctx->memo_buckets[b];
+            ctx->memo_buckets[b] = i + 1;
+        }
+    }
+    unsigned int b = hash & (ctx->num_memo_buckets - 1);
+    ctx->memos[ctx->num_memos] =
+        (TypeMemo){hash, key, polytype, ctx->memo_buckets[b]};
+    ctx->memo_buckets[b] = ++ctx->num_memos;
+}
+
+static void grow_buckets(InferContext *ctx) {
+    free(ctx->buckets);
+    ctx->num_buckets = ctx->num_buckets == 0 ? 256 : ctx->num_buckets * 2;
+    ctx->buckets = calloc(ctx->num_buckets, sizeof(Type *));
+    if (ctx->buckets == NULL) {
+        fprintf(stderr, "Fatal: failed to grow type table.\n");
+        exit(1);
+    }
+    // Oldest first, keeping every bucket in order of creation
+    for (unsigned int i = 0; i < ctx->num_interned; i++) {
+        Type *t = ctx->interned[i];
+        unsigned int b =
+            bucket_of(ctx, t->data.function.param, t->data.function.result);
+        t->data.function.chain = ctx->buckets[b];
+        ctx->buckets[b] = t;
+    }
 }
 
-Type *new_MT_type(int kind) {
-    Type *type = (Type *)malloc(sizeof(Type));
-    type->kind = kind;
+// The one node for param -> result, both closed
+static Type *intern_function(InferContext *ctx, Type *param,
+                             Type *result) {
+    if (ctx->num_buckets > 0) {
+        for (Type *t = ctx->buckets[bucket_of(ctx, param, result)]; t != NULL;
+             t = t->data.function.chain) {
+            if (t->data.function.param == param &&
+                t->data.function.result == result) {
+                return t;
+            }
+        }
+    }
+
+    if (ctx->num_interned == ctx->interned_capacity) {
+        ctx->interned_capacity =
+            ctx->interned_capacity == 0 ? 256 : ctx->interned_capacity * 2;
+        ctx->interned =
+            realloc(ctx->interned, ctx->interned_capacity * sizeof(Type *));
+        if (ctx->interned == NULL) {
+            fprintf(stderr, "Fatal: failed to grow type table.\n");
+            exit(1);
+        }
+    }
+    Type *type = arena_alloc(ctx, sizeof(Type));
+    type->kind = TYPE_FUNCTION;
+    type->closed = true;
+    type->data.function.param = param;
+    type->data.function.result = result;
+    ctx->interned[ctx->num_interned++] = type;
+    if (ctx->num_interned > ctx->num_buckets) {
+        grow_buckets(ctx);
+    } else {
+        unsigned int b = bucket_of(ctx, param, result);
+        type->data.function.chain = ctx->buckets[b];
+        ctx->buckets[b] = type;
+    }
     return type;
 }
 
-Type *type_function(Type *param, Type *result) {
-    Type *type = (Type *)malloc(sizeof(Type));
+// A type variable and its wrapper in one allocation
+typedef struct {
+    Type type;
+    TypeVar var;
+} TypeVarNode;
+
+Type *new_typevar(InferContext *ctx) {
+    TypeVarNode *node = arena_alloc(ctx, sizeof(TypeVarNode));
+    node->type.kind = TYPE_VAR;
+    node->type.closed = false;
+    node->type.data.var = &node->var;
+    node->var.kind = UNBOUND;
+    node->var.data.free.id = new_typevar_id(ctx);
+    node->var.data.free.level = ctx->current_level;
+    node->var.data.free.rank = 0;
+    node->var.data.free.stamp = 0;
+    node->var.data.free.index = 0;
+    return &node->type;
+}
+
+Type *type_function(InferContext *ctx, Type *param, Type *result) {
+    // Bound variables never change, so their representatives can stand in
+    param = find_type(param);
+    result = find_type(result);
+    if (param->closed && result->closed) {
+        return intern_function(ctx, param, result);
+    }
+    Type *type = arena_alloc(ctx, sizeof(Type));
     type->kind = TYPE_FUNCTION;
+    type->closed = false;
     type->data.function.param = param;
     type->data.function.result = result;
+    type->data.function.chain = NULL;
     return type;
 }
 
-TypeVar *make_typevar(typevar_id id, level level) {
-    TypeVar *var = (TypeVar *)malloc(sizeof(TypeVar));
+TypeVar *make_typevar(InferContext *ctx, typevar_id id, level level) {
+    TypeVar *var = arena_alloc(ctx, sizeof(TypeVar));
     var->kind = UNBOUND;
     var->data.free.id = id;
     var->data.free.level = level;
+    var->data.free.rank = 0;
+    var->data.free.stamp = 0;
+    var->data.free.index = 0;
     return var;
 }
 
+// Types a walk has still to visit. Most types are shallow, so the first
+// few are kept in the walk's own array and only deeper ones on the heap.
+typedef struct {
+    Type **items;
+    unsigned int size;
+    unsigned int capacity;
+    Type *local[32];
+} TypeStack;
+
+static void init_type_stack(TypeStack *stack) {
+    stack->items = stack->local;
+    stack->size = 0;
+    stack->capacity = 32;
+}
+
+static void push_type(TypeStack *stack, Type *type) {
+    if (stack->size == stack->capacity) {
+        stack->capacity *= 2;
+        Type **items = stack->items == stack->local
+                           ? malloc(stack->capacity * sizeof(Type *))
+                           : realloc(stack->items,
+                                     stack->capacity * sizeof(Type *));
+        if (items == NULL) {
+            fprintf(stderr, "Fatal: failed to grow the type stack.\n");
+            exit(1);
+        }
+        if (stack->items == stack->local) {
+            memcpy(items, stack->local, sizeof(stack->local));
+        }
+        stack->items = items;
+    }
+    stack->items[stack->size++] = type;
+}
+
+static void free_type_stack(TypeStack *stack) {
+    if (stack->items != stack->local) {
+        free(stack->items);
+    }
+}
+
+// A function type a walk is inside of, with its children walked so far and
+// what the walk made of the parameter
+typedef struct {
+    Type *type;
+    unsigned int state;
+    bool is_function_param;  // For printing
+    union {
+        Type *type;
+        unsigned int shape;
+    } param;
+} TypeFrame;
+
+typedef struct {
+    TypeFrame *frames;
+    unsigned int size;
+    unsigned int capacity;
+} TypeFrames;
+
+static TypeFrame *push_type_frame(TypeFrames *stack, Type *type,
+                                  bool is_function_param) {
+    if (stack->size == stack->capacity) {
+        stack->capacity = stack->capacity == 0 ? 32 : stack->capacity * 2;
+        stack->frames =
+            realloc(stack->frames, stack->capacity * sizeof(TypeFrame));
+        if (stack->frames == NULL) {
+            fprintf(stderr, "Fatal: failed to grow the type stack.\n");
+            exit(1);
+        }
+    }
+    TypeFrame *frame = &stack->frames[stack->size++];
+    *frame = (TypeFrame){type, 0, is_function_param, {NULL}};
+    return frame;
+}
+
+// Follow bound variables to the representative, then point every variable
+// on the way straight at it so the next lookup takes one step
+Type *find_type(Type *type) {
+    Type *root = type;
+    while (root->kind == TYPE_VAR && root->data.var->kind == BOUND) {
+        root = root->data.var->data.type;
+    }
+    while (type != root) {
+        Type *next = type->data.var->data.type;
+        type->data.var->data.type = root;
+        type = next;
+    }
+    return root;
+}
+
 // Check if type variable occurs in a type (occurs check)
 bool occurs(typevar_id id, level lvl, Type *type) {
-    switch (type->kind) {
-        case TYPE_INT:
-        case TYPE_BOOL:
-        case TYPE_UNIT:
-            return false;
-        case TYPE_VAR:
-            if (type->data.var->kind == BOUND) {
-                return occurs(id, lvl, type->data.var->data.type);
-            } else {
-                // Unbound type variable
+    TypeStack stack;
+    init_type_stack(&stack);
+    push_type(&stack, type);
+    bool found = false;
+    while (!found && stack.size > 0) {
+        type = find_type(stack.items[--stack.size]);
+        if (type->closed) {
+            continue;
+        }
+        switch (type->kind) {
+            case TYPE_INT:
+            case TYPE_BOOL:
+            case TYPE_UNIT:
+                break;
+            case TYPE_VAR:
                 if (type->data.var->data.free.id == id) {
-                    return true;
+                    found = true;
+                    break;
                 }
                 // Update the level to the minimum of the two
                 if (type->data.var->data.free.level > lvl) {
                     type->data.var->data.free.level = lvl;
                 }
-                return false;
-            }
+                break;
 
-        case TYPE_FUNCTION:
-            return occurs(id, lvl, type->data.function.param) ||
-                   occurs(id, lvl, type->data.function.result);
+            case TYPE_FUNCTION:
+                // The parameter is visited first
+                push_type(&stack, type->data.function.result);
+                push_type(&stack, type->data.function.param);
+                break;
+        }
     }
-    // Should never reach here
-    return false;
+    free_type_stack(&stack);
+    return found;
 }
 
-// Unification algorithm
-void unify(Type *t1, Type *t2) {
-    // First check if types are already bound
-    if (t1->kind == TYPE_VAR && t1->data.var->kind == BOUND) {
-        unify(t1->data.var->data.type, t2);
-        return;
+// Bind the unbound variable var to the representative type
+static UnifyResult bind_typevar(Type *var, Type *type) {
+    typevar_id id = var->data.var->data.free.id;
+    level lvl = var->data.var->data.free.level;
+    if (occurs(id, lvl, type)) {
+        return UNIFY_RECURSIVE;
     }
+    var->data.var->kind = BOUND;
+    var->data.var->data.type = type;
+    return UNIFY_OK;
+}
 
-    if (t2->kind == TYPE_VAR && t2->data.var->kind == BOUND) {
-        unify(t1, t2->data.var->data.type);
-        return;
+// Merge two unbound variables by rank, keeping the smaller level so that
+// neither gets generalized too early
+static void union_typevars(Type *a, Type *b) {
+    if (a->data.var->data.free.rank < b->data.var->data.free.rank) {
+        Type *tmp = a;
+        a = b;
+        b = tmp;
+    }
+    if (a->data.var->data.free.rank == b->data.var->data.free.rank) {
+        a->data.var->data.free.rank++;
     }
+    if (b->data.var->data.free.level < a->data.var->data.free.level) {
+        a->data.var->data.free.level = b->data.var->data.free.level;
+    }
+    b->data.var->kind = BOUND;
+    b->data.var->data.type = a;
+}
 
-    // Main unification logic
-    if (t1->kind == TYPE_INT && t2->kind == TYPE_INT)
-        return;
-    else if (t1->kind == TYPE_BOOL && t2->kind == TYPE_BOOL)
-        return;
-    else if (t1->kind == TYPE_UNIT && t2->kind == TYPE_UNIT)
-        return;
-    else if (t1->kind == TYPE_VAR && t2->kind == TYPE_VAR &&
-             t1->data.var->kind == UNBOUND && t2->data.var->kind == UNBOUND &&
-             t1->data.var->data.free.id == t2->data.var->data.free.id) {
-        return;  // Same type variable, already unified
-    } else if (t1->kind == TYPE_VAR && t1->data.var->kind == UNBOUND) {
-        // Check occurs
-        typevar_id id = t1->data.var->data.free.id;
-        level lvl = t1->data.var->data.free.level;
-        if (occurs(id, lvl, t2)) {
-            fprintf(stderr, "Type error: recursive type detected\n");
-            exit(1);
+// Unification algorithm. The pairs of types still to unify are kept on a
+// stack, two entries each, parameters before results.
+UnifyResult unify(InferContext *ctx, Type *t1, Type *t2) {
+    (void)ctx;
+    TypeStack stack;
+    init_type_stack(&stack);
+    push_type(&stack, t1);
+    push_type(&stack, t2);
+    UnifyResult result = UNIFY_OK;
+    while (result == UNIFY_OK && stack.size > 0) {
+        t2 = find_type(stack.items[--stack.size]);
+        t1 = find_type(stack.items[--stack.size]);
+        if (t1 == t2) {
+            continue;  // Same type variable or closed type
         }
-        // Bind t1 to t2
-        t1->data.var->kind = BOUND;
-        t1->data.var->data.type = t2;
-    } else if (t2->kind == TYPE_VAR && t2->data.var->kind == UNBOUND) {
-        // Check occurs
-        typevar_id id = t2->data.var->data.free.id;
-        level lvl = t2->data.var->data.free.level;
-        if (occurs(id, lvl, t1)) {
-            fprintf(stderr, "Type error: recursive type detected\n");
-            exit(1);
+
+        if (t1->kind == TYPE_VAR && t2->kind == TYPE_VAR) {
+            union_typevars(t1, t2);
+        } else if (t1->kind == TYPE_VAR) {
+            result = bind_typevar(t1, t2);
+        } else if (t2->kind == TYPE_VAR) {
+            result = bind_typevar(t2, t1);
+        } else if (t1->closed && t2->closed) {
+            // Equal closed types are the same node
+            result = UNIFY_MISMATCH;
+        } else if (t1->kind == TYPE_FUNCTION && t2->kind == TYPE_FUNCTION) {
+            // Both are function types, unify parameter and result
+            push_type(&stack, t1->data.function.result);
+            push_type(&stack, t2->data.function.result);
+            push_type(&stack, t1->data.function.param);
+            push_type(&stack, t2->data.function.param);
+        } else if (t1->kind != t2->kind) {
+            result = UNIFY_MISMATCH;
         }
-        // Bind t2 to t1
-        t2->data.var->kind = BOUND;
-        t2->data.var->data.type = t1;
-    } else if (t1->kind == TYPE_FUNCTION && t2->kind == TYPE_FUNCTION) {
-        // Both are function types, unify parameter and result
-        unify(t1->data.function.param, t2->data.function.param);
-        unify(t1->data.function.result, t2->data.function.result);
-    } else {
-        fprintf(stderr, "Type error: cannot unify types\n");
-        exit(1);
     }
+    free_type_stack(&stack);
+    return result;
 }
-void collect_typevars(Type *t, TVList *tvs, unsigned int *count) {
-    switch (t->kind) {
-        case TYPE_INT:
-        case TYPE_BOOL:
-        case TYPE_UNIT:
-            break;
-        case TYPE_VAR:
-            if (t->data.var->kind == BOUND) {
-                collect_typevars(t->data.var->data.type, tvs, count);
-            } else {
-                // Check if level is deeper than current level
-                if (t->data.var->data.free.level > current_level) {
-                    // Check if already in list
-                    bool found = false;
-                    TVList *cur = tvs;
-                    while (cur != NULL) {
-                        if (cur->id == t->data.var->data.free.id) {
-                            found = true;
-                            break;
-                        }
-                        cur = cur->next;
-                    }
 
-                    if (!found) {
-                        // Add to list
-                        TVList *new_tv = (TVList *)malloc(sizeof(TVList));
-                        new_tv->id = t->data.var->data.free.id;
-                        new_tv->next = tvs;
-                        tvs = new_tv;
-                        (*count)++;
+typedef struct {
+    Type **vars;
+    unsigned int count;
+    unsigned int capacity;
+} TypeVarArray;
+
+static void collect_typevars(InferContext *ctx, Type *t, TypeVarArray *tvs) {
+    TypeStack stack;
+    init_type_stack(&stack);
+    push_type(&stack, t);
+    while (stack.size > 0) {
+        t = find_type(stack.items[--stack.size]);
+        if (t->closed) {
+            continue;
+        }
+        switch (t->kind) {
+            case TYPE_INT:
+            case TYPE_BOOL:
+            case TYPE_UNIT:
+                break;
+            case TYPE_VAR: {
+                // Only variables made deeper than the current level are free
+                // to generalize
+                TypeVar *var = t->data.var;
+                if (var->data.free.level <= ctx->current_level ||
+                    var->data.free.stamp == ctx->visit_stamp) {
+                    break;
+                }
+                var->data.free.stamp = ctx->visit_stamp;
+                if (tvs->count == tvs->capacity) {
+                    tvs->capacity = tvs->capacity == 0 ? 8 : tvs->capacity * 2;
+                    tvs->vars =
+                        realloc(tvs->vars, tvs->capacity * sizeof(Type *));
+                    if (tvs->vars == NULL) {
+                        fprintf(stderr,
+                                "Fatal: failed to grow type variables.\n");
+                        exit(1);
                     }
                 }
+                tvs->vars[tvs->count++] = t;
+                break;
             }
-            break;
 
-        case TYPE_FUNCTION:
-            collect_typevars(t->data.function.param, tvs, count);
-            collect_typevars(t->data.function.result, tvs, count);
-            break;
+            case TYPE_FUNCTION:
+                // In the order they are printed
+                push_type(&stack, t->data.function.result);
+                push_type(&stack, t->data.function.param);
+                break;
+        }
     }
+    free_type_stack(&stack);
 }
 
-// Generalize a type to a polymorphic type
-PolyType *generalize(Type *type) {
-    TVList *tvs = NULL;
-    unsigned int count = 0;
-    // Collect type variables
-    collect_typevars(type, tvs, &count);
-
-    // Create polytype
+PolyType *quantify(Type *type, Type **typevars, unsigned int n) {
     PolyType *polytype = (PolyType *)malloc(sizeof(PolyType));
-    polytype->num_typevars = count;
+    polytype->num_typevars = n;
+    polytype->typevars = typevars;
     polytype->type = type;
-
-    if (count > 0) {
-        // Fill typevar array from the list
-        polytype->typevars = (typevar_id *)malloc(sizeof(typevar_id) * count);
-        TVList *cur = tvs;
-        for (unsigned int i = 0; i < count; i++) {
-            polytype->typevars[i] = cur->id;
-            TVList *tmp = cur;
-            cur = cur->next;
-            free(tmp);
-        }
-    } else {
-        polytype->typevars = NULL;
+    for (unsigned int i = 0; i < n; i++) {
+        typevars[i]->data.var->data.free.index = i;
     }
-
     return polytype;
 }
 
+// Generalize a type to a polymorphic type
+PolyType *generalize(InferContext *ctx, Type *type) {
+    TypeVarArray tvs = {NULL, 0, 0};
+    ctx->visit_stamp++;
+    collect_typevars(ctx, type, &tvs);
+    return quantify(type, tvs.vars, tvs.count);
+}
+
 // Create a non-generalized polytype (for lambda parameters)
 PolyType *dont_generalize(Type *type) {
     PolyType *polytype = (PolyType *)malloc(sizeof(PolyType));
@@ -211,118 +584,133 @@ PolyType *dont_generalize(Type *type) {
     return polytype;
 }
 
-Type *instantiate_type(Type *t, TVMap *map) {
+// t with the variables of polytype replaced by those in fresh, when t has
+// nothing to walk into; NULL for a function type that may hold some
+static Type *instantiate_leaf(Type *t, PolyType *polytype, Type **fresh) {
+    if (t->closed) {
+        return t;
+    }
     switch (t->kind) {
         case TYPE_UNIT:
         case TYPE_INT:
         case TYPE_BOOL:
-            return new_MT_type(t->kind);
-        case TYPE_VAR:
-            if (t->data.var->kind == BOUND) {
-                return instantiate_type(t->data.var->data.type, map);
-            } else {
-                // Check if this type variable is in the map
-                TVMap *cur = map;
-                while (cur != NULL) {
-                    if (cur->id == t->data.var->data.free.id) {
-                        return cur->type;
-                    }
-                    cur = cur->next;
-                }
-
-                // Not in map, create a copy
-                Type *new_t = (Type *)malloc(sizeof(Type));
-                new_t->kind = TYPE_VAR;
-                new_t->data.var = (TypeVar *)malloc(sizeof(TypeVar));
-                new_t->data.var->kind = UNBOUND;
-                new_t->data.var->data.free.id = t->data.var->data.free.id;
-                new_t->data.var->data.free.level = t->data.var->data.free.level;
-                return new_t;
+            return t;
+        case TYPE_VAR: {
+            // Variables that are not quantified must stay the same, or what
+            // is learnt about one would not reach the other
+            unsigned int i = t->data.var->data.free.index;
+            if (i < polytype->num_typevars && polytype->typevars[i] == t) {
+                return fresh[i];
             }
-
+            return t;
+        }
         case TYPE_FUNCTION:
-            return type_function(
-                instantiate_type(t->data.function.param, map),
-                instantiate_type(t->data.function.result, map));
-        default:
-            fprintf(stderr, "001 Not implemented");
+            break;
     }
     return NULL;
 }
 
-// Instantiate a polymorphic type into a monomorphic type
-Type *instantiate(PolyType *polytype) {
-    // Create a mapping from the generalized type variables to new types
-
-    TVMap *map = NULL;
-
-    // Create new type variables for each generalized type variable
-    for (unsigned int i = 0; i < polytype->num_typevars; i++) {
-        TVMap *entry = (TVMap *)malloc(sizeof(TVMap));
-        entry->id = polytype->typevars[i];
-        entry->type = new_typevar();
-        entry->next = map;
-        map = entry;
+// Copy t with the variables of polytype replaced by those in fresh. Parts
+// without any of them are returned as they are rather than copied.
+static Type *instantiate_type(InferContext *ctx, Type *t, PolyType *polytype,
+                              Type **fresh) {
+    Type *copy = instantiate_leaf(find_type(t), polytype, fresh);
+    if (copy != NULL) {
+        return copy;
+    }
+    TypeFrames stack = {NULL, 0, 0};
+    push_type_frame(&stack, find_type(t), false);
+    while (stack.size > 0) {
+        TypeFrame *frame = &stack.frames[stack.size - 1];
+        Type *fn = frame->type;
+        Type *child = NULL;
+        if (frame->state == 0) {
+            child = fn->data.function.param;
+        } else if (frame->state == 1) {
+            frame->param.type = copy;
+            child = fn->data.function.result;
+        } else {
+            // copy is that of the result
+            stack.size--;
+            if (frame->param.type != fn->data.function.param ||
+                copy != fn->data.function.result) {
+                copy = type_function(ctx, frame->param.type, copy);
+            } else {
+                copy = fn;
+            }
+            continue;
+        }
+        frame->state++;
+        child = find_type(child);
+        copy = instantiate_leaf(child, polytype, fresh);
+        if (copy == NULL) {
+            push_type_frame(&stack, child, false);
+        }
     }
-    // Instantiate the type
-    Type *result = instantiate_type(polytype->type, map);
+    free(stack.frames);
+    return copy;
+}
 
-    // Free the map
-    while (map != NULL) {
-        TVMap *tmp = map;
-        map = map->next;
-        free(tmp);
+// Instantiate a polymorphic type into a monomorphic type
+Type *instantiate(InferContext *ctx, PolyType *polytype) {
+    unsigned int n = polytype->num_typevars;
+    if (n == 0) {
+        return polytype->type;
     }
 
+    // Fresh variables by index of the ones they replace
+    Type *local[16];
+    Type **fresh = n <= 16 ? local : malloc(n * sizeof(Type *));
+    for (unsigned int i = 0; i < n; i++) {
+        fresh[i] = new_typevar(ctx);
+    }
+    Type *result = instantiate_type(ctx, polytype->type, polytype, fresh);
+    if (fresh != local) {
+        free(fresh);
+    }
     return result;
 }
 
 // Environment operations
-TypeEnv *extend_type_env(char *name, PolyType *type, TypeEnv *env) {
-    TypeEnv *new_env = (TypeEnv *)malloc(sizeof(TypeEnv));
-    new_env->name = strdup(name);
-    new_env->type = type;
-    new_env->next = env;
-    return new_env;
-}
-
-PolyType *lookup_type_env(char *name, TypeEnv *env) {
-    while (env != NULL) {
-        if (strcmp(env->name, name) == 0) {
-            return env->type;
+TypeEnv *new_type_env(void) { return calloc(1, sizeof(TypeEnv)); }
+
+void push_type_env(TypeEnv *env, Symbol name, PolyType *type) {
+    if (name >= env->num_symbols) {
+        unsigned int n = env->num_symbols == 0 ? 64 : env->num_symbols;
+        while (n <= name) n *= 2;
+        env->types = realloc(env->types, n * sizeof(PolyType *));
+        if (env->types == NULL) {
+            fprintf(stderr, "Fatal: failed to grow type environment.\n");
+            exit(1);
         }
-        env = env->next;
+        memset(env->types + env->num_symbols, 0,
+               (n - env->num_symbols) * sizeof(PolyType *));
+        env->num_symbols = n;
     }
-    return NULL;
+    if (env->depth == env->capacity) {
+        env->capacity = env->capacity == 0 ? 64 : env->capacity * 2;
+        env->scopes = realloc(env->scopes, env->capacity * sizeof(TypeBinding));
+        if (env->scopes == NULL) {
+            fprintf(stderr, "Fatal: failed to grow type environment.\n");
+            exit(1);
+        }
+    }
+    env->scopes[env->depth++] = (TypeBinding){name, env->types[name]};
+    env->types[name] = type;
 }
 
-// Memory management
-void free_type(Type *type) {
-    if (type == NULL) return;
-
-    switch (type->kind) {
-        case TYPE_UNIT:
-        case TYPE_INT:
-        case TYPE_BOOL:
-            break;
-
-        case TYPE_VAR:
-            if (type->data.var->kind == BOUND) {
-                // Don't free the bound type here to avoid cycles
-                // It will be freed elsewhere
-            }
-            free(type->data.var);
-            break;
-
-        case TYPE_FUNCTION:
-            free_type(type->data.function.param);
-            free_type(type->data.function.result);
-            break;
-    }
+PolyType *pop_type_env(TypeEnv *env) {
+    TypeBinding binding = env->scopes[--env->depth];
+    PolyType *type = env->types[binding.name];
+    env->types[binding.name] = binding.shadowed;
+    return type;
+}
 
-    free(type);
+PolyType *lookup_type_env(Symbol name, TypeEnv *env) {
+    return name < env->num_symbols ? env->types[name] : NULL;
 }
 
+// Memory management
 void free_polytype(PolyType *polytype) {
     if (polytype == NULL) return;
 
@@ -336,92 +724,294 @@ void free_polytype(PolyType *polytype) {
 }
 
 void free_type_env(TypeEnv *env) {
-    while (env != NULL) {
-        TypeEnv *next = env->next;
-        free(env->name);
-        free_polytype(env->type);
-        free(env);
-        env = next;
+    while (env->depth > 0) {
+        free_polytype(pop_type_env(env));
+    }
+    free(env->types);
+    free(env->scopes);
+    free(env);
+}
+
+// Printing. Unification and instantiation can make one subtree of a type
+// appear exponentially many times in the tree it stands for, whether as one
+// shared node or as equal copies. Subtrees are grouped into shapes by
+// structure, and large shapes that occur more than once are printed once,
+// after the type, and referred to by name: "t1 -> t1 where t1 = ...".
+
+// Shared shapes shorter than this are printed in place
+#define ABBREVIATE_MIN 40
+
+// A class of structurally equal subtrees
+typedef struct {
+    Type *type;         // One of them
+    unsigned int uses;  // Occurrences as a child of other shapes
+    unsigned int name;  // Variable or abbreviation number plus one, or 0
+    size_t length;      // Printed in place, saturating at SIZE_MAX
+} Shape;
+
+// Entry of the printer's table, mapping a type node (key, 0) or a function
+// shape (param shape, result shape + 1) to a shape index plus one
+typedef struct {
+    uint64_t a;
+    uint64_t b;
+    unsigned int shape;
+} ShapeKey;
+
+typedef struct {
+    Shape *shapes;
+    unsigned int num_shapes;
+    unsigned int shapes_capacity;
+    ShapeKey *table;
+    unsigned int table_size;
+    unsigned int table_used;
+    unsigned int num_vars;
+    unsigned int *abbreviations;  // Shape indices, in the order named
+    unsigned int num_abbreviations;
+    char *out;
+    size_t out_length;
+    size_t out_capacity;
+} Printer;
+
+static ShapeKey *printer_slot(Printer *p, uint64_t a, uint64_t b) {
+    uint64_t h = (a ^ (b * 0xff51afd7ed558ccdu)) * 0x9e3779b97f4a7c15u;
+    unsigned int mask = p->table_size - 1;
+    unsigned int i = (unsigned int)(h >> 32) & mask;
+    while (p->table[i].shape != 0 &&
+           (p->table[i].a != a || p->table[i].b != b)) {
+        i = (i + 1) & mask;
     }
+    return &p->table[i];
+}
+
+// Shape recorded under key, or UINT_MAX
+static unsigned int printer_find(Printer *p, uint64_t a, uint64_t b) {
+    ShapeKey *slot = printer_slot(p, a, b);
+    return slot->shape == 0 ? UINT_MAX : slot->shape - 1;
 }
 
-char *get_var_name(typevar_id id, VarNameEntry *var_names, int *var_count) {
-    // Check if already in map
-    for (int i = 0; i < *var_count; i++) {
-        if (var_names[i].id == id) {
-            return var_names[i].name;
+static void printer_add(Printer *p, uint64_t a, uint64_t b,
+                        unsigned int shape) {
+    if (2 * (p->table_used + 1) > p->table_size) {
+        // Keep the table at most half full
+        ShapeKey *old = p->table;
+        unsigned int old_size = p->table_size;
+        p->table_size = old_size * 2;
+        p->table = calloc(p->table_size, sizeof(ShapeKey));
+        if (p->table == NULL) {
+            fprintf(stderr, "Fatal: failed to grow type printer.\n");
+            exit(1);
+        }
+        for (unsigned int i = 0; i < old_size; i++) {
+            if (old[i].shape != 0) {
+                *printer_slot(p, old[i].a, old[i].b) = old[i];
+            }
         }
+        free(old);
     }
+    *printer_slot(p, a, b) = (ShapeKey){a, b, shape + 1};
+    p->table_used++;
+}
 
-    // Create new name
-    char *name = (char *)malloc(10);
-    sprintf(name, "'%c", 'a' + *var_count);
+static unsigned int new_shape(Printer *p, Type *type, size_t length) {
+    if (p->num_shapes == p->shapes_capacity) {
+        p->shapes_capacity =
+            p->shapes_capacity == 0 ? 16 : p->shapes_capacity * 2;
+        p->shapes = realloc(p->shapes, p->shapes_capacity * sizeof(Shape));
+        if (p->shapes == NULL) {
+            fprintf(stderr, "Fatal: failed to grow type printer.\n");
+            exit(1);
+        }
+    }
+    p->shapes[p->num_shapes] = (Shape){type, 0, 0, length};
+    return p->num_shapes++;
+}
 
-    // Add to map
-    var_names[*var_count].id = id;
-    var_names[*var_count].name = name;
-    (*var_count)++;
-    return name;
+static size_t add_lengths(size_t a, size_t b) {
+    return a > SIZE_MAX - b ? SIZE_MAX : a + b;
 }
-// Helper: should we add parentheses around this type in a function context?
-bool needs_parens(Type *t) {
-    if (t->kind == TYPE_FUNCTION) {
-        return true;
+
+// Shape of a node that needs no walking into: one measured already, or a
+// variable or ground type. UINT_MAX for a function type not yet measured.
+static unsigned int measure_leaf(Printer *p, Type *type) {
+    uint64_t node = (uint64_t)(uintptr_t)type;
+    unsigned int shape = printer_find(p, node, 0);
+    if (shape == UINT_MAX && type->kind != TYPE_FUNCTION) {
+        // Names of ground types and variables, roughly
+        shape = new_shape(p, type, 4);
+        printer_add(p, node, 0, shape);
     }
-    if (t->kind == TYPE_VAR && t->data.var->kind == BOUND) {
-        return needs_parens(t->data.var->data.type);
+    return shape;
+}
+
+// Shape of type, measuring every node under it once
+static unsigned int measure(Printer *p, Type *type) {
+    type = find_type(type);
+    unsigned int shape = measure_leaf(p, type);
+    if (shape != UINT_MAX) {
+        return shape;
     }
-    return false;
+    TypeFrames stack = {NULL, 0, 0};
+    push_type_frame(&stack, type, false);
+    while (stack.size > 0) {
+        TypeFrame *frame = &stack.frames[stack.size - 1];
+        type = frame->type;
+        Type *child = NULL;
+        if (frame->state == 0) {
+            child = type->data.function.param;
+        } else if (frame->state == 1) {
+            frame->param.shape = shape;
+            child = type->data.function.result;
+        } else {
+            // shape is that of the result
+            stack.size--;
+            unsigned int param = frame->param.shape;
+            unsigned int result = shape;
+            shape = printer_find(p, param, (uint64_t)result + 1);
+            if (shape == UINT_MAX) {
+                size_t length = add_lengths(p->shapes[param].length,
+                                            p->shapes[result].length);
+                shape = new_shape(p, type, add_lengths(length, 6));
+                printer_add(p, param, (uint64_t)result + 1, shape);
+                p->shapes[param].uses++;
+                p->shapes[result].uses++;
+            }
+            printer_add(p, (uint64_t)(uintptr_t)type, 0, shape);
+            continue;
+        }
+        frame->state++;
+        child = find_type(child);
+        shape = measure_leaf(p, child);
+        if (shape == UINT_MAX) {
+            push_type_frame(&stack, child, false);
+        }
+    }
+    free(stack.frames);
+    return shape;
 }
 
-char *type_to_string_rec(Type *t, bool is_function_param,
-                         VarNameEntry *var_names, int *var_count) {
-    char buffer[1024];
+static void emit(Printer *p, const char *s) {
+    size_t n = strlen(s);
+    if (p->out_length + n + 1 > p->out_capacity) {
+        while (p->out_length + n + 1 > p->out_capacity) {
+            p->out_capacity = p->out_capacity == 0 ? 64 : p->out_capacity * 2;
+        }
+        p->out = realloc(p->out, p->out_capacity);
+        if (p->out == NULL) {
+            fprintf(stderr, "Fatal: failed to grow type string.\n");
+            exit(1);
+        }
+    }
+    memcpy(p->out + p->out_length, s, n + 1);
+    p->out_length += n;
+}
 
-    switch (t->kind) {
+// Print a type that is not a function type in place, or the name of an
+// abbreviated one. Returns false for a function type to print in place.
+static bool print_leaf(Printer *p, Type *type) {
+    char name[32];
+    switch (type->kind) {
         case TYPE_UNIT:
-            return strdup("unit");
+            emit(p, "unit");
+            return true;
         case TYPE_INT:
-            return strdup("int");
+            emit(p, "int");
+            return true;
         case TYPE_BOOL:
-            return strdup("bool");
-
-        case TYPE_VAR:
-            if (t->data.var->kind == BOUND) {
-                return type_to_string_rec(t->data.var->data.type,
-                                          is_function_param, var_names,
-                                          var_count);
+            emit(p, "bool");
+            return true;
+
+        case TYPE_VAR: {
+            // Variables are named in the order they are printed
+            Shape *shape =
+                &p->shapes[printer_find(p, (uint64_t)(uintptr_t)type, 0)];
+            if (shape->name == 0) {
+                shape->name = ++p->num_vars;
+            }
+            unsigned int n = shape->name - 1;
+            if (n < 26) {
+                sprintf(name, "'%c", 'a' + n);
             } else {
-                return strdup(get_var_name(t->data.var->data.free.id, var_names,
-                                           var_count));
+                sprintf(name, "'%c%u", 'a' + n % 26, n / 26);
             }
+            emit(p, name);
+            return true;
+        }
 
         case TYPE_FUNCTION: {
-            char *param_str = type_to_string_rec(t->data.function.param, true,
-                                                 var_names, var_count);
-            char *result_str = type_to_string_rec(t->data.function.result,
-                                                  false, var_names, var_count);
-
-            if (needs_parens(t->data.function.param) && is_function_param) {
-                sprintf(buffer, "(%s) -> %s", param_str, result_str);
-            } else {
-                sprintf(buffer, "%s -> %s", param_str, result_str);
+            unsigned int i = printer_find(p, (uint64_t)(uintptr_t)type, 0);
+            Shape *shape = &p->shapes[i];
+            if (shape->uses < 2 || shape->length < ABBREVIATE_MIN) {
+                return false;
             }
+            if (shape->name == 0) {
+                p->abbreviations[p->num_abbreviations] = i;
+                shape->name = ++p->num_abbreviations;
+            }
+            sprintf(name, "t%u", shape->name);
+            emit(p, name);
+            return true;
+        }
+    }
+    return true;
+}
 
-            free(param_str);
-            free(result_str);
-            return strdup(buffer);
+// Print type in place, even when it is an abbreviated function type, with
+// whatever is under it abbreviated as needed
+static void print_type(Printer *p, Type *type) {
+    type = find_type(type);
+    if (type->kind != TYPE_FUNCTION) {
+        print_leaf(p, type);
+        return;
+    }
+    TypeFrames stack = {NULL, 0, 0};
+    push_type_frame(&stack, type, false);
+    while (stack.size > 0) {
+        TypeFrame *frame = &stack.frames[stack.size - 1];
+        Type *child;
+        bool is_function_param;
+        if (frame->state == 0) {
+            // A function type as a parameter needs parentheses
+            if (frame->is_function_param) emit(p, "(");
+            child = frame->type->data.function.param;
+            is_function_param = true;
+        } else if (frame->state == 1) {
+            emit(p, " -> ");
+            child = frame->type->data.function.result;
+            is_function_param = false;
+        } else {
+            if (frame->is_function_param) emit(p, ")");
+            stack.size--;
+            continue;
+        }
+        frame->state++;
+        child = find_type(child);
+        if (!print_leaf(p, child)) {
+            push_type_frame(&stack, child, is_function_param);
         }
     }
-    return strdup("unknown");
+    free(stack.frames);
 }
 
 char *type_to_string(Type *type) {
-    VarNameEntry var_names[256];
-    int var_count = 0;
-    char *result = type_to_string_rec(type, false, var_names, &var_count);
-    for (int i = 0; i < var_count; i++) {
-        free(var_names[i].name);
+    Printer p = {0};
+    p.table_size = 64;
+    p.table = calloc(p.table_size, sizeof(ShapeKey));
+    measure(&p, type);
+    p.abbreviations = malloc(p.num_shapes * sizeof(unsigned int));
+
+    // The type itself is never abbreviated
+    print_type(&p, type);
+
+    // Abbreviated shapes can name further ones
+    for (unsigned int i = 0; i < p.num_abbreviations; i++) {
+        char name[32];
+        sprintf(name, i == 0 ? " where t%u = " : ", t%u = ", i + 1);
+        emit(&p, name);
+        print_type(&p, p.shapes[p.abbreviations[i]].type);
     }
-    return result;
+
+    free(p.shapes);
+    free(p.table);
+    free(p.abbreviations);
+    return p.out;
 }
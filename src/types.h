@@ -4,17 +4,22 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "symbol.h"
+
 // Type variable ID and level for generalization
 typedef int typevar_id;
 typedef int level;
 
 // Forward declarations
+typedef struct InferContext InferContext;
 typedef struct Type Type;
 typedef struct TypeVar TypeVar;
 typedef struct TypeEnv TypeEnv;
 typedef struct PolyType PolyType;
 
-// Type variable structure
+// Type variables form a union-find forest: a bound variable links to the
+// type it was unified with, and the unbound variable or other type at the
+// end of the chain represents them all (see find_type())
 struct TypeVar {
     enum { BOUND, UNBOUND } kind;
     union {
@@ -22,13 +27,20 @@ struct TypeVar {
         struct {
             typevar_id id;
             level level;
+            unsigned int rank;  // Bound on the height of the tree under it
+            unsigned int stamp;  // Last generalization that visited it
+            unsigned int index;  // Position in the polytype quantifying it
         } free;  // For UNBOUND
     } data;
 };
 
-// Type structure
+// Type structure. Closed types, those without type variables, never change
+// and are shared: int, bool and unit are singletons and closed function types
+// are hash-consed, so two closed types are equal exactly when they are the
+// same node.
 struct Type {
     enum { TYPE_UNIT, TYPE_INT, TYPE_BOOL, TYPE_VAR, TYPE_FUNCTION } kind;
+    bool closed;
 
     union {
         TypeVar *var;  // For TYPE_VAR
@@ -37,58 +49,100 @@ struct Type {
         struct {
             Type *param;
             Type *result;
+            Type *chain;  // Next closed type in the same hash bucket
         } function;  // For TYPE_FUNCTION
     } data;
 };
 
-Type *new_MT_type(int kind);
+Type *type_unit(void);
+Type *type_int(void);
+Type *type_bool(void);
+
+// Every other type node is allocated from the arena of an inference context
+// (see below). type_arena_mark()
+// records how much of it is in use, and type_arena_release() frees all the
+// types allocated since in one go, keeping the memory for the next ones.
+typedef struct {
+    struct TypeChunk *chunk;
+    size_t used;
+    unsigned int interned;
+    unsigned int memos;
+} TypeMark;
+
+TypeMark type_arena_mark(InferContext *ctx);
+void type_arena_release(InferContext *ctx, TypeMark mark);
+
+// Polytypes remembered by the structure of what they were inferred for.
+// Keys with the same hash are told apart by equal. The context owns the
+// polytypes, and those added after a mark are dropped when the arena is
+// released to it, so a key has to live at least that long. On a hit,
+// found is set to the key the polytype was added with.
+typedef bool (*TypeMemoEqual)(const void *a, const void *b);
+PolyType *type_memo_find(InferContext *ctx, unsigned int hash, const void *key,
+                         TypeMemoEqual equal, const void **found);
+void type_memo_add(InferContext *ctx, unsigned int hash, const void *key,
+                   PolyType *polytype);
 
-// Polymorphic type (forall a1,...,an. T)
+// Polymorphic type (forall a1,...,an. T). Each quantified variable records
+// its index in typevars, so instantiation finds its replacement directly.
 struct PolyType {
     unsigned int num_typevars;
-    typevar_id *typevars;
+    Type **typevars;
     Type *type;
 };
 
-// Type environment for type inference
+// Type environment for type inference: the innermost binding of every
+// symbol, indexed by the symbol itself. Binders push a binding and pop it
+// when their scope ends, which puts back the one it shadowed.
+typedef struct {
+    Symbol name;
+    PolyType *shadowed;
+} TypeBinding;
+
 struct TypeEnv {
-    char *name;
-    PolyType *type;
-    TypeEnv *next;
+    PolyType **types;  // By symbol, NULL when unbound
+    unsigned int num_symbols;
+    TypeBinding *scopes;  // Pushed bindings, innermost last
+    unsigned int depth;
+    unsigned int capacity;
+    PolyType *if_type;  // Of the primitive if, which is only applied in full
 };
-// Collect all type variables that should be generalized
-typedef struct TVList {
-    typevar_id id;
-    struct TVList *next;
-} TVList;
-
-typedef struct TVMap {
-    typevar_id id;
-    Type *type;
-    struct TVMap *next;
-} TVMap;
-typedef struct {
-    typevar_id id;
-    char *name;
-} VarNameEntry;
 
-extern level current_level;
-extern typevar_id current_typevar;
+// State of a type checker: the current level, the next type variable id
+// and the arena its types live in. Contexts share nothing but the ground
+// type singletons, so separate ones can check programs on different threads
+// at the same time.
+InferContext *new_infer_context(void);
+void free_infer_context(InferContext *ctx);
 
-void enter_level();
-void exit_level();
-typevar_id new_typevar_id();
-Type *new_typevar();
-Type *type_function(Type *param, Type *result);
-TypeVar *make_typevar(typevar_id id, level level);
-PolyType *generalize(Type *type);
+void enter_level(InferContext *ctx);
+void exit_level(InferContext *ctx);
+typevar_id new_typevar_id(InferContext *ctx);
+Type *new_typevar(InferContext *ctx);
+Type *type_function(InferContext *ctx, Type *param, Type *result);
+TypeVar *make_typevar(InferContext *ctx, typevar_id id, level level);
+PolyType *generalize(InferContext *ctx, Type *type);
 PolyType *dont_generalize(Type *type);
-Type *instantiate(PolyType *polytype);
-void unify(Type *t1, Type *t2);
+// Quantify type over the n variables in typevars; the polytype keeps the
+// array
+PolyType *quantify(Type *type, Type **typevars, unsigned int n);
+Type *instantiate(InferContext *ctx, PolyType *polytype);
+// The representative of type, compressing the chain of bound variables
+// leading to it
+Type *find_type(Type *type);
+// Make t1 and t2 the same type. On failure they may be partly unified.
+typedef enum { UNIFY_OK, UNIFY_MISMATCH, UNIFY_RECURSIVE } UnifyResult;
+UnifyResult unify(InferContext *ctx, Type *t1, Type *t2);
 bool occurs(typevar_id id, level lvl, Type *type);
-TypeEnv *extend_type_env(char *name, PolyType *type, TypeEnv *env);
-PolyType *lookup_type_env(char *name, TypeEnv *env);
-void free_type(Type *type);
+TypeEnv *new_type_env(void);
+void push_type_env(TypeEnv *env, Symbol name, PolyType *type);
+// Undo the latest push, returning the polytype it bound
+PolyType *pop_type_env(TypeEnv *env);
+PolyType *lookup_type_env(Symbol name, TypeEnv *env);
 void free_polytype(PolyType *polytype);
 void free_type_env(TypeEnv *env);
+// Print a type, naming its variables 'a, 'b, ... in order. Large subtrees
+// reached more than once are printed once, after a "where", so the string
+// grows with the size of the type graph rather than of the tree it stands
+// for.
 char *type_to_string(Type *type);
@@ -0,0 +1,280 @@
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gc.h"
+#include "primitives.h"
+
+// Where to resume a caller once the callee returns
+typedef struct {
+    Code *code;
+    unsigned int pc;
+    unsigned int base;  // Index of slot 0 of the frame in the value stack
+    Closure *closure;
+} CallFrame;
+
+// Report an error in the instruction whose opcode is at ops[at]
+static _Noreturn void vm_error(Code *code, unsigned int at,
+                               const char *message) {
+    runtime_error(code->offsets[at], "%s", message);
+}
+
+static void *vm_grow(void *array, unsigned int *capacity, unsigned int needed,
+                     size_t size) {
+    while (*capacity < needed) {
+        *capacity *= 2;
+    }
+    void *p = realloc(array, *capacity * size);
+    if (p == NULL) {
+        fprintf(stderr, "Fatal: VM stack exhausted\n");
+        exit(1);
+    }
+    return p;
+}
+
+// What the collector needs to see of a running VM. The interpreter keeps
+// these in locals and copies them here before anything that can allocate,
+// and the stacks whenever they move, for vm_run() to free.
+typedef struct {
+    Value *stack;
+    unsigned int sp;
+    CallFrame *frames;
+    unsigned int num_frames;
+    Closure *closure;
+    Env *globals;
+} VmRoots;
+
+static void trace_vm(void *data) {
+    VmRoots *roots = data;
+    gc_mark_env(roots->globals);
+    for (unsigned int i = 0; i < roots->sp; i++) {
+        gc_mark_value(roots->stack[i]);
+    }
+    gc_mark_closure(roots->closure);
+    for (unsigned int i = 0; i < roots->num_frames; i++) {
+        gc_mark_closure(roots->frames[i].closure);
+    }
+}
+
+#define INITIAL_STACK 256
+#define INITIAL_FRAMES 64
+
+static Value run_vm(Program *program, VmRoots *roots) {
+    unsigned int stack_capacity = INITIAL_STACK;
+    unsigned int frames_capacity = INITIAL_FRAMES;
+    Value *stack = roots->stack;
+    CallFrame *frames = roots->frames;
+    Env *globals = roots->globals;
+    unsigned int num_frames = 0;
+
+    Code *code = program->codes[0];
+    unsigned int *ops = code->ops;
+    unsigned int pc = 0;
+    unsigned int base = 0;
+    unsigned int sp = 0;
+    Closure *closure = NULL;  // Running closure, NULL at top level
+    Value *gl = globals->slots;
+    Value *constants = program->constants;
+    Value result;
+
+    unsigned int saved_roots = gc_save_roots();
+    gc_push_tracer(trace_vm, roots);
+#define SYNC_ROOTS()                                                  \
+    (roots->sp = sp, roots->num_frames = num_frames,                  \
+     roots->closure = closure)
+
+    if (code->frame_size + code->max_stack > stack_capacity) {
+        stack = vm_grow(stack, &stack_capacity,
+                        code->frame_size + code->max_stack, sizeof(Value));
+        roots->stack = stack;
+    }
+    for (; sp < code->frame_size; sp++) {
+        stack[sp] = val_unit();
+    }
+
+    for (;;) {
+        switch ((OpCode)ops[pc++]) {
+            case OP_CONST:
+                stack[sp++] = constants[ops[pc++]];
+                break;
+            case OP_LOCAL:
+                stack[sp++] = stack[base + ops[pc++]];
+                break;
+            case OP_FREE:
+                stack[sp++] = closure->captured[ops[pc++]];
+                break;
+            case OP_GLOBAL:
+                stack[sp++] = gl[ops[pc++]];
+                break;
+            case OP_STORE:
+                stack[base + ops[pc++]] = stack[--sp];
+                break;
+
+            case OP_CLOSURE: {
+                Exp *lambda = program->codes[ops[pc++]]->lambda;
+                SYNC_ROOTS();
+                Closure *created = new_closure(lambda);
+                for (unsigned int i = 0; i < created->num_captured; i++) {
+                    VarRef ref = lambda->data.lambda.captures[i];
+                    created->captured[i] = ref.scope == VAR_LOCAL
+                                               ? stack[base + ref.index]
+                                               : closure->captured[ref.index];
+                }
+                stack[sp++] = val_closure(created);
+                break;
+            }
+
+            case OP_FIX: {
+                Value v = stack[sp - 1];
+                as_closure(v)->captured[ops[pc++]] = v;
+                break;
+            }
+
+            case OP_APPLY:
+            case OP_TAIL_APPLY: {
+                bool tail = ops[pc - 1] == OP_TAIL_APPLY;
+                Value arg = stack[--sp];
+                Value fn = stack[--sp];
+
+                if (value_type(fn) == VAL_PRIMITIVE) {
+                    SYNC_ROOTS();
+                    stack[sp++] =
+                        apply_primitive(fn, arg, code->offsets[pc - 1]);
+                    if (tail) {
+                        goto do_return;
+                    }
+                    break;
+                }
+                if (!is_closure(fn)) {
+                    vm_error(code, pc - 1, "cannot apply a non-function value");
+                }
+
+                Code *callee = as_closure(fn)->lambda->data.lambda.code;
+                if (callee == NULL) {
+                    vm_error(code, pc - 1,
+                             "cannot apply a closure with no bytecode");
+                }
+                if (tail) {
+                    // The new frame replaces the current one
+                    sp = base;
+                } else {
+                    if (num_frames == frames_capacity) {
+                        frames = vm_grow(frames, &frames_capacity,
+                                         num_frames + 1, sizeof(CallFrame));
+                        roots->frames = frames;
+                    }
+                    frames[num_frames++] = (CallFrame){code, pc, base, closure};
+                    base = sp;
+                }
+                unsigned int needed =
+                    base + callee->frame_size + callee->max_stack;
+                if (needed > stack_capacity) {
+                    stack = vm_grow(stack, &stack_capacity, needed,
+                                    sizeof(Value));
+                    roots->stack = stack;
+                }
+                stack[sp++] = arg;
+                for (unsigned int i = 1; i < callee->frame_size; i++) {
+                    stack[sp++] = val_unit();
+                }
+                code = callee;
+                ops = code->ops;
+                pc = 0;
+                closure = as_closure(fn);
+                break;
+            }
+
+            case OP_RETURN:
+            do_return:
+                result = stack[--sp];
+                if (num_frames == 0) {
+                    gc_restore_roots(saved_roots);
+                    return result;
+                }
+                sp = base;
+                num_frames--;
+                code = frames[num_frames].code;
+                ops = code->ops;
+                pc = frames[num_frames].pc;
+                base = frames[num_frames].base;
+                closure = frames[num_frames].closure;
+                stack[sp++] = result;
+                break;
+
+            case OP_JUMP:
+                pc = ops[pc];
+                break;
+            case OP_JUMP_IF_FALSE: {
+                Value cond = stack[--sp];
+                if (!is_bool(cond)) {
+                    vm_error(code, pc - 1, "if expects a boolean condition");
+                }
+                pc = as_bool(cond) ? pc + 1 : ops[pc];
+                break;
+            }
+
+            case OP_ADD: {
+                Value b = stack[--sp];
+                Value *a = &stack[sp - 1];
+                if (!is_int(*a) || !is_int(b)) {
+                    vm_error(code, pc - 1, "add expects two integers");
+                }
+                *a = val_int(as_int(*a) + as_int(b));
+                break;
+            }
+            case OP_SUBTRACT: {
+                Value b = stack[--sp];
+                Value *a = &stack[sp - 1];
+                if (!is_int(*a) || !is_int(b)) {
+                    vm_error(code, pc - 1, "subtract expects two integers");
+                }
+                *a = val_int(as_int(*a) - as_int(b));
+                break;
+            }
+            case OP_MULTIPLY: {
+                Value b = stack[--sp];
+                Value *a = &stack[sp - 1];
+                if (!is_int(*a) || !is_int(b)) {
+                    vm_error(code, pc - 1, "multiply expects two integers");
+                }
+                *a = val_int(as_int(*a) * as_int(b));
+                break;
+            }
+            case OP_EQUALS: {
+                Value b = stack[--sp];
+                stack[sp - 1] = prim_equals(stack[sp - 1], b);
+                break;
+            }
+            case OP_SUCC: {
+                Value *a = &stack[sp - 1];
+                if (!is_int(*a)) {
+                    vm_error(code, pc - 1, "succ expects an integer argument");
+                }
+                *a = val_int(as_int(*a) + 1);
+                break;
+            }
+        }
+    }
+}
+
+Value vm_run(Program *program, Env *globals) {
+    // A runtime error unwinds past the interpreter, so frees its stacks on
+    // the way
+    VmRoots roots = {malloc(INITIAL_STACK * sizeof(Value)), 0,
+                     malloc(INITIAL_FRAMES * sizeof(CallFrame)), 0, NULL,
+                     globals};
+    RuntimeHandler handler;
+    push_runtime_handler(&handler);
+    if (setjmp(handler.jump) != 0) {
+        free(roots.stack);
+        free(roots.frames);
+        forward_runtime_error(&handler);
+    }
+    Value result = run_vm(program, &roots);
+    pop_runtime_handler(&handler);
+    free(roots.stack);
+    free(roots.frames);
+    return result;
+}
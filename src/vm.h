@@ -0,0 +1,8 @@
+#pragma once
+#include "compile.h"
+#include "lambda.h"
+
+// Run a compiled program. Locals and intermediate values live on a value
+// stack and calls push a small record on a separate call stack, so neither
+// grows the C stack.
+Value vm_run(Program *program, Env *globals);